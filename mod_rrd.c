@@ -65,6 +65,36 @@
  * Example call:
  *   curl "http://localhost/rrd/monitor.png?DEF:ifOutOctets=monitor*.rrd:ifOutOctets:AVERAGE&LINE1:ifOutOctets%2300ff00:Out+Octets"
  *
+ * A name ending in .heatmap.png renders a DEF as a heatmap instead, with
+ * one row per matching RRD file and one column per time bucket:
+ *   curl "http://localhost/rrd/monitor.heatmap.png?DEF:ifOutOctets=monitor*.rrd:ifOutOctets:AVERAGE&heatmap-sort=max"
+ *
+ * A name ending in .atlas.png draws every RRD file in the directory as a
+ * small tile of one image, with the tile offsets in .atlas.json:
+ *   curl "http://localhost/rrd/host1/browse.atlas.png?atlas-columns=6"
+ *   curl "http://localhost/rrd/host1/browse.atlas.json?atlas-columns=6"
+ *
+ * Adding with=info returns a JSON object holding the rrdgraph info of the
+ * render, such as print[N], value_min and graph_end, alongside the image
+ * encoded as base64, so that one render serves both:
+ *   curl "http://localhost/rrd/monitor.png?DEF:ifOutOctets=monitor*.rrd:ifOutOctets:AVERAGE&VDEF:m=ifOutOctets,MAXIMUM&PRINT:m:%25.0lf&with=info"
+ *
+ * Data exports of many files can be paged with limit, following the
+ * cursor in the Link header of each response to fetch the next page:
+ *   curl -i "http://localhost/rrd/monitor.json?DEF:ifOutOctets=monitor*.rrd:ifOutOctets:AVERAGE&LINE1:ifOutOctets%2300ff00:Out+Octets&limit=100"
+ *
+ * A POST of threshold rules, one per line, to a name ending in .check.json
+ * returns the status of each rule as JSON without rendering anything:
+ *   curl --data-binary "monitor*.rrd ifOutOctets AVERAGE 300 gt 1000000" "http://localhost/rrd/monitor.check.json"
+ *
+ * Rendered graphs can be cached with RRDGraphCache, and degraded in tiers
+ * with RRDGraphDegrade when renders queue up for librrd.
+ *
+ * With RRDGraphExplain on, a name ending in .explain.json returns the plan
+ * that would be rendered, the files matched and rejected by each DEF, the
+ * generated arguments and an estimated cost, without rendering anything:
+ *   curl "http://localhost/rrd/monitor.explain.json?DEF:ifOutOctets=monitor*.rrd:ifOutOctets:AVERAGE"
+ *
  * Notes:
  * - Write as a handler, not a filter (alas)
  * - Use rrd_graph_v() to return images in memory buffer
@@ -84,7 +114,13 @@
  *   need to build the DEF values ourselves.
  */
 
+/* dlmopen() and LM_ID_NEWLM are GNU extensions */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "apr.h"
+#include "apr_base64.h"
 #include "apr_escape.h"
 #include "apr_strings.h"
 #include "apr_buckets.h"
@@ -94,16 +130,28 @@
 #include "apr_tables.h"
 #include "apr_cstr.h"
 #include "apr_uuid.h"
+#include "apr_atomic.h"
+#include "apr_sha1.h"
+#include "apr_shm.h"
+#include "apr_global_mutex.h"
+#include "apr_thread_pool.h"
+#include "apr_signal.h"
 
 #include "ap_config.h"
 #include "ap_expr.h"
 #include "ap_mpm.h"
+#include "ap_listen.h"
+#include "mpm_common.h"
 #include "util_filter.h"
+#include "util_mutex.h"
 #include "httpd.h"
 #include "http_config.h"
 #include "http_log.h"
 #include "http_protocol.h"
 #include "http_request.h"
+#include "ap_provider.h"
+#include "mod_proxy.h"
+#include "mod_status.h"
 
 #undef PACKAGE_BUGREPORT
 #undef PACKAGE_NAME
@@ -115,25 +163,266 @@
 
 #include "rrd.h"
 
+#include <math.h>
+#include <zlib.h>
+
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #if HAVE_SYS_XATTR_H
 #include <sys/xattr.h>
 #endif
 
+#if HAVE_DLFCN_H
+#include <dlfcn.h>
+#endif
+
+#if HAVE_DLMOPEN
+#include <gnu/lib-names.h>
+#endif
+
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * A copy of librrd. The linked copy always comes first, and further
+ * copies are loaded into link namespaces of their own with dlmopen(),
+ * each with its own global state and so its own lock.
+ */
+typedef struct rrd_instance_t {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    rrd_info_t *(*graph_v)(int, char **);
+    rrd_info_t *(*info_r)(const char *);
+    void (*info_free)(rrd_info_t *);
+    char *(*get_error)(void);
+    void (*clear_error)(void);
+    void (*set_error)(char *, ...);
+    int (*fetch_r)(const char *, const char *, time_t *, time_t *,
+            unsigned long *, unsigned long *, char ***, rrd_value_t **);
+    char *(*parsetime)(const char *, rrd_time_value_t *);
+    int (*proc_start_end)(rrd_time_value_t *, rrd_time_value_t *, time_t *,
+            time_t *);
+    void (*freemem)(void *);
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+} rrd_instance_t;
+
+static rrd_instance_t *rrd_instances = NULL;
+static int rrd_instance_count = 0;
+
+#if APR_HAS_THREADS
+static volatile apr_uint32_t rrd_instance_next = 0;
+#endif
+
+/* set in the index process when it is asked to stop */
+static volatile sig_atomic_t rrd_index_stopping = 0;
+
+/* the heaviest graph specs, shared by all children */
+static struct rrd_hitter_t *rrd_sketch = NULL;
+static int rrd_sketch_count = 0;
+static int *rrd_sketch_heap = NULL;
+static int *rrd_sketch_index = NULL;
+static int rrd_sketch_buckets = 0;
+static apr_global_mutex_t *rrd_sketch_mutex = NULL;
+
+#if APR_HAS_THREADS
+/* background work that does not need librrd's graph lock */
+static apr_thread_pool_t *rrd_workers = NULL;
+#endif
+
+#if HAVE_ZSTD
+/* decompressed copies of cold archives held open by live requests */
+static apr_pool_t *rrd_cold_pool = NULL;
+static apr_hash_t *rrd_cold_pins = NULL;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *rrd_cold_mutex = NULL;
+#endif
+#endif
+
+#if APR_HAS_THREADS
+/* background renders of neighbouring windows not yet finished */
+static volatile apr_uint32_t rrd_prefetch_pending = 0;
+static volatile apr_uint32_t rrd_prefetch_rendering = 0;
+#endif
+
+/* kilobytes written to the graph caches since they were last trimmed */
+static volatile apr_uint32_t *rrd_cache_written = NULL;
+
+/* renders queued for a copy of librrd, and how long they waited */
+static volatile apr_uint32_t rrd_render_queue = 0;
+static volatile apr_uint32_t rrd_render_wait = 0;
+static volatile apr_uint32_t rrd_render_waited = 0;
+
+#if HAVE_RRD_FETCH_CB_REGISTER
+/* the request being rendered, per thread when renders run in parallel */
+static struct rrd_fetch_t *rrd_fetch_ctx = NULL;
 #if APR_HAS_THREADS
-static apr_thread_mutex_t *rrd_mutex = NULL;
+static apr_threadkey_t *rrd_fetch_key = NULL;
+#endif
 #endif
 
 module AP_MODULE_DECLARE_DATA rrd_module;
 
+#define RRD_INDEX_MAGIC "rrdidx02"
+#define RRD_INDEX_ORDER 0x01020304
+#define RRD_INDEX_NAME 20
+#define RRD_INDEX_HOURS 48
+#define RRD_INDEX_DAYS 35
+#define RRD_INDEX_INTERVAL 300
+
+/*
+ * glibc has 16 link namespaces: the linked copy lives in the base, and
+ * dlmopen() keeps the last one back, leaving 14 for further copies.
+ */
+#define RRD_INSTANCES_MAX 15
+#define RRD_CACHE_MAXAGE 60
+#define RRD_CACHE_SIZE 64
+#define RRD_PARTITION_MAX (86400 * 366)
+#define RRD_FANOUT 10
+#define RRD_WAIT_EXPIRY 10
+
+#define RRD_ATLAS_WIDTH 120
+#define RRD_ATLAS_HEIGHT 40
+#define RRD_ATLAS_COLUMNS 8
+#define RRD_IMAGE_SIDE 4096
+#define RRD_IMAGE_PIXELS (4 * 1024 * 1024)
+#define RRD_PNG_CHUNK (64 * 1024)
+
+#define RRD_WORKERS 4
+#define RRD_PREFETCH_MAX 16
+#define RRD_CHECK_BODY (1024 * 1024)
+
+#define RRD_SKETCH_MUTEX "rrd-sketch"
+#define RRD_SKETCH_SPEC 256
+#define RRD_COLD_SIZE 256
+#define RRD_LIBRARY "librrd.so.8"
+
+typedef struct rrd_server_conf {
+    apr_array_header_t *indexes;
+    const char *library;
+    const char *cold;
+    apr_off_t cold_size;
+    int instances;
+    int sketch;
+} rrd_server_conf;
+
+/*
+ * One graph spec in the space saving sketch. The weight is the render
+ * time in microseconds times the files matched, overestimated by at most
+ * the error. Renders and cache hits are counted apart, only renders
+ * carry weight.
+ */
+typedef struct rrd_hitter_t {
+    apr_uint64_t hash;
+    apr_uint64_t weight;
+    apr_uint64_t error;
+    apr_uint64_t busy;
+    apr_uint64_t hits;
+    apr_uint64_t cached;
+    apr_uint64_t files;
+    int heap;
+    char spec[RRD_SKETCH_SPEC];
+} rrd_hitter_t;
+
+typedef struct rrd_index_t {
+    const char *root;
+    const char *dir;
+    apr_interval_time_t interval;
+    apr_time_t next;
+} rrd_index_t;
+
+typedef struct rrd_indexer_t {
+    server_rec *s;
+    apr_pool_t *pool;
+    apr_array_header_t *indexes;
+    apr_proc_t proc;
+} rrd_indexer_t;
+
+typedef struct rrd_summary_t {
+    double min;
+    double max;
+    double avg;
+    double last;
+} rrd_summary_t;
+
+/*
+ * The sidecar starts with this header, and is native endian: the order
+ * is RRD_INDEX_ORDER as written, so sidecars shared with a host of the
+ * other endianness are ignored and rebuilt.
+ */
+typedef struct rrd_index_header_t {
+    char magic[8];
+    apr_uint32_t ds_cnt;
+    apr_uint32_t hours;
+    apr_uint32_t days;
+    apr_uint32_t order;
+    apr_int64_t hour_end;
+    apr_int64_t day_end;
+} rrd_index_header_t;
+
+/* followed by one of these for each data source */
+typedef struct rrd_index_ds_t {
+    char name[RRD_INDEX_NAME];
+    rrd_summary_t hours[RRD_INDEX_HOURS];
+    rrd_summary_t days[RRD_INDEX_DAYS];
+} rrd_index_ds_t;
+
+typedef enum rrd_tier_e {
+    RRD_TIER_NONE,
+    RRD_TIER_STALE,
+    RRD_TIER_FANOUT,
+    RRD_TIER_REDUCE,
+    RRD_TIER_REJECT,
+    RRD_TIER_COUNT
+} rrd_tier_e;
+
+static const char * const rrd_tiers[] = {
+    "none", "stale", "fanout", "reduce", "reject"
+};
+
+typedef enum rrd_cache_e {
+    RRD_CACHE_OFF,
+    RRD_CACHE_MISS,
+    RRD_CACHE_STALE,
+    RRD_CACHE_FRESH
+} rrd_cache_e;
+
+static const char * const rrd_caches[] = {
+    "off", "miss", "stale", "fresh"
+};
+
+typedef struct rrd_degrade_t {
+    int queue;
+    apr_interval_time_t wait;
+    unsigned int set:1;
+} rrd_degrade_t;
+
 typedef struct rrd_conf {
     const char *location;
     apr_array_header_t *options;
     apr_array_header_t *elements;
     apr_hash_t *env;
     const char *format;
+    apr_int64_t partition;
+    const char *cache;
+    apr_interval_time_t cache_maxage;
+    apr_off_t cache_size;
+    rrd_degrade_t degrade[RRD_TIER_COUNT];
+    int fanout;
+    int prefetch;
+    int explain;
     int graph;
     unsigned int location_set:1;
     unsigned int format_set:1;
+    unsigned int partition_set:1;
+    unsigned int cache_set:1;
+    unsigned int fanout_set:1;
+    unsigned int prefetch_set:1;
+    unsigned int explain_set:1;
     unsigned int graph_set:1;
 } rrd_conf;
 
@@ -158,6 +447,15 @@ typedef enum rrd_conf_e {
     RRD_CONF_TEXTALIGN
 } rrd_conf_e;
 
+typedef enum rrd_mode_e {
+    RRD_MODE_GRAPH,
+    RRD_MODE_HEATMAP,
+    RRD_MODE_ATLAS,
+    RRD_MODE_INDEX,
+    RRD_MODE_EXPLAIN,
+    RRD_MODE_CHECK
+} rrd_mode_e;
+
 typedef struct rrd_cmd_t rrd_cmd_t;
 
 typedef struct rrd_def_t {
@@ -169,6 +467,15 @@ typedef struct rrd_def_t {
     apr_array_header_t *requests;
     ap_expr_info_t *epath;
     ap_expr_info_t *edirpath;
+    apr_array_header_t *rejected;
+    apr_array_header_t *other;
+    const char *other_legend;
+    const char *pattern;
+    const char *base;
+    const char *colour;
+    rrd_cmd_t *alias;
+    int distribution;
+    int index;
 } rrd_def_t;
 
 typedef struct rrd_vdef_t {
@@ -244,6 +551,7 @@ typedef struct rrd_cmd_t {
     rrd_conf_e type;
     int num;
     rrd_cmd_t *def;
+    const char *element;
     union {
         rrd_def_t d;
         rrd_vdef_t v;
@@ -268,6 +576,11 @@ typedef struct rrd_cmds_t {
     apr_array_header_t *cmds;
     apr_array_header_t *opts;
     apr_hash_t *names;
+    apr_hash_t *defs;
+    apr_table_t *params;
+    const char *format;
+    apr_interval_time_t rendered;
+    int explain;
 } rrd_cmds_t;
 
 typedef struct rrd_cb_t {
@@ -275,6 +588,68 @@ typedef struct rrd_cb_t {
     rrd_cmd_t *cmd;
 } rrd_cb_t;
 
+typedef struct rrd_reject_t {
+    const char *filename;
+    int status;
+} rrd_reject_t;
+
+typedef struct rrd_fetch_t {
+    request_rec *r;
+    rrd_cmds_t *cmds;
+    rrd_instance_t *instance;
+} rrd_fetch_t;
+
+typedef struct rrd_series_t {
+    time_t start;
+    time_t end;
+    unsigned long step;
+    unsigned long rows;
+    rrd_value_t *data;
+} rrd_series_t;
+
+typedef struct rrd_row_t {
+    int index;
+    double summary;
+} rrd_row_t;
+
+typedef struct rrd_columns_t {
+    double min;
+    double max;
+    double sum;
+    double last;
+    int n;
+} rrd_columns_t;
+
+typedef struct rrd_check_t {
+    const char *filename;
+    const char *source;
+    const char *dsname;
+    const char *cf;
+    time_t start;
+    time_t end;
+    double value;
+    const char *err;
+} rrd_check_t;
+
+typedef struct rrd_threshold_t {
+    const char *line;
+    const char *path;
+    const char *window;
+    const char *op;
+    double threshold;
+    time_t start;
+    time_t end;
+    rrd_cmd_t *cmd;
+    rrd_check_t *checks;
+    const char *err;
+} rrd_threshold_t;
+
+typedef struct rrd_match_t {
+    request_rec *rr;
+    double indexed;
+    int order;
+} rrd_match_t;
+
 static char *substring_quote(apr_pool_t *p, const char *start, int len,
                             char quote)
 {
@@ -404,6 +779,63 @@ static const char *pescape_colon(apr_pool_t *p, const char *str)
     return str;
 }
 
+static const char *pescape_json(apr_pool_t *p, const char *str)
+{
+    apr_size_t len = 0;
+    const char *s;
+    char *d, *result;
+
+    for (s = str; *s; ++s) {
+        len += (*s == '"' || *s == '\\') ? 2 :
+                ((unsigned char)*s < 0x20) ? 6 : 1;
+    }
+
+    d = result = apr_palloc(p, len + 1);
+    for (s = str; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            *d++ = '\\';
+            *d++ = *s;
+        }
+        else if ((unsigned char)*s < 0x20) {
+            d += apr_snprintf(d, 7, "\\u%04x", (unsigned char)*s);
+        }
+        else {
+            *d++ = *s;
+        }
+    }
+    *d = '\0';
+
+    return result;
+}
+
+static const char *pjson_number(apr_pool_t *p, double val)
+{
+    /* JSON has no NaN or infinity */
+    if (isnan(val) || isinf(val)) {
+        return "null";
+    }
+    return apr_psprintf(p, "%.15g", val);
+}
+
+static const char *relative_path(request_rec *r, const char *filename)
+{
+    const char *last = strrchr(r->filename, '/');
+
+    /* paths are shown relative to the directory of the request */
+    if (last && !strncmp(filename, r->filename, last + 1 - r->filename)) {
+        return filename + (last + 1 - r->filename);
+    }
+    return filename;
+}
+
+static const char *source_filename(request_rec *rr)
+{
+    const char *cold = apr_table_get(rr->notes, "rrd-cold");
+
+    /* cold archives are read from their copy, but named as archives */
+    return cold ? cold : rr->filename;
+}
+
 static void log_message(request_rec *r, apr_status_t status,
         const char *message, const char *err)
 {
@@ -525,6 +957,14 @@ static const char *lookup_content_type(const char *format)
 	return NULL;
 }
 
+static int is_line_format(const char *format)
+{
+    /* formats with one header line followed by one line per row */
+    return format && (strcasecmp(format, "CSV") == 0
+            || strcasecmp(format, "TSV") == 0
+            || strcasecmp(format, "SSV") == 0);
+}
+
 static const char *parse_rrdgraph_suffix(request_rec *r)
 {
     const char *fname = ap_strrchr_c(r->filename, '/');
@@ -594,6 +1034,90 @@ static const char *parse_rrdgraph_suffix(request_rec *r)
     return NULL;
 }
 
+static rrd_mode_e parse_rrdgraph_mode(request_rec *r)
+{
+    const char *fname = r->filename ? ap_strrchr_c(r->filename, '/') : NULL;
+
+    if (fname) {
+        /* the mode is the suffix before the format, eg name.heatmap.png */
+        const char *suffix = ap_strrchr_c(fname, '.');
+        if (suffix) {
+            const char *mode = ap_strrchr_c(
+                    apr_pstrmemdup(r->pool, fname, suffix - fname), '.');
+            if (mode) {
+                switch (mode[1]) {
+                case 'a':
+                case 'A':
+                    if (strcasecmp(mode, ".atlas") == 0
+                            && (strcasecmp(suffix, ".png") == 0
+                                    || strcasecmp(suffix, ".json") == 0)) {
+                        return RRD_MODE_ATLAS;
+                    }
+                    break;
+                case 'c':
+                case 'C':
+                    if (strcasecmp(mode, ".check") == 0
+                            && strcasecmp(suffix, ".json") == 0) {
+                        return RRD_MODE_CHECK;
+                    }
+                    break;
+                case 'e':
+                case 'E':
+                    if (strcasecmp(mode, ".explain") == 0
+                            && strcasecmp(suffix, ".json") == 0) {
+                        return RRD_MODE_EXPLAIN;
+                    }
+                    break;
+                case 'h':
+                case 'H':
+                    if (strcasecmp(mode, ".heatmap") == 0
+                            && strcasecmp(suffix, ".png") == 0) {
+                        return RRD_MODE_HEATMAP;
+                    }
+                    break;
+                case 'i':
+                case 'I':
+                    if (strcasecmp(mode, ".index") == 0
+                            && strcasecmp(suffix, ".json") == 0) {
+                        return RRD_MODE_INDEX;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    return RRD_MODE_GRAPH;
+}
+
+static const char *parse_def_options(apr_pool_t *p, const char *cf,
+        rrd_def_t *d)
+{
+    apr_array_header_t *opts;
+    char *opt, *last;
+
+    if (!ap_strstr_c(cf, "distribution")) {
+        return cf;
+    }
+
+    /* pull out our own options, rrdgraph never sees these */
+    opts = apr_array_make(p, 4, sizeof(const char *));
+    for (opt = apr_strtok(apr_pstrdup(p, cf), ":", &last); opt;
+            opt = apr_strtok(NULL, ":", &last)) {
+        if (strcmp(opt, "distribution") == 0) {
+            d->distribution = 1;
+        }
+        else if (strncmp(opt, "distribution=", 13) == 0) {
+            d->distribution = 1;
+            d->colour = opt + 13 + (opt[13] == '#');
+        }
+        else {
+            APR_ARRAY_PUSH(opts, const char *) = opt;
+        }
+    }
+
+    return apr_array_pstrcat(p, opts, ':');
+}
+
 static int parse_element(apr_pool_t *p, const char *element, ap_expr_info_t *expr1,
 		ap_expr_info_t *expr2, apr_array_header_t *cmds)
 {
@@ -650,7 +1174,7 @@ static int parse_element(apr_pool_t *p, const char *element, ap_expr_info_t *exp
             cmd->d.vname = ap_getword(p, &element, '=');
             cmd->d.path = ap_getword(p, &element, ':');
             cmd->d.dsname = ap_getword(p, &element, ':');
-            cmd->d.cf = element;
+            cmd->d.cf = parse_def_options(p, element, &cmd->d);
             cmd->d.pool = p;
             cmd->d.requests = apr_array_make(p, 10, sizeof(request_rec *));
             cmd->d.epath = expr1;
@@ -806,6 +1330,16 @@ static int parse_option(apr_pool_t *p, const char *key, const char *val,
                 return 1;
             }
             break;
+        case 'e':
+            /* [-e|--end time] */
+            if (strcmp(key, "end") == 0) {
+                rrd_opt_t *opt = apr_array_push(opts);
+                opt->key = key;
+                opt->val = val;
+                opt->eval = eval;
+                return 1;
+            }
+            break;
         case 'f':
             /* [-n|--font FONTTAG:size:font] */
             if (strcmp(key, "font") == 0) {
@@ -897,6 +1431,14 @@ static int parse_option(apr_pool_t *p, const char *key, const char *val,
             }
             break;
         case 's':
+            /* [-s|--start time] */
+            if (strcmp(key, "start") == 0) {
+                rrd_opt_t *opt = apr_array_push(opts);
+                opt->key = key;
+                opt->val = val;
+                opt->eval = eval;
+                return 1;
+            }
             /* [-S|--step seconds] */
             if (strcmp(key, "step") == 0) {
                 rrd_opt_t *opt = apr_array_push(opts);
@@ -1120,6 +1662,99 @@ static int parse_option(apr_pool_t *p, const char *key, const char *val,
     return 0;
 }
 
+static int parse_param(apr_pool_t *p, const char *key, const char *val,
+        apr_table_t *params)
+{
+    /* parameters interpreted by mod_rrd itself, not passed to rrdgraph */
+    if (val) {
+        switch (key[0]) {
+        case 'a':
+            /* [atlas=vname] */
+            if (strcmp(key, "atlas") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            /* [atlas-columns=count] */
+            if (strcmp(key, "atlas-columns") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            /* [atlas-ds=dsname] */
+            if (strcmp(key, "atlas-ds") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            /* [atlas-cf={AVERAGE,MIN,MAX,LAST}] */
+            if (strcmp(key, "atlas-cf") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            break;
+        case 'c':
+            /* [cursor=offset.version] */
+            if (strcmp(key, "cursor") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            break;
+        case 'h':
+            /* [heatmap=vname] */
+            if (strcmp(key, "heatmap") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            /* [heatmap-sort={min,max,average,last}] */
+            if (strcmp(key, "heatmap-sort") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            break;
+        case 'i':
+            /* [index-stat={min,max,average,last}] */
+            if (strcmp(key, "index-stat") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            /* [index-window=seconds] */
+            if (strcmp(key, "index-window") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            /* [index-op={gt,ge,lt,le}] */
+            if (strcmp(key, "index-op") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            /* [index-value=number] */
+            if (strcmp(key, "index-value") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            /* [index-limit=count] */
+            if (strcmp(key, "index-limit") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            break;
+        case 'l':
+            /* [limit=count] */
+            if (strcmp(key, "limit") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            break;
+        case 'w':
+            /* [with=info] */
+            if (strcmp(key, "with") == 0) {
+                apr_table_setn(params, key, val);
+                return 1;
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
 static int parse_query(request_rec *r, rrd_cmds_t **pcmds)
 {
     rrd_conf *conf = ap_get_module_config(r->per_dir_config,
@@ -1130,6 +1765,8 @@ static int parse_query(request_rec *r, rrd_cmds_t **pcmds)
     int optnum = 0, cmdnum = 0;
 
     cmds->names = apr_hash_make(r->pool);
+    cmds->defs = apr_hash_make(r->pool);
+    cmds->params = apr_table_make(r->pool, 2);
 
     /* count the query string */
     args = apr_pstrdup(r->pool, r->args);
@@ -1152,8 +1789,9 @@ static int parse_query(request_rec *r, rrd_cmds_t **pcmds)
     /* parse the query string */
     args = apr_pstrdup(r->pool, r->args);
     while ((arg = apr_cstr_tokenize("&", &args))) {
-        const char *key, *val;
+        const char *key, *val, *text;
         char *element;
+        int nelts;
 
         if (!arg[0]) {
             continue;
@@ -1167,7 +1805,14 @@ static int parse_query(request_rec *r, rrd_cmds_t **pcmds)
             return HTTP_BAD_REQUEST;
         }
 
+        nelts = cmds->cmds->nelts;
+        text = apr_pstrdup(r->pool, element);
         if (parse_element(r->pool, element, NULL, NULL, cmds->cmds)) {
+            /* keep the element as given, it names the graph */
+            if (cmds->cmds->nelts > nelts) {
+                APR_ARRAY_IDX(cmds->cmds, cmds->cmds->nelts - 1,
+                        rrd_cmd_t).element = text;
+            }
             continue;
         }
 
@@ -1175,6 +1820,10 @@ static int parse_query(request_rec *r, rrd_cmds_t **pcmds)
         key = apr_cstr_tokenize("=", &element);
         val = element;
 
+        if (parse_param(r->pool, key, val, cmds->params)) {
+            continue;
+        }
+
         if (parse_option(r->pool, key, val, NULL, cmds->opts)) {
             continue;
         }
@@ -1189,572 +1838,1161 @@ static int parse_query(request_rec *r, rrd_cmds_t **pcmds)
     return OK;
 }
 
-static const char *resolve_def_cb(ap_dir_match_t *w, const char *fname)
+static int lru_compare(const void *a, const void *b)
 {
-    rrd_cb_t *ctx = w->ctx;
-    request_rec *rr;
-
-    rr = ap_sub_req_lookup_file(fname, ctx->r, NULL);
+    const apr_finfo_t *fa = a, *fb = b;
 
-    if (rr->status == HTTP_OK) {
-        APR_ARRAY_PUSH(ctx->cmd->d.requests, request_rec *) = rr;
-        ctx->cmd->num++;
+    /* the least recently used first */
+    if (fa->mtime != fb->mtime) {
+        return fa->mtime < fb->mtime ? -1 : 1;
     }
-    else {
-        ap_log_rerror(
-                APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, rr, "mod_rrd: Access to path returned %d, ignoring: %s",
-                rr->status, fname);
+    return 0;
+}
+
+#if HAVE_ZSTD
+/*
+ * Cold archives are RRD files compressed with zstd. Each is decompressed
+ * on first use into the RRDGraphCold directory, named after a hash of its
+ * path, and reused until the archive changes.
+ */
+static const char *cold_filename(apr_pool_t *p, const char *dir,
+        const char *fname)
+{
+    apr_sha1_ctx_t sha1;
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    char *hex;
+    int i;
+
+    apr_sha1_init(&sha1);
+    apr_sha1_update_binary(&sha1, (const unsigned char *)fname,
+            strlen(fname));
+    apr_sha1_final(digest, &sha1);
+
+    hex = apr_palloc(p, APR_SHA1_DIGESTSIZE * 2 + 1);
+    for (i = 0; i < APR_SHA1_DIGESTSIZE; ++i) {
+        apr_snprintf(hex + i * 2, 3, "%02x", digest[i]);
     }
 
-    return NULL;
+    return apr_pstrcat(p, dir, "/", hex, ".rrd", NULL);
 }
 
-static int resolve_def(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+static const char *cold_decompress(apr_pool_t *p, const char *from,
+        const char *to)
 {
-    ap_dir_match_t w;
-    rrd_cb_t ctx;
-    apr_pool_t *ptemp;
-    const char *last, *path, *dirpath = r->filename;
-    apr_hash_index_t *hi, *hi2;
-    apr_hash_t *set;
-
-    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
-            &rrd_module);
+    apr_file_t *in, *out;
+    ZSTD_DStream *zds;
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    apr_size_t isize = ZSTD_DStreamInSize(), osize = ZSTD_DStreamOutSize();
+    void *ibuf = apr_palloc(p, isize), *obuf = apr_palloc(p, osize);
+    char *tmp = apr_pstrcat(p, to, ".XXXXXX", NULL);
+    const char *err = NULL;
+    size_t ret = 1;
+    apr_status_t rv;
 
-    apr_pool_create(&ptemp, r->pool);
+    if ((rv = apr_file_open(&in, from, APR_FOPEN_READ | APR_FOPEN_BINARY,
+            APR_FPROT_OS_DEFAULT, p)) != APR_SUCCESS) {
+        return apr_psprintf(p, "Could not open: %pm", &rv);
+    }
 
-    /* process the wildcards */
-    ctx.r = r;
-    ctx.cmd = cmd;
+    /* written aside and renamed into place, readers never see a part */
+    if ((rv = apr_file_mktemp(&out, tmp, APR_FOPEN_CREATE | APR_FOPEN_WRITE
+            | APR_FOPEN_EXCL | APR_FOPEN_BINARY, p)) != APR_SUCCESS) {
+        apr_file_close(in);
+        return apr_psprintf(p, "Could not create '%s': %pm", tmp, &rv);
+    }
 
-    w.prefix = "rrd path: ";
-    w.p = r->pool;
-    w.ptemp = ptemp;
-    w.flags = AP_DIR_FLAG_OPTIONAL | AP_DIR_FLAG_RECURSIVE;
-    w.cb = resolve_def_cb;
-    w.ctx = &ctx;
-    w.depth = 0;
+    /* the copy is as private as the archive is behind its access checks */
+    apr_file_perms_set(tmp, APR_FPROT_UREAD | APR_FPROT_UWRITE);
 
-    path = cmd->d.path;
-    if (cmd->d.epath) {
-        const char *err = NULL;
-        path = ap_expr_str_exec(r, cmd->d.epath, &err);
-        if (err) {
-            log_message(r, APR_SUCCESS,
-                apr_psprintf(r->pool,
-                        "While evaluating an element expression: %s", err), NULL);
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
+    zds = ZSTD_createDStream();
+    if (!zds) {
+        err = "Could not create the zstd stream";
     }
+    else if (ZSTD_isError(ret = ZSTD_initDStream(zds))) {
+        err = apr_psprintf(p, "Could not start the zstd stream: %s",
+                ZSTD_getErrorName(ret));
+    }
+    ret = 1;
 
-    if (cmd->d.edirpath) {
-        const char *err = NULL;
-        dirpath = ap_expr_str_exec(r, cmd->d.edirpath, &err);
-        if (err) {
-            log_message(r, APR_SUCCESS,
-                apr_psprintf(r->pool,
-                        "While evaluating an element expression: %s", err), NULL);
-            return HTTP_INTERNAL_SERVER_ERROR;
+    while (!err) {
+        apr_size_t len = isize;
+
+        rv = apr_file_read(in, ibuf, &len);
+        if (APR_EOF == rv) {
+            if (ret) {
+                err = "Archive is truncated";
+            }
+            break;
+        }
+        if (APR_SUCCESS != rv) {
+            err = apr_psprintf(p, "Could not read: %pm", &rv);
+            break;
+        }
+
+        input.src = ibuf;
+        input.size = len;
+        input.pos = 0;
+        while (!err && input.pos < input.size) {
+            output.dst = obuf;
+            output.size = osize;
+            output.pos = 0;
+
+            ret = ZSTD_decompressStream(zds, &output, &input);
+            if (ZSTD_isError(ret)) {
+                err = apr_psprintf(p, "Could not decompress: %s",
+                        ZSTD_getErrorName(ret));
+            }
+            else if ((rv = apr_file_write_full(out, obuf, output.pos, NULL))
+                    != APR_SUCCESS) {
+                err = apr_psprintf(p, "Could not write '%s': %pm", tmp, &rv);
+            }
         }
-    }
-    else {
-    	last = strrchr(r->filename, '/');
-    	if (last) {
-        	dirpath = apr_pstrndup(ptemp, r->filename, last - r->filename);
-    	}
     }
 
-    ap_log_rerror(
-            APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
-            "mod_rrd: Attempting to match wildcard RRD path '%s' against base '%s'",
-            path, dirpath);
+    ZSTD_freeDStream(zds);
+    apr_file_close(in);
 
-    const char *err = ap_dir_fnmatch(&w, dirpath, path);
+    if (APR_SUCCESS != (rv = apr_file_close(out)) && !err) {
+        err = apr_psprintf(p, "Could not write '%s': %pm", tmp, &rv);
+    }
+    if (!err && APR_SUCCESS != (rv = apr_file_rename(tmp, to, p))) {
+        err = apr_psprintf(p, "Could not rename '%s': %pm", tmp, &rv);
+    }
     if (err) {
-        log_message(r, APR_SUCCESS,
-            apr_psprintf(r->pool,
-                    "While parsing DEF path '%s': %s", path, err), NULL);
-        return HTTP_BAD_REQUEST;
+        apr_file_remove(tmp, p);
     }
 
-    /* process the environment lookup */
-    set = apr_hash_make(ptemp);
-    for (hi = apr_hash_first(NULL, conf->env); hi; hi = apr_hash_next(hi)) {
-        const char *err = NULL, *key, *val;
-        ap_expr_info_t *eval;
-        void *v;
-        const void *k;
-        int j;
+    return err;
+}
 
-        apr_hash_this(hi, &k, NULL, &v);
-        key = k;
-        eval = v;
+/*
+ * A copy in use is held open with a shared lock until the request that
+ * reads it ends. Record locks belong to the process and are lost when
+ * any descriptor on the file is closed, so each process opens a copy
+ * once and counts the requests holding it.
+ */
+typedef struct rrd_cold_pin_t {
+    apr_pool_t *pool;
+    apr_file_t *file;
+    const char *filename;
+    int refs;
+} rrd_cold_pin_t;
 
-        for (j = 0; j < cmd->d.requests->nelts; ++j) {
-            request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, j, request_rec *);
+static void cold_lock(void)
+{
+#if APR_HAS_THREADS
+    if (rrd_cold_mutex) {
+        apr_thread_mutex_lock(rrd_cold_mutex);
+    }
+#endif
+}
 
-            val = ap_expr_str_exec(rr, eval, &err);
-            if (err) {
-                log_message(r, APR_SUCCESS,
-                        apr_psprintf(r->pool,
-                                "While evaluating an element expression: %s", err), NULL);
-                return HTTP_INTERNAL_SERVER_ERROR;
-            }
-            if (val && val[0]) {
-                apr_hash_set(set, val, APR_HASH_KEY_STRING, val);
-            }
+static void cold_unlock(void)
+{
+#if APR_HAS_THREADS
+    if (rrd_cold_mutex) {
+        apr_thread_mutex_unlock(rrd_cold_mutex);
+    }
+#endif
+}
 
-        }
+static apr_status_t cold_unpin(void *data)
+{
+    rrd_cold_pin_t *pin = data;
 
-        if (apr_hash_count(set)) {
-            apr_array_header_t *arr = apr_array_make(ptemp, apr_hash_count(set), sizeof(const char *));
-            for (hi2 = apr_hash_first(NULL, set); hi2; hi2 = apr_hash_next(hi2)) {
-                apr_hash_this(hi2, apr_array_push(arr), NULL, NULL);
+    cold_lock();
+    if (!--pin->refs) {
+        apr_hash_set(rrd_cold_pins, pin->filename, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(pin->pool);
+    }
+    cold_unlock();
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Hold the copy until the main request ends. Returns APR_EAGAIN when the
+ * copy was evicted or replaced before the lock was granted.
+ */
+static apr_status_t cold_pin(request_rec *r, const char *cold)
+{
+    rrd_cold_pin_t *pin;
+    apr_finfo_t finfo, cinfo;
+    apr_status_t rv = APR_SUCCESS;
+
+    while (r->main) {
+        r = r->main;
+    }
+
+    cold_lock();
+
+    pin = apr_hash_get(rrd_cold_pins, cold, APR_HASH_KEY_STRING);
+    if (!pin) {
+        apr_pool_t *pool;
+
+        apr_pool_create(&pool, rrd_cold_pool);
+        pin = apr_pcalloc(pool, sizeof(rrd_cold_pin_t));
+        pin->pool = pool;
+        pin->filename = apr_pstrdup(pool, cold);
+
+        if ((rv = apr_file_open(&pin->file, cold, APR_FOPEN_READ
+                | APR_FOPEN_BINARY, APR_FPROT_OS_DEFAULT, pool))
+                    == APR_SUCCESS
+                && (rv = apr_file_lock(pin->file, APR_FLOCK_SHARED))
+                    == APR_SUCCESS
+                && (rv = apr_file_info_get(&finfo, APR_FINFO_IDENT,
+                    pin->file)) == APR_SUCCESS) {
+
+            /* an evicted copy was unlinked under us, decompress again */
+            if (apr_stat(&cinfo, cold, APR_FINFO_IDENT, pool) != APR_SUCCESS
+                    || cinfo.inode != finfo.inode
+                    || cinfo.device != finfo.device) {
+                rv = APR_EAGAIN;
             }
-            apr_table_setn(r->subprocess_env, key, apr_array_pstrcat(r->pool, arr, ','));
+        }
+        else if (APR_STATUS_IS_ENOENT(rv)) {
+            rv = APR_EAGAIN;
+        }
 
+        if (APR_SUCCESS != rv) {
+            apr_pool_destroy(pool);
+            cold_unlock();
+            return rv;
         }
-        apr_hash_clear(set);
+
+        apr_hash_set(rrd_cold_pins, pin->filename, APR_HASH_KEY_STRING, pin);
     }
 
-    apr_pool_destroy(ptemp);
+    pin->refs++;
 
-    cmd->def = cmd;
-    apr_hash_set(cmds->names, cmd->d.vname, APR_HASH_KEY_STRING, cmd);
+    cold_unlock();
 
-    return OK;
+    apr_pool_cleanup_register(r->pool, pin, cold_unpin,
+            apr_pool_cleanup_null);
+
+    return APR_SUCCESS;
 }
 
-static int resolve_vdef(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+/*
+ * Remove the least recently used copies until the directory fits its
+ * size again. Copies held by a request in this process are skipped, and
+ * those held by other processes refuse the exclusive lock.
+ */
+static void cold_evict(apr_pool_t *p, rrd_server_conf *sconf)
 {
-    cmd->v.ref = apr_hash_get(cmds->names, cmd->v.dsname, APR_HASH_KEY_STRING);
-    if (cmd->v.ref) {
-        cmd->def = cmd->v.ref->def;
-    }
+    apr_array_header_t *files = apr_array_make(p, 64, sizeof(apr_finfo_t));
+    apr_finfo_t dirent;
+    apr_dir_t *dir;
+    apr_off_t total = 0;
+    apr_status_t rv;
+    int i;
 
-    if (!cmd->v.ref) {
-        log_message(r, APR_SUCCESS,
-            apr_psprintf(r->pool,
-                    "While parsing VDEF '%s': '%s' was not found", cmd->v.vname, cmd->v.dsname), NULL);
-        return HTTP_BAD_REQUEST;
-    }
-    else {
-        cmd->num = cmd->v.ref->num;
+    if (apr_dir_open(&dir, sconf->cold, p) != APR_SUCCESS) {
+        return;
     }
 
-    apr_hash_set(cmds->names, cmd->v.vname, APR_HASH_KEY_STRING, cmd);
-    return OK;
-}
+    while ((rv = apr_dir_read(&dirent, APR_FINFO_NAME | APR_FINFO_TYPE
+            | APR_FINFO_SIZE | APR_FINFO_MTIME, dir)) == APR_SUCCESS
+            || rv == APR_INCOMPLETE) {
+        apr_size_t len;
 
-static int resolve_cdef(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
-{
-    int i;
+        /* copies in the making are left alone */
+        len = dirent.name ? strlen(dirent.name) : 0;
+        if (dirent.filetype != APR_REG || len < 4
+                || strcmp(dirent.name + len - 4, ".rrd")) {
+            continue;
+        }
 
-    for (i = 0; i < cmd->c.rpns->nelts; ++i) {
-        rrd_rpn_t *rp = &((rrd_rpn_t *) cmd->c.rpns->elts)[i];
+        dirent.fname = apr_pstrcat(p, sconf->cold, "/", dirent.name, NULL);
+        APR_ARRAY_PUSH(files, apr_finfo_t) = dirent;
+        total += dirent.size;
+    }
 
-        if (!cmd->c.ref) {
-            rrd_cmd_t *ref = apr_hash_get(cmds->names, rp->rpn,
-                    APR_HASH_KEY_STRING);
-            if (ref) {
-                cmd->c.ref = ref;
-                rp->def = cmd->def = ref->def;
+    apr_dir_close(dir);
+
+    if (total <= sconf->cold_size) {
+        return;
+    }
+
+    qsort(files->elts, files->nelts, sizeof(apr_finfo_t), lru_compare);
+
+    for (i = 0; i < files->nelts && total > sconf->cold_size; ++i) {
+        apr_finfo_t *finfo = &APR_ARRAY_IDX(files, i, apr_finfo_t);
+        apr_finfo_t finfo2, cinfo;
+        apr_file_t *file;
+
+        cold_lock();
+
+        if (!apr_hash_get(rrd_cold_pins, finfo->fname, APR_HASH_KEY_STRING)
+                && apr_file_open(&file, finfo->fname, APR_FOPEN_READ
+                    | APR_FOPEN_BINARY, APR_FPROT_OS_DEFAULT, p)
+                    == APR_SUCCESS) {
+
+            /* remove only what is still the copy we hold exclusively */
+            if (apr_file_lock(file, APR_FLOCK_EXCLUSIVE | APR_FLOCK_NONBLOCK)
+                        == APR_SUCCESS
+                    && apr_file_info_get(&finfo2, APR_FINFO_IDENT, file)
+                        == APR_SUCCESS
+                    && apr_stat(&cinfo, finfo->fname, APR_FINFO_IDENT, p)
+                        == APR_SUCCESS
+                    && cinfo.inode == finfo2.inode
+                    && cinfo.device == finfo2.device
+                    && apr_file_remove(finfo->fname, p) == APR_SUCCESS) {
+                total -= finfo->size;
             }
+
+            apr_file_close(file);
         }
 
+        cold_unlock();
     }
-    if (cmd->c.ref) {
-        cmd->num = cmd->c.ref->num;
-    }
-    apr_hash_set(cmds->names, cmd->c.vname, APR_HASH_KEY_STRING, cmd);
-    return OK;
 }
 
-static int resolve_area(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+static apr_status_t cold_evict_cleanup(void *data)
 {
-    rrd_cmd_t *ref;
+    server_rec *s = data;
+    rrd_server_conf *sconf = ap_get_module_config(s->module_config,
+            &rrd_module);
+    apr_pool_t *p;
 
-    ref = apr_hash_get(cmds->names, cmd->a.vname, APR_HASH_KEY_STRING);
-    if (ref) {
-        cmd->def = ref->def;
-    }
-    else {
-        log_message(r, APR_SUCCESS,
-            apr_psprintf(r->pool,
-                    "While parsing AREA: '%s' was not found", cmd->a.vname), NULL);
-        return HTTP_BAD_REQUEST;
+    /* the request pool is being cleaned up, work in a pool of our own */
+    if (apr_pool_create_unmanaged_ex(&p, NULL, NULL) == APR_SUCCESS) {
+        cold_evict(p, sconf);
+        apr_pool_destroy(p);
     }
 
-    return OK;
+    return APR_SUCCESS;
 }
 
-static int resolve_line(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+/*
+ * Decompress the copy of a cold archive if missing or older than the
+ * archive. A copy in use is touched, so that its mtime records when it
+ * was last read, and pinned until the request ends. The directory is
+ * trimmed once, after the request lets go of its copies.
+ */
+static const char *cold_resolve(request_rec *r, rrd_server_conf *sconf,
+        const char *fname, const char *cold)
 {
-    rrd_cmd_t *ref;
+    request_rec *m = r;
+    apr_finfo_t finfo, cinfo;
+    const char *err;
+    void *evict = NULL;
+    apr_status_t rv;
+    int attempt;
 
-    ref = apr_hash_get(cmds->names, cmd->l.vname, APR_HASH_KEY_STRING);
-    if (ref) {
-        cmd->def = ref->def;
+    while (m->main) {
+        m = m->main;
     }
-    else {
-        log_message(r, APR_SUCCESS,
-            apr_psprintf(r->pool,
-                    "While parsing LINE: '%s' was not found", cmd->l.vname), NULL);
-        return HTTP_BAD_REQUEST;
+
+    /* registered before any pin, so run after the pins are released */
+    apr_pool_userdata_get(&evict, "mod_rrd-cold-evict", m->pool);
+    if (!evict) {
+        apr_pool_userdata_setn(m, "mod_rrd-cold-evict", NULL, m->pool);
+        apr_pool_cleanup_register(m->pool, m->server, cold_evict_cleanup,
+                apr_pool_cleanup_null);
     }
 
-    return OK;
-}
+    if ((rv = apr_stat(&finfo, fname, APR_FINFO_MTIME, r->pool))
+            != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r,
+                "mod_rrd: Could not stat cold archive '%s'", fname);
+        return NULL;
+    }
 
-static int resolve_tick(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
-{
-    rrd_cmd_t *ref;
+    /* another child may evict the copy between decompressing and pinning */
+    for (attempt = 0; attempt < 2; attempt++) {
 
-    ref = apr_hash_get(cmds->names, cmd->t.vname, APR_HASH_KEY_STRING);
-    if (ref) {
-        cmd->def = ref->def;
-    }
-    else {
-        log_message(r, APR_SUCCESS,
-            apr_psprintf(r->pool,
-                    "While parsing TICK: '%s' was not found", cmd->t.vname), NULL);
-        return HTTP_BAD_REQUEST;
-    }
+        if (apr_stat(&cinfo, cold, APR_FINFO_MTIME, r->pool) == APR_SUCCESS
+                && cinfo.mtime >= finfo.mtime) {
+            apr_file_mtime_set(cold, apr_time_now(), r->pool);
+        }
+        else {
+            apr_dir_make_recursive(sconf->cold, APR_FPROT_UREAD
+                    | APR_FPROT_UWRITE | APR_FPROT_UEXECUTE, r->pool);
 
-    return OK;
-}
+            err = cold_decompress(r->pool, fname, cold);
+            if (err) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, r,
+                        "mod_rrd: Could not decompress cold archive '%s': %s",
+                        fname, err);
+                return NULL;
+            }
 
-static int resolve_shift(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
-{
-    rrd_cmd_t *ref;
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                    "mod_rrd: Decompressed cold archive '%s' to '%s'",
+                    fname, cold);
+        }
 
-    ref = apr_hash_get(cmds->names, cmd->s.vname, APR_HASH_KEY_STRING);
-    if (ref) {
-        cmd->def = ref->def;
-    }
-    else {
-        log_message(r, APR_SUCCESS,
-            apr_psprintf(r->pool,
-                    "While parsing SHIFT: '%s' was not found", cmd->s.vname), NULL);
-        return HTTP_BAD_REQUEST;
+        rv = cold_pin(r, cold);
+        if (APR_SUCCESS == rv) {
+            return cold;
+        }
+        if (!APR_STATUS_IS_EAGAIN(rv)) {
+            break;
+        }
     }
 
-    return OK;
+    ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r,
+            "mod_rrd: Could not hold the copy of cold archive '%s'", fname);
+
+    return NULL;
 }
 
-static int resolve_gprint(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+static int is_cold(const char *fname)
 {
-    rrd_cmd_t *ref;
+    apr_size_t len = strlen(fname);
 
-    ref = apr_hash_get(cmds->names, cmd->p.vname, APR_HASH_KEY_STRING);
-    if (ref) {
-        cmd->def = ref->def;
-    }
-    else {
-        log_message(r, APR_SUCCESS,
-            apr_psprintf(r->pool,
-                    "While parsing GPRINT: '%s' was not found", cmd->p.vname), NULL);
-        return HTTP_BAD_REQUEST;
-    }
-
-    return OK;
+    return len > 4 && strcmp(fname + len - 4, ".zst") == 0;
 }
+#endif
 
-static int resolve_print(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+/*
+ * The file to read a match from, decompressing a cold archive just
+ * before it is read. A copy that could not be made is logged, and fails
+ * to be read like any other missing file.
+ */
+static const char *cold_source(request_rec *r, request_rec *rr)
 {
-    rrd_cmd_t *ref;
+#if HAVE_ZSTD
+    const char *cold = apr_table_get(rr->notes, "rrd-cold");
 
-    ref = apr_hash_get(cmds->names, cmd->p.vname, APR_HASH_KEY_STRING);
-    if (ref) {
-        cmd->def = ref->def;
-    }
-    else {
-        log_message(r, APR_SUCCESS,
-            apr_psprintf(r->pool,
-                    "While parsing PRINT: '%s' was not found", cmd->p.vname), NULL);
-        return HTTP_BAD_REQUEST;
+    if (cold) {
+        rrd_server_conf *sconf = ap_get_module_config(
+                r->server->module_config, &rrd_module);
+
+        cold_resolve(r, sconf, rr->filename, cold);
     }
+#endif
 
-    return OK;
+    return source_filename(rr);
 }
 
-static int resolve_rrds(request_rec *r, rrd_cmds_t *cmds)
+/*
+ * Decompress the cold archives among the matches about to be rendered.
+ * Archives that cannot be read are dropped from the graph and listed as
+ * rejected. Returns the number of files dropped.
+ */
+static int cold_rrds(request_rec *r, rrd_cmds_t *cmds)
 {
-    rrd_cmd_t *cmd;
-    int i, ret;
+    int dropped = 0;
+#if HAVE_ZSTD
+    rrd_server_conf *sconf = ap_get_module_config(r->server->module_config,
+            &rrd_module);
+    int i, j;
 
     for (i = 0; i < cmds->cmds->nelts; ++i) {
-
-        cmd = &((rrd_cmd_t *)cmds->cmds->elts)[i];
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+        int kept = 0;
 
         switch (cmd->type) {
         case RRD_CONF_DEF:
 
-            ret = resolve_def(r, cmd, cmds);
-            if (OK != ret) {
-                return ret;
+            /* an alias follows the DEF it shares files with */
+            if (cmd->d.alias) {
+                cmd->num = cmd->d.alias->num;
+                break;
             }
 
-            break;
-        case RRD_CONF_CDEF:
+            for (j = 0; j < cmd->d.requests->nelts; ++j) {
+                request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, j, request_rec *);
+                const char *cold = apr_table_get(rr->notes, "rrd-cold");
 
-            ret = resolve_cdef(r, cmd, cmds);
-            if (OK != ret) {
-                return ret;
-            }
+                if (cold && !cold_resolve(r, sconf, rr->filename, cold)) {
+                    rrd_reject_t *reject = apr_array_push(cmd->d.rejected);
 
-            break;
-        case RRD_CONF_VDEF:
-
-            ret = resolve_vdef(r, cmd, cmds);
-            if (OK != ret) {
-                return ret;
-            }
-
-            break;
-        case RRD_CONF_AREA:
-
-            ret = resolve_area(r, cmd, cmds);
-            if (OK != ret) {
-                return ret;
-            }
-
-            break;
-        case RRD_CONF_LINE:
-
-            ret = resolve_line(r, cmd, cmds);
-            if (OK != ret) {
-                return ret;
-            }
-
-            break;
-        case RRD_CONF_TICK:
-
-            ret = resolve_tick(r, cmd, cmds);
-            if (OK != ret) {
-                return ret;
+                    reject->filename = apr_pstrdup(r->pool, rr->filename);
+                    reject->status = HTTP_INTERNAL_SERVER_ERROR;
+                    apr_pool_destroy(rr->pool);
+                    dropped++;
+                    continue;
+                }
+                APR_ARRAY_IDX(cmd->d.requests, kept++, request_rec *) = rr;
             }
-
-            break;
-        case RRD_CONF_SHIFT:
-
-            ret = resolve_shift(r, cmd, cmds);
-            if (OK != ret) {
-                return ret;
+            cmd->d.requests->nelts = kept;
+            if (!cmd->d.distribution) {
+                cmd->num = kept;
             }
 
             break;
-        case RRD_CONF_GPRINT:
+        case RRD_CONF_VDEF:
 
-            ret = resolve_gprint(r, cmd, cmds);
-            if (OK != ret) {
-                return ret;
-            }
+            /* follow the new number of series */
+            cmd->num = cmd->v.ref->num;
 
             break;
-        case RRD_CONF_PRINT:
+        case RRD_CONF_CDEF:
 
-            ret = resolve_print(r, cmd, cmds);
-            if (OK != ret) {
-                return ret;
+            if (cmd->c.ref) {
+                cmd->num = cmd->c.ref->num;
             }
 
             break;
         default:
             break;
         }
-
-    }
-
-    return OK;
-}
-
-static int generate_element(request_rec *r, rrd_cmd_t *cmd,
-        apr_array_header_t *args)
-{
-    /* one result */
-    const char *arg;
-
-    const char *legend = cmd->e.legend;
-    if (cmd->e.elegend) {
-        const char *err = NULL;
-        legend = ap_expr_str_exec(r, cmd->e.elegend, &err);
-        if (err) {
-            log_message(r, APR_SUCCESS,
-                    apr_psprintf(r->pool,
-                            "While evaluating an element expression: %s", err), NULL);
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
-        legend = pescape_colon(r->pool, legend);
     }
+#endif
 
-    arg = apr_psprintf(r->pool, "%s:%s",
-            cmd->e.element, legend);
-    APR_ARRAY_PUSH(args, const char *) = arg;
-
-    return OK;
+    return dropped;
 }
 
-static int generate_gprint(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
+static const char *resolve_def_cb(ap_dir_match_t *w, const char *fname)
 {
-    int j;
-
-    /* no reference */
-    if (!cmd->def) {
-        log_message(r, APR_SUCCESS,
-                apr_psprintf(r->pool,
-                        "GPRINT element referred to '%s', which does not exist",
-                        cmd->p.vname), NULL);
-        return HTTP_BAD_REQUEST;
-    }
-
-    /* no results */
-    else if (cmd->def->num == 0) {
-        /* output nothing */
-    }
+    rrd_cb_t *ctx = w->ctx;
+    request_rec *rr;
 
-    /* one result */
-    else if (cmd->def->num == 1) {
-        const char *arg = apr_psprintf(r->pool, "GPRINT:%s:%s",
-                cmd->p.vname, cmd->p.format);
-        APR_ARRAY_PUSH(args, const char *) = arg;
-    }
+#if HAVE_ZSTD
+    /* an archive next to the file it was compressed from is the same file */
+    if (is_cold(fname)) {
+        apr_finfo_t finfo;
 
-    /* more than one result */
-    else {
-        /* handle each PRINT: line */
-        for (j = 0; j < cmd->def->num; ++j) {
-            const char *arg = apr_psprintf(r->pool, "GPRINT:%sw%d:%s",
-                    cmd->p.vname, j, cmd->p.format);
-            APR_ARRAY_PUSH(args, const char *) = arg;
+        if (apr_stat(&finfo, apr_pstrndup(w->ptemp, fname, strlen(fname) - 4),
+                APR_FINFO_TYPE, w->ptemp) == APR_SUCCESS) {
+            return NULL;
         }
     }
+#endif
 
-    return OK;
-}
+    rr = ap_sub_req_lookup_file(fname, ctx->r, NULL);
 
-static int generate_print(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
-{
-    int j;
+#if HAVE_ZSTD
+    /*
+     * Cold archives are read from a decompressed copy, named here and
+     * only made once the archive is about to be read.
+     */
+    if (rr->status == HTTP_OK && is_cold(rr->filename)) {
+        rrd_server_conf *sconf = ap_get_module_config(
+                ctx->r->server->module_config, &rrd_module);
 
-    /* no reference */
-    if (!cmd->def) {
-        log_message(r, APR_SUCCESS,
-                apr_psprintf(r->pool,
-                        "PRINT element referred to '%s', which does not exist",
-                        cmd->p.vname), NULL);
-        return HTTP_BAD_REQUEST;
+        if (sconf->cold) {
+            apr_table_setn(rr->notes, "rrd-cold",
+                    cold_filename(rr->pool, sconf->cold, rr->filename));
+        }
+        else {
+            rr->status = HTTP_INTERNAL_SERVER_ERROR;
+        }
     }
+#endif
 
-    /* no results */
-    else if (cmd->def->num == 0) {
-        /* output nothing */
+    if (rr->status == HTTP_OK) {
+        APR_ARRAY_PUSH(ctx->cmd->d.requests, request_rec *) = rr;
+        ctx->cmd->num++;
     }
+    else {
+        rrd_reject_t *reject = apr_array_push(ctx->cmd->d.rejected);
 
-    /* one result */
-    else if (cmd->def->num == 1) {
-        const char *arg = apr_psprintf(r->pool, "PRINT:%s:%s",
-                cmd->p.vname, cmd->p.format);
-        APR_ARRAY_PUSH(args, const char *) = arg;
-    }
+        reject->filename = apr_pstrdup(ctx->r->pool, fname);
+        reject->status = rr->status;
 
-    /* more than one result */
-    else {
-        /* handle each PRINT: line */
-        for (j = 0; j < cmd->def->num; ++j) {
-            const char *arg = apr_psprintf(r->pool, "PRINT:%sw%d:%s",
-                    cmd->p.vname, j, cmd->p.format);
-            APR_ARRAY_PUSH(args, const char *) = arg;
-        }
+        ap_log_rerror(
+                APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, rr, "mod_rrd: Access to path returned %d, ignoring: %s",
+                rr->status, fname);
     }
 
-    return OK;
+    return NULL;
 }
 
-static int generate_shift(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
+static int resolve_def(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
 {
-    int j;
-
-    /* no reference */
-    if (!cmd->def) {
-        log_message(r, APR_SUCCESS,
-                apr_psprintf(r->pool,
-                        "SHIFT element referred to '%s', which does not exist",
-                        cmd->s.vname), NULL);
-        return HTTP_BAD_REQUEST;
-    }
+    ap_dir_match_t w;
+    rrd_cb_t ctx;
+    apr_pool_t *ptemp;
+    const char *last, *path, *dirpath = r->filename;
+    apr_hash_index_t *hi, *hi2;
+    apr_hash_t *set;
 
-    /* no results */
-    else if (cmd->def->num == 0) {
-        /* output nothing */
-    }
+    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
+            &rrd_module);
+#if HAVE_ZSTD
+    rrd_server_conf *sconf = ap_get_module_config(r->server->module_config,
+            &rrd_module);
+#endif
 
-    /* one result */
-    else if (cmd->def->num == 1) {
-        const char *arg = apr_psprintf(r->pool, "SHIFT:%s:%s",
-                cmd->s.vname, cmd->s.shift);
-        APR_ARRAY_PUSH(args, const char *) = arg;
-    }
+    apr_pool_create(&ptemp, r->pool);
 
-    /* more than one result */
-    else {
-        /* handle each LINE: line */
-        for (j = 0; j < cmd->def->num; ++j) {
-            const char *arg = apr_psprintf(r->pool, "SHIFT:%sw%d:%s",
-                    cmd->s.vname, j, cmd->s.shift);
-            APR_ARRAY_PUSH(args, const char *) = arg;
-        }
-    }
+    /* process the wildcards */
+    ctx.r = r;
+    ctx.cmd = cmd;
 
-    return OK;
-}
+    /* elements from the config are shared, keep the matches per request */
+    cmd->d.requests = apr_array_make(r->pool, 10, sizeof(request_rec *));
+    cmd->d.rejected = apr_array_make(r->pool, 2, sizeof(rrd_reject_t));
 
-static int generate_hrule(request_rec *r, rrd_cmd_t *cmd,
-        apr_array_header_t *args)
-{
-    /* one result */
-    const char *arg;
+    w.prefix = "rrd path: ";
+    w.p = r->pool;
+    w.ptemp = ptemp;
+    w.flags = AP_DIR_FLAG_OPTIONAL | AP_DIR_FLAG_RECURSIVE;
+    w.cb = resolve_def_cb;
+    w.ctx = &ctx;
+    w.depth = 0;
 
-    const char *legend = cmd->r.legend;
-    if (cmd->r.elegend) {
+    path = cmd->d.path;
+    if (cmd->d.epath) {
         const char *err = NULL;
-        legend = ap_expr_str_exec(r, cmd->r.elegend, &err);
+        path = ap_expr_str_exec(r, cmd->d.epath, &err);
         if (err) {
             log_message(r, APR_SUCCESS,
-                    apr_psprintf(r->pool,
-                            "While evaluating an element expression: %s", err), NULL);
+                apr_psprintf(r->pool,
+                        "While evaluating an element expression: %s", err), NULL);
             return HTTP_INTERNAL_SERVER_ERROR;
         }
-        legend = pescape_colon(r->pool, legend);
     }
 
-    arg = apr_psprintf(r->pool, "HRULE:%s%s%s:%s%s%s",
-            cmd->r.val,
-            cmd->r.colour ? "#" : "", cmd->r.colour ? cmd->r.colour : "",
-            legend,
-            cmd->r.args[0] ? ":" : "", cmd->r.args);
-    APR_ARRAY_PUSH(args, const char *) = arg;
-
-    return OK;
-}
-
-static int generate_vrule(request_rec *r, rrd_cmd_t *cmd,
-        apr_array_header_t *args)
-{
-    /* one result */
-    const char *arg;
-
-    const char *legend = cmd->r.legend;
-    if (cmd->r.elegend) {
+    if (cmd->d.edirpath) {
         const char *err = NULL;
-        legend = ap_expr_str_exec(r, cmd->r.elegend, &err);
+        dirpath = ap_expr_str_exec(r, cmd->d.edirpath, &err);
         if (err) {
             log_message(r, APR_SUCCESS,
-                    apr_psprintf(r->pool,
-                            "While evaluating an element expression: %s", err), NULL);
+                apr_psprintf(r->pool,
+                        "While evaluating an element expression: %s", err), NULL);
             return HTTP_INTERNAL_SERVER_ERROR;
         }
-        legend = pescape_colon(r->pool, legend);
+    }
+    else {
+    	last = strrchr(r->filename, '/');
+    	if (last) {
+        	dirpath = apr_pstrndup(r->pool, r->filename, last - r->filename);
+    	}
+    }
+
+    cmd->d.pattern = path;
+    cmd->d.base = dirpath;
+
+    /* the same files as an earlier DEF are matched once, and shared */
+    if (!cmd->d.distribution) {
+        const char *key = apr_pstrcat(r->pool, path, "\n", dirpath, "\n",
+                cmd->d.dsname, "\n", cmd->d.cf, NULL);
+        rrd_cmd_t *first = apr_hash_get(cmds->defs, key, APR_HASH_KEY_STRING);
+
+        if (first) {
+            ap_log_rerror(
+                    APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                    "mod_rrd: DEF '%s' has the same files as '%s', sharing them",
+                    cmd->d.vname, first->d.vname);
+
+            cmd->d.alias = first;
+            cmd->d.requests = first->d.requests;
+            cmd->d.rejected = first->d.rejected;
+            cmd->num = first->num;
+
+            apr_pool_destroy(ptemp);
+
+            cmd->d.index = cmd - &APR_ARRAY_IDX(cmds->cmds, 0, rrd_cmd_t);
+            cmd->def = cmd;
+            apr_hash_set(cmds->names, cmd->d.vname, APR_HASH_KEY_STRING, cmd);
+
+            return OK;
+        }
+
+        apr_hash_set(cmds->defs, key, APR_HASH_KEY_STRING, cmd);
+    }
+
+    ap_log_rerror(
+            APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+            "mod_rrd: Attempting to match wildcard RRD path '%s' against base '%s'",
+            path, dirpath);
+
+    const char *err = ap_dir_fnmatch(&w, dirpath, path);
+#if HAVE_ZSTD
+    /* and the cold archives of the same files, compressed with zstd */
+    if (!err && sconf->cold && strlen(path) > 4
+            && strcmp(path + strlen(path) - 4, ".rrd") == 0) {
+        err = ap_dir_fnmatch(&w, dirpath, apr_pstrcat(ptemp, path, ".zst", NULL));
+    }
+#endif
+    if (err) {
+        log_message(r, APR_SUCCESS,
+            apr_psprintf(r->pool,
+                    "While parsing DEF path '%s': %s", path, err), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* process the environment lookup, left alone when only explaining */
+    set = apr_hash_make(ptemp);
+    for (hi = apr_hash_first(NULL, cmds->explain ? NULL : conf->env); hi;
+            hi = apr_hash_next(hi)) {
+        const char *err = NULL, *key, *val;
+        ap_expr_info_t *eval;
+        void *v;
+        const void *k;
+        int j;
+
+        apr_hash_this(hi, &k, NULL, &v);
+        key = k;
+        eval = v;
+
+        for (j = 0; j < cmd->d.requests->nelts; ++j) {
+            request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, j, request_rec *);
+
+            val = ap_expr_str_exec(rr, eval, &err);
+            if (err) {
+                log_message(r, APR_SUCCESS,
+                        apr_psprintf(r->pool,
+                                "While evaluating an element expression: %s", err), NULL);
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+            if (val && val[0]) {
+                apr_hash_set(set, val, APR_HASH_KEY_STRING, val);
+            }
+
+        }
+
+        if (apr_hash_count(set)) {
+            apr_array_header_t *arr = apr_array_make(ptemp, apr_hash_count(set), sizeof(const char *));
+            for (hi2 = apr_hash_first(NULL, set); hi2; hi2 = apr_hash_next(hi2)) {
+                apr_hash_this(hi2, apr_array_push(arr), NULL, NULL);
+            }
+            apr_table_setn(r->subprocess_env, key, apr_array_pstrcat(r->pool, arr, ','));
+
+        }
+        apr_hash_clear(set);
+    }
+
+    apr_pool_destroy(ptemp);
+
+    /* a distribution is a single set of series, however many files match */
+    if (cmd->d.distribution && cmd->num) {
+        cmd->num = 1;
+    }
+
+    cmd->d.index = cmd - &APR_ARRAY_IDX(cmds->cmds, 0, rrd_cmd_t);
+    cmd->def = cmd;
+    apr_hash_set(cmds->names, cmd->d.vname, APR_HASH_KEY_STRING, cmd);
+
+    return OK;
+}
+
+static int resolve_vdef(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+{
+    cmd->v.ref = apr_hash_get(cmds->names, cmd->v.dsname, APR_HASH_KEY_STRING);
+    if (cmd->v.ref) {
+        cmd->def = cmd->v.ref->def;
+    }
+
+    if (!cmd->v.ref) {
+        log_message(r, APR_SUCCESS,
+            apr_psprintf(r->pool,
+                    "While parsing VDEF '%s': '%s' was not found", cmd->v.vname, cmd->v.dsname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+    else {
+        cmd->num = cmd->v.ref->num;
+    }
+
+    apr_hash_set(cmds->names, cmd->v.vname, APR_HASH_KEY_STRING, cmd);
+    return OK;
+}
+
+static int resolve_cdef(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+{
+    int i;
+
+    for (i = 0; i < cmd->c.rpns->nelts; ++i) {
+        rrd_rpn_t *rp = &((rrd_rpn_t *) cmd->c.rpns->elts)[i];
+
+        if (!cmd->c.ref) {
+            rrd_cmd_t *ref = apr_hash_get(cmds->names, rp->rpn,
+                    APR_HASH_KEY_STRING);
+            if (ref) {
+                cmd->c.ref = ref;
+                rp->def = cmd->def = ref->def;
+            }
+        }
+
+    }
+    if (cmd->c.ref) {
+        cmd->num = cmd->c.ref->num;
+    }
+    apr_hash_set(cmds->names, cmd->c.vname, APR_HASH_KEY_STRING, cmd);
+    return OK;
+}
+
+static int resolve_area(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+{
+    rrd_cmd_t *ref;
+
+    ref = apr_hash_get(cmds->names, cmd->a.vname, APR_HASH_KEY_STRING);
+    if (ref) {
+        cmd->def = ref->def;
+    }
+    else {
+        log_message(r, APR_SUCCESS,
+            apr_psprintf(r->pool,
+                    "While parsing AREA: '%s' was not found", cmd->a.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    return OK;
+}
+
+static int resolve_line(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+{
+    rrd_cmd_t *ref;
+
+    ref = apr_hash_get(cmds->names, cmd->l.vname, APR_HASH_KEY_STRING);
+    if (ref) {
+        cmd->def = ref->def;
+    }
+    else {
+        log_message(r, APR_SUCCESS,
+            apr_psprintf(r->pool,
+                    "While parsing LINE: '%s' was not found", cmd->l.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    return OK;
+}
+
+static int resolve_tick(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+{
+    rrd_cmd_t *ref;
+
+    ref = apr_hash_get(cmds->names, cmd->t.vname, APR_HASH_KEY_STRING);
+    if (ref) {
+        cmd->def = ref->def;
+    }
+    else {
+        log_message(r, APR_SUCCESS,
+            apr_psprintf(r->pool,
+                    "While parsing TICK: '%s' was not found", cmd->t.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    return OK;
+}
+
+static int resolve_shift(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+{
+    rrd_cmd_t *ref;
+
+    ref = apr_hash_get(cmds->names, cmd->s.vname, APR_HASH_KEY_STRING);
+    if (ref) {
+        cmd->def = ref->def;
+    }
+    else {
+        log_message(r, APR_SUCCESS,
+            apr_psprintf(r->pool,
+                    "While parsing SHIFT: '%s' was not found", cmd->s.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    return OK;
+}
+
+static int resolve_gprint(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+{
+    rrd_cmd_t *ref;
+
+    ref = apr_hash_get(cmds->names, cmd->p.vname, APR_HASH_KEY_STRING);
+    if (ref) {
+        cmd->def = ref->def;
+    }
+    else {
+        log_message(r, APR_SUCCESS,
+            apr_psprintf(r->pool,
+                    "While parsing GPRINT: '%s' was not found", cmd->p.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    return OK;
+}
+
+static int resolve_print(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds)
+{
+    rrd_cmd_t *ref;
+
+    ref = apr_hash_get(cmds->names, cmd->p.vname, APR_HASH_KEY_STRING);
+    if (ref) {
+        cmd->def = ref->def;
+    }
+    else {
+        log_message(r, APR_SUCCESS,
+            apr_psprintf(r->pool,
+                    "While parsing PRINT: '%s' was not found", cmd->p.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    return OK;
+}
+
+static int resolve_rrds(request_rec *r, rrd_cmds_t *cmds)
+{
+    rrd_cmd_t *cmd;
+    int i, ret;
+
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+
+        cmd = &((rrd_cmd_t *)cmds->cmds->elts)[i];
+
+        switch (cmd->type) {
+        case RRD_CONF_DEF:
+
+            ret = resolve_def(r, cmd, cmds);
+            if (OK != ret) {
+                return ret;
+            }
+
+            break;
+        case RRD_CONF_CDEF:
+
+            ret = resolve_cdef(r, cmd, cmds);
+            if (OK != ret) {
+                return ret;
+            }
+
+            break;
+        case RRD_CONF_VDEF:
+
+            ret = resolve_vdef(r, cmd, cmds);
+            if (OK != ret) {
+                return ret;
+            }
+
+            break;
+        case RRD_CONF_AREA:
+
+            ret = resolve_area(r, cmd, cmds);
+            if (OK != ret) {
+                return ret;
+            }
+
+            break;
+        case RRD_CONF_LINE:
+
+            ret = resolve_line(r, cmd, cmds);
+            if (OK != ret) {
+                return ret;
+            }
+
+            break;
+        case RRD_CONF_TICK:
+
+            ret = resolve_tick(r, cmd, cmds);
+            if (OK != ret) {
+                return ret;
+            }
+
+            break;
+        case RRD_CONF_SHIFT:
+
+            ret = resolve_shift(r, cmd, cmds);
+            if (OK != ret) {
+                return ret;
+            }
+
+            break;
+        case RRD_CONF_GPRINT:
+
+            ret = resolve_gprint(r, cmd, cmds);
+            if (OK != ret) {
+                return ret;
+            }
+
+            break;
+        case RRD_CONF_PRINT:
+
+            ret = resolve_print(r, cmd, cmds);
+            if (OK != ret) {
+                return ret;
+            }
+
+            break;
+        default:
+            break;
+        }
+
+    }
+
+    return OK;
+}
+
+static int generate_element(request_rec *r, rrd_cmd_t *cmd,
+        apr_array_header_t *args)
+{
+    /* one result */
+    const char *arg;
+
+    const char *legend = cmd->e.legend;
+    if (cmd->e.elegend) {
+        const char *err = NULL;
+        legend = ap_expr_str_exec(r, cmd->e.elegend, &err);
+        if (err) {
+            log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "While evaluating an element expression: %s", err), NULL);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        legend = pescape_colon(r->pool, legend);
+    }
+
+    arg = apr_psprintf(r->pool, "%s:%s",
+            cmd->e.element, legend);
+    APR_ARRAY_PUSH(args, const char *) = arg;
+
+    return OK;
+}
+
+static int generate_gprint(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
+{
+    int j;
+
+    /* no reference */
+    if (!cmd->def) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "GPRINT element referred to '%s', which does not exist",
+                        cmd->p.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* no results */
+    else if (cmd->def->num == 0) {
+        /* output nothing */
+    }
+
+    /* one result */
+    else if (cmd->def->num == 1) {
+        const char *arg = apr_psprintf(r->pool, "GPRINT:%s:%s",
+                cmd->p.vname, cmd->p.format);
+        APR_ARRAY_PUSH(args, const char *) = arg;
+    }
+
+    /* more than one result */
+    else {
+        /* handle each PRINT: line */
+        for (j = 0; j < cmd->def->num; ++j) {
+            const char *arg = apr_psprintf(r->pool, "GPRINT:%sw%d:%s",
+                    cmd->p.vname, j, cmd->p.format);
+            APR_ARRAY_PUSH(args, const char *) = arg;
+        }
+    }
+
+    return OK;
+}
+
+static int generate_print(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
+{
+    int j;
+
+    /* no reference */
+    if (!cmd->def) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "PRINT element referred to '%s', which does not exist",
+                        cmd->p.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* no results */
+    else if (cmd->def->num == 0) {
+        /* output nothing */
+    }
+
+    /* one result */
+    else if (cmd->def->num == 1) {
+        const char *arg = apr_psprintf(r->pool, "PRINT:%s:%s",
+                cmd->p.vname, cmd->p.format);
+        APR_ARRAY_PUSH(args, const char *) = arg;
+    }
+
+    /* more than one result */
+    else {
+        /* handle each PRINT: line */
+        for (j = 0; j < cmd->def->num; ++j) {
+            const char *arg = apr_psprintf(r->pool, "PRINT:%sw%d:%s",
+                    cmd->p.vname, j, cmd->p.format);
+            APR_ARRAY_PUSH(args, const char *) = arg;
+        }
+    }
+
+    return OK;
+}
+
+static int generate_shift(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
+{
+    int j;
+
+    /* no reference */
+    if (!cmd->def) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "SHIFT element referred to '%s', which does not exist",
+                        cmd->s.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* no results */
+    else if (cmd->def->num == 0) {
+        /* output nothing */
+    }
+
+    /* one result */
+    else if (cmd->def->num == 1) {
+        const char *arg = apr_psprintf(r->pool, "SHIFT:%s:%s",
+                cmd->s.vname, cmd->s.shift);
+        APR_ARRAY_PUSH(args, const char *) = arg;
+    }
+
+    /* more than one result */
+    else {
+        /* handle each LINE: line */
+        for (j = 0; j < cmd->def->num; ++j) {
+            const char *arg = apr_psprintf(r->pool, "SHIFT:%sw%d:%s",
+                    cmd->s.vname, j, cmd->s.shift);
+            APR_ARRAY_PUSH(args, const char *) = arg;
+        }
+    }
+
+    return OK;
+}
+
+static int generate_hrule(request_rec *r, rrd_cmd_t *cmd,
+        apr_array_header_t *args)
+{
+    /* one result */
+    const char *arg;
+
+    const char *legend = cmd->r.legend;
+    if (cmd->r.elegend) {
+        const char *err = NULL;
+        legend = ap_expr_str_exec(r, cmd->r.elegend, &err);
+        if (err) {
+            log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "While evaluating an element expression: %s", err), NULL);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        legend = pescape_colon(r->pool, legend);
+    }
+
+    arg = apr_psprintf(r->pool, "HRULE:%s%s%s:%s%s%s",
+            cmd->r.val,
+            cmd->r.colour ? "#" : "", cmd->r.colour ? cmd->r.colour : "",
+            legend,
+            cmd->r.args[0] ? ":" : "", cmd->r.args);
+    APR_ARRAY_PUSH(args, const char *) = arg;
+
+    return OK;
+}
+
+static int generate_vrule(request_rec *r, rrd_cmd_t *cmd,
+        apr_array_header_t *args)
+{
+    /* one result */
+    const char *arg;
+
+    const char *legend = cmd->r.legend;
+    if (cmd->r.elegend) {
+        const char *err = NULL;
+        legend = ap_expr_str_exec(r, cmd->r.elegend, &err);
+        if (err) {
+            log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "While evaluating an element expression: %s", err), NULL);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        legend = pescape_colon(r->pool, legend);
     }
 
     arg = apr_psprintf(r->pool, "VRULE:%s%s%s:%s%s%s",
@@ -1764,845 +3002,5614 @@ static int generate_vrule(request_rec *r, rrd_cmd_t *cmd,
             cmd->r.args[0] ? ":" : "", cmd->r.args);
     APR_ARRAY_PUSH(args, const char *) = arg;
 
-    return OK;
-}
+    return OK;
+}
+
+static int generate_tick(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds,
+        apr_array_header_t *args, int *i)
+{
+    int j, k;
+
+    /* no reference */
+    if (!cmd->def) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "TICK element referred to '%s', which does not exist",
+                        cmd->t.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* no results */
+    else if (cmd->def->num == 0) {
+        /* output nothing */
+    }
+
+    /* one result */
+    else if (cmd->def->num == 1) {
+        const char *arg;
+        request_rec *rr = ((request_rec **)cmd->def->d.requests->elts)[0];
+
+        const char *legend = cmd->t.legend;
+        if (cmd->t.elegend) {
+            const char *err = NULL;
+            legend = ap_expr_str_exec(rr, cmd->t.elegend, &err);
+            if (err) {
+                log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "While evaluating an element expression: %s", err), NULL);
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+            legend = pescape_colon(r->pool, legend);
+        }
+        arg = apr_psprintf(r->pool, "TICK:%s%s%s:%s:%s%s%s",
+                cmd->t.vname,
+                cmd->t.colour ? "#" : "", cmd->t.colour ? cmd->t.colour : "",
+                cmd->t.fraction,
+                legend,
+                cmd->t.args[0] ? ":" : "", cmd->t.args);
+        APR_ARRAY_PUSH(args, const char *) = arg;
+    }
+
+    /* more than one result */
+    else {
+        int skip = 0;
+
+        /* handle each TICK: line */
+        for (j = 0; j < cmd->def->num; ++j) {
+            const char *arg;
+            request_rec *rr = j < cmd->def->d.requests->nelts ?
+                    ((request_rec **)cmd->def->d.requests->elts)[j] : NULL;
+
+            /* past the matches is the sum of the files over the fan out */
+            const char *legend = rr ? cmd->t.legend : cmd->def->d.other_legend;
+            if (rr && cmd->t.elegend) {
+                const char *err = NULL;
+                legend = ap_expr_str_exec(rr, cmd->t.elegend, &err);
+                if (err) {
+                    log_message(r, APR_SUCCESS,
+                        apr_psprintf(r->pool,
+                                "While evaluating an element expression: %s", err), NULL);
+                    return HTTP_INTERNAL_SERVER_ERROR;
+                }
+                legend = pescape_colon(r->pool, legend);
+            }
+
+            arg = apr_psprintf(r->pool, "TICK:%sw%d%s%s:%s:%s%s%s",
+                    cmd->t.vname, j,
+                    cmd->t.colour ? "#" : "", cmd->t.colour ? cmd->t.colour : "",
+                    cmd->t.fraction,
+                    legend,
+                    cmd->t.args[0] ? ":" : "", cmd->t.args);
+            APR_ARRAY_PUSH(args, const char *) = arg;
+
+            for (k = *i + 1; k < cmds->cmds->nelts; ++k) {
+                rrd_cmd_t *pcmd = &((rrd_cmd_t *)cmds->cmds->elts)[k];
+                if (pcmd->def == cmd->def) {
+                    switch (pcmd->type) {
+                    case RRD_CONF_PRINT:
+
+                        APR_ARRAY_PUSH(args, const char *) =
+                            apr_psprintf(r->pool, "PRINT:%sw%d:%s",
+                                pcmd->p.vname, j, pcmd->p.format);
+
+                        break;
+                    case RRD_CONF_GPRINT:
+
+                        APR_ARRAY_PUSH(args, const char *) =
+                            apr_psprintf(r->pool, "GPRINT:%sw%d:%s",
+                                pcmd->p.vname, j, pcmd->p.format);
+
+                        break;
+                    default:
+                        /* skip the print/grint */
+                        skip = k - *i - 1;
+                        /* jump out of the loop */
+                        k = cmds->cmds->nelts;
+                    }
+                }
+                else {
+                    /* skip the print/grint */
+                    skip = k - *i - 1;
+                    /* jump out of the loop */
+                    k = cmds->cmds->nelts;
+                }
+            }
+
+        }
+        *i += skip;
+    }
+
+    return OK;
+}
+
+static int generate_area(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds,
+        apr_array_header_t *args, int *i)
+{
+    int j, k;
+
+    /* no reference */
+    if (!cmd->def) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "AREA element referred to '%s', which does not exist",
+                        cmd->a.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* no results */
+    else if (cmd->def->num == 0) {
+        /* output nothing */
+    }
+
+    /* one result */
+    else if (cmd->def->num == 1) {
+        const char *arg;
+        request_rec *rr = ((request_rec **)cmd->def->d.requests->elts)[0];
+
+        const char *legend = cmd->a.legend;
+        if (cmd->a.elegend) {
+            const char *err = NULL;
+            legend = ap_expr_str_exec(rr, cmd->a.elegend, &err);
+            if (err) {
+                log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "While evaluating an element expression: %s", err), NULL);
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+            legend = pescape_colon(r->pool, legend);
+        }
+
+        arg = apr_psprintf(r->pool, "AREA:%s%s%s:%s%s%s",
+                cmd->a.vname,
+                cmd->a.colour ? "#" : "", cmd->a.colour ? cmd->a.colour : "",
+                legend,
+                cmd->a.args[0] ? ":" : "", cmd->a.args);
+        APR_ARRAY_PUSH(args, const char *) = arg;
+    }
+
+    /* more than one result */
+    else {
+        int skip = 0;
+
+        /* handle each AREA: line */
+        for (j = 0; j < cmd->def->num; ++j) {
+            const char *arg;
+            request_rec *rr = j < cmd->def->d.requests->nelts ?
+                    ((request_rec **)cmd->def->d.requests->elts)[j] : NULL;
+
+            /* past the matches is the sum of the files over the fan out */
+            const char *legend = rr ? cmd->a.legend : cmd->def->d.other_legend;
+            if (rr && cmd->a.elegend) {
+                const char *err = NULL;
+                legend = ap_expr_str_exec(rr, cmd->a.elegend, &err);
+                if (err) {
+                    log_message(r, APR_SUCCESS,
+                        apr_psprintf(r->pool,
+                                "While evaluating an element expression: %s", err), NULL);
+                    return HTTP_INTERNAL_SERVER_ERROR;
+                }
+                legend = pescape_colon(r->pool, legend);
+            }
+
+            arg = apr_psprintf(r->pool, "AREA:%sw%d%s%s:%s%s%s",
+                    cmd->a.vname, j,
+                    cmd->a.colour ? "#" : "", cmd->a.colour ? cmd->a.colour : "",
+                    legend,
+                    cmd->a.args[0] ? ":" : "", cmd->a.args);
+            APR_ARRAY_PUSH(args, const char *) = arg;
+
+            for (k = *i + 1; k < cmds->cmds->nelts; ++k) {
+                rrd_cmd_t *pcmd = &((rrd_cmd_t *)cmds->cmds->elts)[k];
+                if (pcmd->def == cmd->def) {
+                    switch (pcmd->type) {
+                    case RRD_CONF_PRINT:
+
+                        APR_ARRAY_PUSH(args, const char *) =
+                            apr_psprintf(r->pool, "PRINT:%sw%d:%s",
+                                pcmd->p.vname, j, pcmd->p.format);
+
+                        break;
+                    case RRD_CONF_GPRINT:
+
+                        APR_ARRAY_PUSH(args, const char *) =
+                            apr_psprintf(r->pool, "GPRINT:%sw%d:%s",
+                                pcmd->p.vname, j, pcmd->p.format);
+
+                        break;
+                    default:
+                        /* skip the print/grint */
+                        skip = k - *i - 1;
+                        /* jump out of the loop */
+                        k = cmds->cmds->nelts;
+                    }
+                }
+                else {
+                    /* skip the print/grint */
+                    skip = k - *i - 1;
+                    /* jump out of the loop */
+                    k = cmds->cmds->nelts;
+                }
+            }
+
+        }
+        *i += skip;
+    }
+
+    return OK;
+}
+
+static int generate_line(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds,
+        apr_array_header_t *args, int *i)
+{
+    int j, k;
+
+    /* no reference */
+    if (!cmd->def) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "LINE element referred to '%s', which does not exist",
+                        cmd->l.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* no results */
+    else if (cmd->def->num == 0) {
+        /* output nothing */
+    }
+
+    /* one result */
+    else if (cmd->def->num == 1) {
+        const char *arg;
+        request_rec *rr = ((request_rec **)cmd->def->d.requests->elts)[0];
+
+        const char *legend = cmd->l.legend;
+        if (cmd->l.elegend) {
+            const char *err = NULL;
+            legend = ap_expr_str_exec(rr, cmd->l.elegend, &err);
+            if (err) {
+                log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "While evaluating an element expression: %s", err), NULL);
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+            legend = pescape_colon(r->pool, legend);
+        }
+        arg = apr_psprintf(r->pool, "%s:%s%s%s:%s%s%s",
+                cmd->l.line, cmd->l.vname,
+                cmd->l.colour ? "#" : "", cmd->l.colour ? cmd->l.colour : "",
+                legend,
+                cmd->l.args[0] ? ":" : "", cmd->l.args);
+        APR_ARRAY_PUSH(args, const char *) = arg;
+    }
+
+    /* more than one result */
+    else {
+        int skip = 0;
+
+        /* handle each LINE: line */
+        for (j = 0; j < cmd->def->num; ++j) {
+            const char *arg;
+            request_rec *rr = j < cmd->def->d.requests->nelts ?
+                    ((request_rec **)cmd->def->d.requests->elts)[j] : NULL;
+
+            /* past the matches is the sum of the files over the fan out */
+            const char *legend = rr ? cmd->l.legend : cmd->def->d.other_legend;
+            if (rr && cmd->l.elegend) {
+                const char *err = NULL;
+                legend = ap_expr_str_exec(rr, cmd->l.elegend, &err);
+                if (err) {
+                    log_message(r, APR_SUCCESS,
+                        apr_psprintf(r->pool,
+                                "While evaluating an element expression: %s", err), NULL);
+                    return HTTP_INTERNAL_SERVER_ERROR;
+                }
+                legend = pescape_colon(r->pool, legend);
+            }
+
+            arg = apr_psprintf(r->pool, "%s:%sw%d%s%s:%s%s%s",
+                    cmd->l.line, cmd->l.vname, j,
+                    cmd->l.colour ? "#" : "", cmd->l.colour ? cmd->l.colour : "",
+                    legend,
+                    cmd->l.args[0] ? ":" : "", cmd->l.args);
+            APR_ARRAY_PUSH(args, const char *) = arg;
+
+            for (k = *i + 1; k < cmds->cmds->nelts; ++k) {
+                rrd_cmd_t *pcmd = &((rrd_cmd_t *)cmds->cmds->elts)[k];
+                if (pcmd->def == cmd->def) {
+                    switch (pcmd->type) {
+                    case RRD_CONF_PRINT:
+
+                        APR_ARRAY_PUSH(args, const char *) =
+                            apr_psprintf(r->pool, "PRINT:%sw%d:%s",
+                                pcmd->p.vname, j, pcmd->p.format);
+
+                        break;
+                    case RRD_CONF_GPRINT:
+
+                        APR_ARRAY_PUSH(args, const char *) =
+                            apr_psprintf(r->pool, "GPRINT:%sw%d:%s",
+                                pcmd->p.vname, j, pcmd->p.format);
+
+                        break;
+                    default:
+                        /* skip the print/grint */
+                        skip = k - *i - 1;
+                        /* jump out of the loop */
+                        k = cmds->cmds->nelts;
+                    }
+                }
+                else {
+                    /* skip the print/grint */
+                    skip = k - *i - 1;
+                    /* jump out of the loop */
+                    k = cmds->cmds->nelts;
+                }
+            }
+
+        }
+        *i += skip;
+    }
+
+    return OK;
+}
+
+static int generate_vdef(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
+{
+    int j;
+
+    /* no reference */
+    if (!cmd->def) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "VDEF element referred to '%s', which does not exist",
+                        cmd->v.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* no results */
+    else if (cmd->def->num == 0) {
+        /* output nothing */
+    }
+
+    /* one result */
+    else if (cmd->def->num == 1) {
+        APR_ARRAY_PUSH(args, const char *) =
+                apr_pstrcat(r->pool, "VDEF:", cmd->v.vname, "=",
+                        cmd->v.dsname, ",", cmd->v.rpn, NULL);
+    }
+
+    /* more than one result */
+    else {
+        /* handle each VDEF: line */
+        for (j = 0; j < cmd->def->num; ++j) {
+            const char *arg = apr_psprintf(r->pool, "VDEF:%sw%d=%sw%d,%s", cmd->v.vname,
+                j, cmd->v.dsname, j, cmd->v.rpn);
+            APR_ARRAY_PUSH(args, const char *) = arg;
+        }
+    }
+
+    return OK;
+}
+
+static int generate_cdef(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
+{
+    int j, k;
+
+    /* no reference */
+    if (!cmd->def) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "CDEF element '%s' referred to no existing definitions",
+                        cmd->c.vname), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* no results */
+    else if (cmd->def->num == 0) {
+        /* output nothing */
+    }
+
+    /* one result */
+    else if (cmd->def->num == 1) {
+        APR_ARRAY_PUSH(args, const char *) =
+                apr_pstrcat(r->pool, "CDEF:", cmd->c.vname, "=",
+                        cmd->c.rpn, NULL);
+    }
+
+    /* more than one result */
+    else {
+        /* handle each CDEF: line */
+        for (j = 0; j < cmd->num; ++j) {
+            char *cdef;
+            int len;
+
+            /* first pass - work out the length */
+            len = apr_snprintf(NULL, 0, "CDEF:%sw%d=", cmd->c.vname, j);
+            for (k = 0; k < cmd->c.rpns->nelts; ++k) {
+                rrd_rpn_t *rp = (((rrd_rpn_t *)cmd->c.rpns->elts) + k);
+                if (k) {
+                    len++;
+                }
+                if (!rp->def || rp->def->num < 2) {
+                    len += apr_snprintf(NULL, 0, "%s", rp->rpn);
+                }
+                else {
+                    len += apr_snprintf(NULL, 0, "%sw%d", rp->rpn, j);
+                }
+            }
+
+            /* second pass, write the cdef */
+            cdef = apr_palloc(r->pool, len + 1);
+            APR_ARRAY_PUSH(args, const char *) = cdef;
+            cdef += apr_snprintf(cdef, len, "CDEF:%sw%d=", cmd->c.vname, j);
+            for (k = 0; k < cmd->c.rpns->nelts; ++k) {
+                rrd_rpn_t *rp = (((rrd_rpn_t *)cmd->c.rpns->elts) + k);
+                if (k) {
+                    *cdef++ = ',';
+                }
+                if (!rp->def || rp->def->num < 2) {
+                    cdef += apr_snprintf(cdef, len, "%s", rp->rpn);
+                }
+                else {
+                    cdef += apr_snprintf(cdef, len, "%sw%d", rp->rpn, j);
+                }
+            }
+        }
+    }
+
+    return OK;
+}
+
+static int generate_distribution(request_rec *r, rrd_cmd_t *cmd,
+        apr_array_header_t *args)
+{
+#if HAVE_RRD_FETCH_CB_REGISTER
+    /* the series are calculated by distribution_cb() while rendering */
+    const char *vname = cmd->d.vname;
+    const char *source = apr_psprintf(r->pool, "cb//mod_rrd/%d", cmd->d.index);
+
+    APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+            "DEF:%smin=%s:min:%s", vname, source, cmd->d.cf);
+    APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+            "DEF:%sp25=%s:p25:%s", vname, source, cmd->d.cf);
+    APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+            "DEF:%s=%s:median:%s", vname, source, cmd->d.cf);
+    APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+            "DEF:%sp75=%s:p75:%s", vname, source, cmd->d.cf);
+    APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+            "DEF:%smax=%s:max:%s", vname, source, cmd->d.cf);
+
+    /* draw the quartiles as bands stacked on an invisible minimum */
+    if (cmd->d.colour) {
+        const char *outer = cmd->d.colour, *inner = cmd->d.colour;
+
+        if (strlen(cmd->d.colour) == 6) {
+            outer = apr_pstrcat(r->pool, cmd->d.colour, "40", NULL);
+            inner = apr_pstrcat(r->pool, cmd->d.colour, "80", NULL);
+        }
+
+        APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+                "CDEF:%sb0=%sp25,%smin,-", vname, vname, vname);
+        APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+                "CDEF:%sb1=%s,%sp25,-", vname, vname, vname);
+        APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+                "CDEF:%sb2=%sp75,%s,-", vname, vname, vname);
+        APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+                "CDEF:%sb3=%smax,%sp75,-", vname, vname, vname);
+        APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+                "AREA:%smin", vname);
+        APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+                "AREA:%sb0#%s::STACK", vname, outer);
+        APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+                "AREA:%sb1#%s::STACK", vname, inner);
+        APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+                "AREA:%sb2#%s::STACK", vname, inner);
+        APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+                "AREA:%sb3#%s::STACK", vname, outer);
+    }
+
+    return OK;
+#else
+    log_message(r, APR_SUCCESS,
+            apr_psprintf(r->pool,
+                    "DEF '%s' asked for a distribution, which needs "
+                    "rrd_fetch_cb_register() from librrd v1.5 or later",
+                    cmd->d.vname), NULL);
+    return HTTP_NOT_IMPLEMENTED;
+#endif
+}
+
+static int generate_alias(request_rec *r, rrd_cmd_t *cmd,
+        apr_array_header_t *args)
+{
+    const char *vname = cmd->d.vname, *first = cmd->d.alias->d.vname;
+    int j;
+
+    /* no results */
+    if (cmd->num == 0) {
+        return OK;
+    }
+
+    /* each series is a copy of the same series of the first DEF */
+    if (cmd->num > 1) {
+        for (j = 0; j < cmd->num; ++j) {
+            APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+                    "CDEF:%sw%d=%sw%d", vname, j, first, j);
+        }
+    }
+
+    APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+            "CDEF:%s=%s", vname, first);
+
+    return OK;
+}
+
+static int generate_def(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
+{
+    int j;
+
+    /* safety check - reject anything trying to set the daemon */
+    if (ap_strstr_c(cmd->d.cf, ":daemon=")) {
+        log_message(r, APR_SUCCESS,
+                    "DEF elements must not contain a 'daemon' parameter", NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* the files were matched by an earlier DEF, and are fetched once */
+    if (cmd->d.alias) {
+        return generate_alias(r, cmd, args);
+    }
+
+    /* no results */
+    if (cmd->d.requests->nelts == 0) {
+        /* output nothing */
+    }
+
+    /* distribution across the results */
+    else if (cmd->d.distribution) {
+        return generate_distribution(r, cmd, args);
+    }
+
+    /* one result */
+    else if (cmd->num == 1) {
+        request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, 0, request_rec *);
+        const char *arg = apr_psprintf(r->pool, "DEF:%s=%s:%s:%s", cmd->d.vname,
+        		pescape_colon(r->pool, source_filename(rr)), cmd->d.dsname, cmd->d.cf);
+        APR_ARRAY_PUSH(args, const char *) = arg;
+    }
+
+    /* more than one result */
+    else {
+        char *cdef;
+        int len = apr_snprintf(NULL, 0, "CDEF:%s=", cmd->d.vname);
+
+        /* handle each DEF: line */
+        for (j = 0; j < cmd->d.requests->nelts; ++j) {
+            request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, j, request_rec *);
+            const char *arg = apr_psprintf(r->pool, "DEF:%sw%d=%s:%s:%s", cmd->d.vname,
+                j, pescape_colon(r->pool, source_filename(rr)), cmd->d.dsname, cmd->d.cf);
+            APR_ARRAY_PUSH(args, const char *) = arg;
+        }
+
+        /* files over the fan out limit are summed into one series */
+        if (cmd->d.other) {
+            apr_array_header_t *sum = apr_array_make(r->pool,
+                    cmd->d.other->nelts * 2, sizeof(const char *));
+
+            for (j = 0; j < cmd->d.other->nelts; ++j) {
+                request_rec *rr = APR_ARRAY_IDX(cmd->d.other, j, request_rec *);
+                const char *arg = apr_psprintf(r->pool, "DEF:%so%d=%s:%s:%s",
+                        cmd->d.vname, j,
+                        pescape_colon(r->pool, source_filename(rr)),
+                        cmd->d.dsname, cmd->d.cf);
+                APR_ARRAY_PUSH(args, const char *) = arg;
+                APR_ARRAY_PUSH(sum, const char *) = apr_psprintf(r->pool,
+                        j ? "%so%d,ADDNAN" : "%so%d", cmd->d.vname, j);
+            }
+            APR_ARRAY_PUSH(args, const char *) = apr_psprintf(r->pool,
+                    "CDEF:%sw%d=%s", cmd->d.vname, cmd->d.requests->nelts,
+                    apr_array_pstrcat(r->pool, sum, ','));
+        }
+
+        for (j = 0; j < cmd->num; ++j) {
+            len += apr_snprintf(NULL, 0, "%s%sw%d%s", j ? "," : "", cmd->d.vname, j, j ? ",+" : "");
+        }
+
+        /* calculate the CDEF summary line */
+        cdef = apr_palloc(r->pool, len + 1);
+        APR_ARRAY_PUSH(args, const char *) = cdef;
+        cdef += apr_snprintf(cdef, len, "CDEF:%s=", cmd->d.vname);
+        for (j = 0; j < cmd->num; ++j) {
+            cdef += apr_snprintf(cdef, len, "%s%sw%d%s", j ? "," : "", cmd->d.vname, j, j ? ",+" : "");
+        }
+
+    }
+
+    return OK;
+}
+
+static int generate_args(request_rec *r, rrd_cmds_t *cmds, apr_array_header_t **pargs)
+{
+    apr_array_header_t *args;
+    rrd_cmd_t *cmd;
+    rrd_opt_t *opt;
+    const char *format;
+    int i, num = 4, ret = OK;
+
+    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
+            &rrd_module);
+
+    /* count the options */
+    for (i = 0; i < cmds->opts->nelts; ++i) {
+
+        opt = &((rrd_opt_t *)cmds->opts->elts)[i];
+
+        if (opt->val) {
+            num++;
+        }
+
+        num++;
+    }
+    /* count the number of elements we need */
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+
+        cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+
+        if (cmd->def) {
+            num += cmd->def->d.requests->nelts;
+        }
+
+        num++;
+    }
+
+    /* work out the format */
+    format = cmds->format = conf->format ? conf->format : parse_rrdgraph_suffix(r);
+
+    /* set the content type */
+    ap_set_content_type(r, lookup_content_type(format));
+
+    /* create arguments of the correct size */
+    args = *pargs = apr_array_make(r->pool, num, sizeof(const char *));
+
+    /* the argv array */
+    APR_ARRAY_PUSH(args, const char *) = "rrdgraph";
+    APR_ARRAY_PUSH(args, const char *) = "-";
+    APR_ARRAY_PUSH(args, const char *) = "--imgformat";
+    APR_ARRAY_PUSH(args, const char *) = format;
+
+    /* first create the options */
+    for (i = 0; i < cmds->opts->nelts; ++i) {
+
+        opt = &((rrd_opt_t *)cmds->opts->elts)[i];
+
+        APR_ARRAY_PUSH(args, const char *) =
+                apr_pstrcat(r->pool, "--", opt->key, NULL);
+        if (opt->eval) {
+            const char *err = NULL;
+
+            APR_ARRAY_PUSH(args, const char *) = ap_expr_str_exec(r, opt->eval, &err);
+            if (err) {
+                log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "While evaluating expressions for '%s': %s", opt->key, err), NULL);
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+        }
+        else if (opt->val) {
+            APR_ARRAY_PUSH(args, const char *) = opt->val;
+        }
+
+    }
+
+    /* and finally create the elements */
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+
+        cmd = &((rrd_cmd_t *)cmds->cmds->elts)[i];
+
+        switch (cmd->type) {
+        case RRD_CONF_DEF:
+
+            ret = generate_def(r, cmd, args);
+
+            break;
+        case RRD_CONF_CDEF:
+
+            ret = generate_cdef(r, cmd, args);
+
+            break;
+        case RRD_CONF_VDEF:
+
+            ret = generate_vdef(r, cmd, args);
+
+            break;
+        case RRD_CONF_LINE:
+
+            ret = generate_line(r, cmd, cmds, args, &i);
+
+            break;
+        case RRD_CONF_AREA:
+
+            ret = generate_area(r, cmd, cmds, args, &i);
+
+            break;
+        case RRD_CONF_TICK:
+
+            ret = generate_tick(r, cmd, cmds, args, &i);
+
+            break;
+        case RRD_CONF_SHIFT:
+
+            ret = generate_shift(r, cmd, args);
+
+            break;
+        case RRD_CONF_PRINT:
+
+            ret = generate_print(r, cmd, args);
+
+            break;
+        case RRD_CONF_GPRINT:
+
+            ret = generate_gprint(r, cmd, args);
+
+            break;
+        case RRD_CONF_HRULE:
+
+            ret = generate_hrule(r, cmd, args);
+
+            break;
+        case RRD_CONF_VRULE:
+
+            ret = generate_vrule(r, cmd, args);
+
+            break;
+        case RRD_CONF_COMMENT:
+        case RRD_CONF_TEXTALIGN:
+
+            ret = generate_element(r, cmd, args);
+
+            break;
+        }
+
+        if (OK != ret) {
+            return ret;
+        }
+
+    }
+
+    for (i = 0; i < args->nelts; ++i) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r, "mod_rrd: rrdgraph:%d: %s",
+                i, ((const char **) args->elts)[i]);
+    }
+
+    return OK;
+}
+
+static int cleanup_args(request_rec *r, rrd_cmds_t *cmds)
+{
+    rrd_cmd_t *cmd;
+    int i;
+
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        request_rec **rr;
+
+        cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+
+        /* free all the saved requests */
+        if (RRD_CONF_DEF == cmd->type && cmd->d.requests) {
+            while ((rr = apr_array_pop(cmd->d.requests))) {
+                apr_pool_destroy((*rr)->pool);
+            }
+        }
+        if (RRD_CONF_DEF == cmd->type && cmd->d.other) {
+            while ((rr = apr_array_pop(cmd->d.other))) {
+                apr_pool_destroy((*rr)->pool);
+            }
+        }
+
+    }
+
+    return OK;
+}
+
+static int pass_brigade(request_rec *r, apr_bucket_brigade *bb)
+{
+    apr_status_t rv;
+
+    /* send our response down the stack */
+    rv = ap_pass_brigade(r->output_filters, bb);
+    if (rv == APR_SUCCESS || r->status != HTTP_OK
+            || r->connection->aborted) {
+        return OK;
+    }
+    else {
+        /* no way to know what type of error occurred */
+        ap_log_rerror(
+                APLOG_MARK, APLOG_DEBUG, rv, r, "rrd_handler: ap_pass_brigade returned %i", rv);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+}
+
+static void info_json(request_rec *r, rrd_info_t *grinfo,
+        apr_bucket_brigade *ib)
+{
+    rrd_info_t *info;
+    int first = 1;
+
+    /* everything but the image, such as print[N] and value_min */
+    apr_brigade_puts(ib, NULL, NULL, "{");
+    for (info = grinfo; info; info = info->next) {
+        const char *val;
+
+        switch (info->type) {
+        case RD_I_VAL:
+            val = pjson_number(r->pool, info->value.u_val);
+            break;
+        case RD_I_CNT:
+            val = apr_psprintf(r->pool, "%lu", info->value.u_cnt);
+            break;
+        case RD_I_INT:
+            val = apr_psprintf(r->pool, "%d", info->value.u_int);
+            break;
+        case RD_I_STR:
+            val = apr_pstrcat(r->pool, "\"",
+                    pescape_json(r->pool, info->value.u_str), "\"", NULL);
+            break;
+        default:
+            /* skip blobs */
+            continue;
+        }
+
+        apr_brigade_printf(ib, NULL, NULL, "%s\"%s\":%s", first ? "" : ",",
+                pescape_json(r->pool, info->key), val);
+        first = 0;
+    }
+    apr_brigade_puts(ib, NULL, NULL, "}");
+}
+
+#if HAVE_RRD_FETCH_CB_REGISTER
+static void fetch_ctx_set(rrd_fetch_t *fetch)
+{
+#if APR_HAS_THREADS
+    if (rrd_fetch_key) {
+        apr_threadkey_private_set(fetch, rrd_fetch_key);
+        return;
+    }
+#endif
+    rrd_fetch_ctx = fetch;
+}
+
+static rrd_fetch_t *fetch_ctx_get(void)
+{
+#if APR_HAS_THREADS
+    if (rrd_fetch_key) {
+        void *fetch = NULL;
+
+        apr_threadkey_private_get(&fetch, rrd_fetch_key);
+        return fetch;
+    }
+#endif
+    return rrd_fetch_ctx;
+}
+#endif
+
+static void instance_waited(apr_time_t begin)
+{
+    apr_time_t now = apr_time_now();
+    apr_uint64_t wait = now - begin;
+    apr_uint32_t old, avg;
+
+    if (wait > APR_UINT32_MAX) {
+        wait = APR_UINT32_MAX;
+    }
+
+    /* a moving average of the lock wait, weighted to recent renders */
+    do {
+        old = apr_atomic_read32(&rrd_render_wait);
+        avg = (apr_uint32_t) (((apr_uint64_t) old * 7 + wait) / 8);
+    } while (apr_atomic_cas32(&rrd_render_wait, avg, old) != old);
+
+    apr_atomic_set32(&rrd_render_waited, (apr_uint32_t) apr_time_sec(now));
+}
+
+/*
+ * Wait for a copy of librrd. Renders of the same request share a count
+ * of their own that is nonzero while any of them waits, so that the
+ * request is queued once however many of its renders wait.
+ */
+/*
+ * Make room for the copies of librrd, and fill in the linked copy.
+ */
+static rrd_instance_t *instance_linked(apr_pool_t *p, int instances)
+{
+    rrd_instance_t *instance;
+
+    rrd_instances = apr_pcalloc(p, instances * sizeof(rrd_instance_t));
+    instance = &rrd_instances[rrd_instance_count++];
+    instance->graph_v = rrd_graph_v;
+    instance->info_r = rrd_info_r;
+    instance->info_free = rrd_info_free;
+    instance->get_error = rrd_get_error;
+    instance->clear_error = rrd_clear_error;
+    instance->set_error = rrd_set_error;
+    instance->fetch_r = rrd_fetch_r;
+    instance->parsetime = rrd_parsetime;
+    instance->proc_start_end = rrd_proc_start_end;
+    instance->freemem = rrd_freemem;
+    instance->malloc = malloc;
+    instance->free = free;
+
+    return instance;
+}
+
+static rrd_instance_t *instance_acquire(volatile apr_uint32_t *waiting)
+{
+    rrd_instance_t *instance = &rrd_instances[0];
+#if APR_HAS_THREADS
+    apr_time_t begin;
+    int i;
+
+    /* librrd is not thread safe, unless the MPM is not threaded */
+    if (!instance->mutex) {
+        return instance;
+    }
+
+    begin = apr_time_now();
+
+    /* take the first copy of librrd that is not busy rendering */
+    for (i = 0; i < rrd_instance_count; ++i) {
+        if (apr_thread_mutex_trylock(rrd_instances[i].mutex) == APR_SUCCESS) {
+            instance_waited(begin);
+            return &rrd_instances[i];
+        }
+    }
+
+    /* all busy, queue behind each copy in turn */
+    if (!waiting || !apr_atomic_inc32(waiting)) {
+        apr_atomic_inc32(&rrd_render_queue);
+    }
+    instance = &rrd_instances[apr_atomic_inc32(&rrd_instance_next)
+            % rrd_instance_count];
+    apr_thread_mutex_lock(instance->mutex);
+    if (!waiting || !apr_atomic_dec32(waiting)) {
+        apr_atomic_dec32(&rrd_render_queue);
+    }
+    instance_waited(begin);
+#endif
+
+    return instance;
+}
+
+static void instance_release(rrd_instance_t *instance)
+{
+#if APR_HAS_THREADS
+    if (instance->mutex) {
+        apr_thread_mutex_unlock(instance->mutex);
+    }
+#endif
+}
+
+/*
+ * A pool with an allocator of its own, under the given parent, or
+ * unmanaged without one. Memory used away from the request thread, or
+ * outliving the request, comes from pools such as this.
+ */
+static apr_pool_t *allocator_pool(apr_pool_t *parent)
+{
+    apr_allocator_t *allocator;
+    apr_pool_t *pool;
+    apr_status_t rv;
+
+    if (apr_allocator_create(&allocator) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    rv = parent ? apr_pool_create_ex(&pool, parent, NULL, allocator) :
+            apr_pool_create_unmanaged_ex(&pool, NULL, allocator);
+    if (APR_SUCCESS != rv) {
+        apr_allocator_destroy(allocator);
+        return NULL;
+    }
+    apr_allocator_owner_set(allocator, pool);
+
+    return pool;
+}
+
+#if APR_HAS_THREADS
+/*
+ * The request pool is not thread safe. Work handed to other threads gets
+ * a pool of its own under the pool returned here, created and destroyed
+ * in the request thread, and all sharing one allocator that is.
+ */
+static apr_pool_t *worker_pool(request_rec *r)
+{
+    apr_thread_mutex_t *mutex;
+    apr_pool_t *pool = allocator_pool(r->pool);
+
+    if (pool && apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT,
+            pool) == APR_SUCCESS) {
+        apr_allocator_mutex_set(apr_pool_allocator_get(pool), mutex);
+        return pool;
+    }
+    if (pool) {
+        apr_pool_destroy(pool);
+    }
+
+    return NULL;
+}
+#endif
+
+static int render_rrdgraph(request_rec *r, rrd_cmds_t *cmds,
+        apr_array_header_t *args, apr_bucket_brigade *bb,
+        apr_bucket_brigade *ib, int skip)
+{
+    rrd_info_t *grinfo, *info;
+    rrd_instance_t *instance;
+    apr_time_t begin;
+    int ret = OK;
+#if HAVE_RRD_FETCH_CB_REGISTER
+    rrd_fetch_t fetch;
+#endif
+
+    /* rrd_graph_v is not thread safe, wait for a free copy of librrd */
+    instance = instance_acquire(NULL);
+    begin = apr_time_now();
+
+#if HAVE_RRD_FETCH_CB_REGISTER
+    /* make the request visible to distribution_cb() */
+    fetch.r = r;
+    fetch.cmds = cmds;
+    fetch.instance = instance;
+    fetch_ctx_set(&fetch);
+#endif
+
+    /* we're ready, let's generate the graph */
+    grinfo = instance->graph_v(args->nelts, (char **)args->elts);
+    if (grinfo == NULL) {
+        log_message(r, APR_SUCCESS, "Call to rrd_graph_v failed",
+                instance->get_error());
+        ret = HTTP_INTERNAL_SERVER_ERROR;
+    }
+    else {
+        /* grab the image data from the results */
+        for (info = grinfo; info; info = info->next) {
+            if (strcmp(info->key, "image") == 0) {
+                const char *buf = (const char *)info->value.u_blo.ptr;
+                apr_size_t len = info->value.u_blo.size;
+
+                /* drop leading lines, such as a repeated header */
+                while (skip-- > 0 && len) {
+                    const char *eol = memchr(buf, '\n', len);
+                    if (!eol) {
+                        len = 0;
+                        break;
+                    }
+                    len -= eol + 1 - buf;
+                    buf = eol + 1;
+                }
+
+                apr_brigade_write(bb, NULL, NULL, buf, len);
+                break;
+            }
+            /* skip anything else */
+        }
+
+        /* keep the graph metadata if asked, before it is freed */
+        if (ib) {
+            info_json(r, grinfo, ib);
+        }
+
+        instance->info_free(grinfo);
+    }
+    instance->clear_error();
+
+#if HAVE_RRD_FETCH_CB_REGISTER
+    fetch_ctx_set(NULL);
+#endif
+
+    cmds->rendered += apr_time_now() - begin;
+
+    instance_release(instance);
+
+    return ret;
+}
+
+static const char *lookup_arg(apr_array_header_t *args, const char *key)
+{
+    const char *val = NULL;
+    int i;
+
+    /* the options follow "rrdgraph - --imgformat format", last one wins */
+    for (i = 4; i + 1 < args->nelts; ++i) {
+        if (strcmp(APR_ARRAY_IDX(args, i, const char *), key) == 0) {
+            val = APR_ARRAY_IDX(args, ++i, const char *);
+        }
+    }
+
+    return val;
+}
+
+static int parse_window(request_rec *r, apr_array_header_t *args,
+        time_t *start, time_t *end, unsigned long *step)
+{
+    rrd_instance_t *instance;
+    rrd_time_value_t start_tv, end_tv;
+    const char *start_spec, *end_spec, *val;
+    char *err;
+    long width = 400;
+    int ret = OK;
+
+    start_spec = (val = lookup_arg(args, "--start")) ? val : "end-24h";
+    end_spec = (val = lookup_arg(args, "--end")) ? val : "now";
+    *step = (val = lookup_arg(args, "--step")) ? strtoul(val, NULL, 10) : 0;
+    if ((val = lookup_arg(args, "--width"))) {
+        width = atol(val);
+    }
+
+    /* the time parser and error state of librrd are not thread safe */
+    instance = instance_acquire(NULL);
+
+    if ((err = instance->parsetime(start_spec, &start_tv))
+            || (err = instance->parsetime(end_spec, &end_tv))) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "Could not parse the time window '%s' to '%s'",
+                        start_spec, end_spec), err);
+        ret = HTTP_BAD_REQUEST;
+    }
+    else if (instance->proc_start_end(&start_tv, &end_tv, start, end) == -1) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "Could not resolve the time window '%s' to '%s'",
+                        start_spec, end_spec), instance->get_error());
+        instance->clear_error();
+        ret = HTTP_BAD_REQUEST;
+    }
+
+    instance_release(instance);
+
+    if (OK != ret) {
+        return ret;
+    }
+
+    /* no explicit step, use the step rrdgraph would pick for the width */
+    if (!*step) {
+        *step = (*end - *start) / (width > 0 ? width : 400);
+        if (!*step) {
+            *step = 1;
+        }
+    }
+
+    return OK;
+}
+
+static apr_array_header_t *partition_args(request_rec *r,
+        apr_array_header_t *args, time_t start, time_t end,
+        unsigned long step)
+{
+    apr_array_header_t *pargs = apr_array_make(r->pool, args->nelts + 6,
+            sizeof(const char *));
+    int i;
+
+    for (i = 0; i < args->nelts; ++i) {
+        const char *arg = APR_ARRAY_IDX(args, i, const char *);
+
+        /* drop the window of the original request */
+        if (i >= 4 && i + 1 < args->nelts && (strcmp(arg, "--start") == 0
+                || strcmp(arg, "--end") == 0 || strcmp(arg, "--step") == 0)) {
+            ++i;
+            continue;
+        }
+
+        APR_ARRAY_PUSH(pargs, const char *) = arg;
+
+        /* and replace it with the window of the partition */
+        if (i == 3) {
+            APR_ARRAY_PUSH(pargs, const char *) = "--start";
+            APR_ARRAY_PUSH(pargs, const char *) =
+                    apr_psprintf(r->pool, "%ld", (long) start);
+            APR_ARRAY_PUSH(pargs, const char *) = "--end";
+            APR_ARRAY_PUSH(pargs, const char *) =
+                    apr_psprintf(r->pool, "%ld", (long) end);
+            APR_ARRAY_PUSH(pargs, const char *) = "--step";
+            APR_ARRAY_PUSH(pargs, const char *) =
+                    apr_psprintf(r->pool, "%lu", step);
+        }
+    }
+
+    return pargs;
+}
+
+static const char *index_sidecar(apr_pool_t *p, apr_array_header_t *indexes,
+        const char *filename)
+{
+    int i;
+
+    for (i = 0; indexes && i < indexes->nelts; ++i) {
+        rrd_index_t *index = &APR_ARRAY_IDX(indexes, i, rrd_index_t);
+        apr_size_t len = strlen(index->root);
+
+        if (!strncmp(filename, index->root, len) && filename[len] == '/') {
+            return apr_pstrcat(p, index->dir, filename + len, ".idx", NULL);
+        }
+    }
+
+    return NULL;
+}
+
+static double index_stat(const rrd_summary_t *buckets, int count,
+        apr_int64_t end, apr_interval_time_t size, time_t from,
+        const char *stat)
+{
+    double val = NAN, sum = 0;
+    int b, n = 0;
+
+    /* buckets ending inside the window, the most recent first */
+    for (b = 0; b < count && end - b * size > from; ++b) {
+        const rrd_summary_t *bucket = &buckets[b];
+
+        if (!strcmp(stat, "min")) {
+            val = isnan(val) || bucket->min < val ? bucket->min : val;
+        }
+        else if (!strcmp(stat, "max")) {
+            val = isnan(val) || bucket->max > val ? bucket->max : val;
+        }
+        else if (!strcmp(stat, "last")) {
+            if (isnan(val)) {
+                val = bucket->last;
+            }
+        }
+        else if (!isnan(bucket->avg)) {
+            sum += bucket->avg;
+            n++;
+        }
+    }
+
+    if (!strcmp(stat, "average")) {
+        val = n ? sum / n : NAN;
+    }
+
+    return val;
+}
+
+static int index_header_valid(const rrd_index_header_t *header)
+{
+    return !memcmp(header->magic, RRD_INDEX_MAGIC, sizeof(header->magic))
+            && header->order == RRD_INDEX_ORDER
+            && header->hours == RRD_INDEX_HOURS
+            && header->days == RRD_INDEX_DAYS;
+}
+
+static double index_lookup(apr_pool_t *p, const char *sidecar,
+        const char *dsname, time_t from, const char *stat)
+{
+    rrd_index_header_t header;
+    rrd_index_ds_t ds;
+    apr_file_t *file;
+    apr_size_t len;
+    apr_uint32_t i;
+    double val = NAN;
+
+    if (apr_file_open(&file, sidecar, APR_FOPEN_READ | APR_FOPEN_BINARY,
+            APR_FPROT_OS_DEFAULT, p) != APR_SUCCESS) {
+        return NAN;
+    }
+
+    if (apr_file_read_full(file, &header, sizeof(header), &len) == APR_SUCCESS
+            && index_header_valid(&header)) {
+        for (i = 0; i < header.ds_cnt; ++i) {
+            if (apr_file_read_full(file, &ds, sizeof(ds), &len)
+                    != APR_SUCCESS) {
+                break;
+            }
+            if (strncmp(ds.name, dsname, RRD_INDEX_NAME)) {
+                continue;
+            }
+
+            /* hours when they cover the window, otherwise days */
+            if (header.hour_end - RRD_INDEX_HOURS * 3600 <= from) {
+                val = index_stat(ds.hours, RRD_INDEX_HOURS, header.hour_end,
+                        3600, from, stat);
+            }
+            else {
+                val = index_stat(ds.days, RRD_INDEX_DAYS, header.day_end,
+                        86400, from, stat);
+            }
+            break;
+        }
+    }
+
+    apr_file_close(file);
+
+    return val;
+}
+
+static int fanout_compare(const void *a, const void *b)
+{
+    const rrd_match_t *ma = a, *mb = b;
+
+    /* the busiest first, otherwise keep the order of the matches */
+    if (ma->indexed != mb->indexed) {
+        return ma->indexed < mb->indexed ? 1 : -1;
+    }
+    return ma->order - mb->order;
+}
+
+static void degrade_fanout(request_rec *r, rrd_conf *conf, rrd_cmds_t *cmds)
+{
+    rrd_server_conf *sconf = ap_get_module_config(r->server->module_config,
+            &rrd_module);
+    time_t from = apr_time_sec(r->request_time) - 86400;
+    int limit = conf->fanout_set ? conf->fanout : RRD_FANOUT;
+    int i, j;
+
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+        rrd_match_t *matches;
+        int nelts;
+
+        switch (cmd->type) {
+        case RRD_CONF_DEF:
+
+            /* an alias follows the DEF it shares files with */
+            if (cmd->d.alias) {
+                cmd->d.other_legend = cmd->d.alias->d.other_legend;
+                cmd->num = cmd->d.alias->num;
+                break;
+            }
+
+            nelts = cmd->d.requests->nelts;
+            if (cmd->d.distribution || nelts <= limit) {
+                break;
+            }
+
+            /* rank by the daily average in the summary index, where indexed */
+            matches = apr_palloc(r->pool, nelts * sizeof(rrd_match_t));
+            for (j = 0; j < nelts; ++j) {
+                request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, j, request_rec *);
+                const char *sidecar = index_sidecar(r->pool, sconf->indexes,
+                        rr->filename);
+
+                matches[j].rr = rr;
+                matches[j].order = j;
+                matches[j].indexed = sidecar ? index_lookup(r->pool, sidecar,
+                        cmd->d.dsname, from, "average") : NAN;
+                if (isnan(matches[j].indexed)) {
+                    matches[j].indexed = -HUGE_VAL;
+                }
+            }
+            qsort(matches, nelts, sizeof(rrd_match_t), fanout_compare);
+
+            /*
+             * The busiest keep a series each, and the rest are summed into
+             * one, so that far fewer series are drawn and described.
+             */
+            cmd->d.requests->nelts = 0;
+            cmd->d.other = apr_array_make(r->pool, nelts - limit,
+                    sizeof(request_rec *));
+            for (j = 0; j < nelts; ++j) {
+                APR_ARRAY_PUSH(j < limit ? cmd->d.requests : cmd->d.other,
+                        request_rec *) = matches[j].rr;
+            }
+            cmd->d.other_legend = apr_psprintf(r->pool, "other (%d)",
+                    nelts - limit);
+            cmd->num = limit + 1;
+
+            break;
+        case RRD_CONF_VDEF:
+
+            /* follow the new number of series */
+            cmd->num = cmd->v.ref->num;
+
+            break;
+        case RRD_CONF_CDEF:
+
+            if (cmd->c.ref) {
+                cmd->num = cmd->c.ref->num;
+            }
+
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/*
+ * Page through the matches of each wildcard DEF, limit at a time. The
+ * cursor carries the offset of the next page and a version of the full
+ * match list, so that a page is never stitched to a changed match set.
+ */
+static int page_rrds(request_rec *r, rrd_conf *conf, rrd_cmds_t *cmds)
+{
+    const char *limit = apr_table_get(cmds->params, "limit");
+    const char *cursor = apr_table_get(cmds->params, "cursor");
+    const char *format, *version, *query;
+    apr_sha1_ctx_t sha1;
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    char *end, *hex, *tok, *last;
+    apr_int64_t offset = 0, count;
+    int i, j, found = 0, more = 0;
+
+    if (!limit && !cursor) {
+        return OK;
+    }
+
+    format = conf->format ? conf->format : parse_rrdgraph_suffix(r);
+    if (!format || (!is_line_format(format) && strcasecmp(format, "JSON")
+            && strcasecmp(format, "JSONTIME") && strcasecmp(format, "XML")
+            && strcasecmp(format, "XMLENUM"))) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "Limit and cursor only apply to data exports: %s",
+                        format ? format : "(none)"), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    if (!limit) {
+        log_message(r, APR_SUCCESS, "Cursor needs a limit", NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    count = apr_strtoi64(limit, &end, 10);
+    if (*end || count < 1) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "Limit must be a positive number of series: %s",
+                        limit), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* the version covers every match, in the order they were found */
+    apr_sha1_init(&sha1);
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+
+        if (cmd->type != RRD_CONF_DEF || cmd->d.distribution
+                || cmd->d.alias) {
+            continue;
+        }
+        apr_sha1_update_binary(&sha1, (const unsigned char *)cmd->d.vname,
+                strlen(cmd->d.vname) + 1);
+        for (j = 0; j < cmd->d.requests->nelts; ++j) {
+            request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, j, request_rec *);
+
+            apr_sha1_update_binary(&sha1, (const unsigned char *)rr->filename,
+                    strlen(rr->filename) + 1);
+        }
+    }
+    apr_sha1_final(digest, &sha1);
+
+    hex = apr_palloc(r->pool, 17);
+    for (i = 0; i < 8; ++i) {
+        apr_snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+    version = hex;
+
+    /* [cursor=offset.version] */
+    if (cursor) {
+        offset = apr_strtoi64(cursor, &end, 10);
+        if (*end != '.' || offset < 0) {
+            log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "Cursor must be offset.version: %s",
+                            cursor), NULL);
+            return HTTP_BAD_REQUEST;
+        }
+        if (strcmp(end + 1, version)) {
+            log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "Matches have changed since the cursor was issued: %s",
+                            cursor), NULL);
+            return HTTP_CONFLICT;
+        }
+    }
+
+    /* keep this page of each DEF, let the rest go */
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+        int nelts, kept = 0;
+
+        switch (cmd->type) {
+        case RRD_CONF_DEF:
+
+            if (cmd->d.distribution) {
+                break;
+            }
+
+            /* an alias follows the DEF it shares files with */
+            if (cmd->d.alias) {
+                cmd->num = cmd->d.alias->num;
+                break;
+            }
+
+            nelts = cmd->d.requests->nelts;
+            for (j = 0; j < nelts; ++j) {
+                request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, j, request_rec *);
+
+                if (j >= offset && j < offset + count) {
+                    APR_ARRAY_IDX(cmd->d.requests, kept++, request_rec *) = rr;
+                }
+                else {
+                    apr_pool_destroy(rr->pool);
+                }
+            }
+            cmd->d.requests->nelts = kept;
+            cmd->num = kept;
+
+            found |= kept > 0;
+            more |= nelts > offset + count;
+
+            break;
+        case RRD_CONF_VDEF:
+
+            /* follow the new number of series */
+            cmd->num = cmd->v.ref->num;
+
+            break;
+        case RRD_CONF_CDEF:
+
+            if (cmd->c.ref) {
+                cmd->num = cmd->c.ref->num;
+            }
+
+            break;
+        default:
+            break;
+        }
+    }
+
+    /* no matches at all is an empty page, with no page after it */
+    if (!found && offset > 0) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "Cursor is past the last match: %s", cursor), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    apr_table_setn(r->headers_out, "X-RRD-Version", version);
+
+    /* the same query again, with the cursor moved on */
+    if (more) {
+        query = NULL;
+        for (tok = apr_strtok(apr_pstrdup(r->pool, r->args), "&;", &last);
+                tok; tok = apr_strtok(NULL, "&;", &last)) {
+            if (strncmp(tok, "cursor=", 7)) {
+                query = query ? apr_pstrcat(r->pool, query, "&", tok, NULL) : tok;
+            }
+        }
+        cursor = apr_psprintf(r->pool, "%" APR_INT64_T_FMT ".%s",
+                offset + count, version);
+        apr_table_setn(r->headers_out, "X-RRD-Cursor", cursor);
+        apr_table_setn(r->headers_out, "Link",
+                apr_psprintf(r->pool, "<%s?%s%scursor=%s>; rel=\"next\"",
+                        ap_escape_uri(r->pool, r->uri),
+                        query ? query : "", query ? "&" : "", cursor));
+    }
+
+    return OK;
+}
+
+static apr_array_header_t *degrade_reduce(request_rec *r,
+        apr_array_header_t *args)
+{
+    apr_array_header_t *rargs;
+    time_t start, end;
+    unsigned long step;
+    int i;
+
+    /* half the points */
+    if (parse_window(r, args, &start, &end, &step) == OK) {
+        args = partition_args(r, args, start, end, step * 2);
+    }
+
+    /* and drawn without anti-aliasing */
+    rargs = apr_array_make(r->pool, args->nelts + 2, sizeof(const char *));
+    for (i = 0; i < args->nelts; ++i) {
+        APR_ARRAY_PUSH(rargs, const char *) = APR_ARRAY_IDX(args, i, const char *);
+        if (i == 3) {
+            APR_ARRAY_PUSH(rargs, const char *) = "--graph-render-mode";
+            APR_ARRAY_PUSH(rargs, const char *) = "mono";
+        }
+    }
+
+    return rargs;
+}
+
+static rrd_tier_e degrade_tier(request_rec *r, rrd_conf *conf)
+{
+    apr_uint32_t queue = apr_atomic_read32(&rrd_render_queue);
+    apr_interval_time_t wait = apr_atomic_read32(&rrd_render_wait);
+    int tier;
+
+    /* a wait no render has measured lately says nothing about the load */
+    if (apr_time_sec(r->request_time)
+            - apr_atomic_read32(&rrd_render_waited) > RRD_WAIT_EXPIRY) {
+        wait = 0;
+    }
+
+    /* the most severe tier whose queue depth or lock wait is reached */
+    for (tier = RRD_TIER_REJECT; tier > RRD_TIER_NONE; --tier) {
+        rrd_degrade_t *degrade = &conf->degrade[tier];
+
+        if (degrade->set && ((degrade->queue && queue >= degrade->queue)
+                || (degrade->wait && wait >= degrade->wait))) {
+            return tier;
+        }
+    }
+
+    return RRD_TIER_NONE;
+}
+
+static const char *cache_digest(request_rec *r, rrd_conf *conf,
+        apr_sha1_ctx_t *sha1)
+{
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    char *hex;
+    int i;
+
+    apr_sha1_final(digest, sha1);
+
+    hex = apr_palloc(r->pool, APR_SHA1_DIGESTSIZE * 2 + 1);
+    for (i = 0; i < APR_SHA1_DIGESTSIZE; ++i) {
+        apr_snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+
+    return apr_pstrcat(r->pool, conf->cache, "/", hex, NULL);
+}
+
+static const char *cache_filename(request_rec *r, rrd_conf *conf,
+        apr_array_header_t *args)
+{
+    apr_sha1_ctx_t sha1;
+    int i;
+
+    if (!conf->cache) {
+        return NULL;
+    }
+
+    /* the arguments name every file, after the access checks */
+    apr_sha1_init(&sha1);
+    for (i = 0; i < args->nelts; ++i) {
+        const char *arg = APR_ARRAY_IDX(args, i, const char *);
+
+        apr_sha1_update_binary(&sha1, (const unsigned char *)arg,
+                strlen(arg) + 1);
+    }
+
+    return cache_digest(r, conf, &sha1);
+}
+
+/*
+ * The request as sent, before any file is matched or checked. It names
+ * the graph last cached for the same query from the same user and client
+ * address, which stand in for the access checks until that graph is
+ * stale.
+ */
+static const char *cache_request(request_rec *r, rrd_conf *conf)
+{
+    apr_sha1_ctx_t sha1;
+    const char *parts[4];
+    int i;
+
+    if (!conf->cache) {
+        return NULL;
+    }
+
+    parts[0] = r->uri;
+    parts[1] = r->args ? r->args : "";
+    parts[2] = r->user ? r->user : "";
+    parts[3] = r->useragent_ip ? r->useragent_ip : "";
+
+    /* never the same as arguments, which start with the program name */
+    apr_sha1_init(&sha1);
+    apr_sha1_update_binary(&sha1, (const unsigned char *)"", 1);
+    for (i = 0; i < 4; ++i) {
+        apr_sha1_update_binary(&sha1, (const unsigned char *)parts[i],
+                strlen(parts[i]) + 1);
+    }
+
+    return cache_digest(r, conf, &sha1);
+}
+
+static rrd_cache_e cache_lookup(request_rec *r, rrd_conf *conf,
+        const char *filename, apr_file_t **file, apr_finfo_t *finfo)
+{
+    *file = NULL;
+
+    if (!filename) {
+        return RRD_CACHE_OFF;
+    }
+
+    if (apr_file_open(file, filename, APR_FOPEN_READ | APR_FOPEN_BINARY,
+            APR_FPROT_OS_DEFAULT, r->pool) != APR_SUCCESS) {
+        *file = NULL;
+        return RRD_CACHE_MISS;
+    }
+
+    if (apr_file_info_get(finfo, APR_FINFO_SIZE | APR_FINFO_MTIME, *file)
+            != APR_SUCCESS) {
+        apr_file_close(*file);
+        *file = NULL;
+        return RRD_CACHE_MISS;
+    }
+
+    return r->request_time - finfo->mtime < conf->cache_maxage ?
+            RRD_CACHE_FRESH : RRD_CACHE_STALE;
+}
+
+/*
+ * A request key holds the name of the graph cached under its arguments,
+ * rather than a copy, so that a trim frees every graph it removes.
+ */
+static rrd_cache_e cache_follow(request_rec *r, rrd_conf *conf,
+        const char *request, apr_file_t **file, apr_finfo_t *finfo)
+{
+    apr_file_t *link;
+    char name[APR_SHA1_DIGESTSIZE * 2 + 1];
+    apr_status_t rv;
+
+    *file = NULL;
+
+    if (!request) {
+        return RRD_CACHE_OFF;
+    }
+
+    if (apr_file_open(&link, request, APR_FOPEN_READ | APR_FOPEN_BINARY,
+            APR_FPROT_OS_DEFAULT, r->pool) != APR_SUCCESS) {
+        return RRD_CACHE_MISS;
+    }
+    rv = apr_file_read_full(link, name, APR_SHA1_DIGESTSIZE * 2, NULL);
+    apr_file_close(link);
+
+    name[APR_SHA1_DIGESTSIZE * 2] = 0;
+    if (rv != APR_SUCCESS
+            || strspn(name, "0123456789abcdef") != APR_SHA1_DIGESTSIZE * 2) {
+        return RRD_CACHE_MISS;
+    }
+
+    return cache_lookup(r, conf,
+            apr_pstrcat(r->pool, conf->cache, "/", name, NULL), file, finfo);
+}
+
+static void cache_serve(request_rec *r, rrd_cache_e state, apr_file_t *file,
+        apr_finfo_t *finfo, apr_bucket_brigade *bb)
+{
+    apr_brigade_insert_file(bb, file, 0, finfo->size, r->pool);
+    ap_set_content_length(r, finfo->size);
+    if (RRD_CACHE_STALE == state) {
+        apr_table_setn(r->headers_out, "X-RRD-Degraded",
+                rrd_tiers[RRD_TIER_STALE]);
+    }
+}
+
+/*
+ * Remove the least recently used graphs until the cache fits its size
+ * again. A graph read since it was written is ranked by its access time,
+ * where the filesystem records one.
+ */
+static void cache_trim(apr_pool_t *p, const char *dir, apr_off_t size)
+{
+    apr_array_header_t *files = apr_array_make(p, 64, sizeof(apr_finfo_t));
+    apr_finfo_t dirent;
+    apr_file_t *lock;
+    apr_dir_t *d;
+    apr_off_t total = 0;
+    apr_status_t rv;
+    int i;
+
+    /* one trimmer at a time, the others leave it to that one */
+    if (apr_file_open(&lock, apr_pstrcat(p, dir, "/.trim", NULL),
+            APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_BINARY,
+            APR_FPROT_UREAD | APR_FPROT_UWRITE, p) != APR_SUCCESS) {
+        return;
+    }
+    if (apr_file_lock(lock, APR_FLOCK_EXCLUSIVE | APR_FLOCK_NONBLOCK)
+            != APR_SUCCESS) {
+        apr_file_close(lock);
+        return;
+    }
+
+    if (apr_dir_open(&d, dir, p) != APR_SUCCESS) {
+        apr_file_close(lock);
+        return;
+    }
+
+    while ((rv = apr_dir_read(&dirent, APR_FINFO_NAME | APR_FINFO_TYPE
+            | APR_FINFO_SIZE | APR_FINFO_MTIME | APR_FINFO_ATIME, d))
+                == APR_SUCCESS || rv == APR_INCOMPLETE) {
+
+        /* graphs in the making have a suffix, and are left alone */
+        if (dirent.filetype != APR_REG || !dirent.name
+                || strchr(dirent.name, '.')) {
+            continue;
+        }
+
+        if (dirent.atime > dirent.mtime) {
+            dirent.mtime = dirent.atime;
+        }
+        dirent.fname = apr_pstrcat(p, dir, "/", dirent.name, NULL);
+        APR_ARRAY_PUSH(files, apr_finfo_t) = dirent;
+        total += dirent.size;
+    }
+
+    apr_dir_close(d);
+
+    if (total > size) {
+        qsort(files->elts, files->nelts, sizeof(apr_finfo_t), lru_compare);
+    }
+
+    for (i = 0; i < files->nelts && total > size; ++i) {
+        apr_finfo_t *finfo = &APR_ARRAY_IDX(files, i, apr_finfo_t);
+
+        /* a graph being served stays open, and is read to the end */
+        if (apr_file_remove(finfo->fname, p) == APR_SUCCESS) {
+            total -= finfo->size;
+        }
+    }
+
+    apr_file_close(lock);
+}
+
+static apr_status_t cache_write(apr_pool_t *p, const char *dir,
+        apr_off_t size, const char *filename, const char *buf, apr_size_t len)
+{
+    apr_file_t *file;
+    char *tmp;
+    apr_uint32_t kb = (apr_uint32_t) (len / 1024 + 1), written;
+    apr_status_t rv;
+
+    /* write to a temporary file, then rename over the old graph */
+    tmp = apr_pstrcat(p, filename, ".XXXXXX", NULL);
+    rv = apr_file_mktemp(&file, tmp, APR_FOPEN_CREATE | APR_FOPEN_WRITE
+            | APR_FOPEN_EXCL | APR_FOPEN_BINARY, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_write_full(file, buf, len, NULL);
+        apr_file_close(file);
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_rename(tmp, filename, p);
+        }
+        if (rv != APR_SUCCESS) {
+            apr_file_remove(tmp, p);
+        }
+    }
+
+    /* trim once an eighth of the cache has been written by all children */
+    written = apr_atomic_add32(rrd_cache_written, kb) + kb;
+    if (rv == APR_SUCCESS && written >= size / 1024 / 8
+            && apr_atomic_cas32(rrd_cache_written, 0, written) == written) {
+        cache_trim(p, dir, size);
+    }
+
+    return rv;
+}
+
+static void cache_store(request_rec *r, const char *filename,
+        apr_bucket_brigade *bb)
+{
+    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
+            &rrd_module);
+    char *buf;
+    apr_size_t len;
+    apr_status_t rv;
+
+    rv = apr_brigade_pflatten(bb, &buf, &len, r->pool);
+    if (rv == APR_SUCCESS) {
+        rv = cache_write(r->pool, conf->cache, conf->cache_size, filename,
+                buf, len);
+    }
+
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r,
+                "mod_rrd: Could not cache the graph in '%s', ignoring",
+                filename);
+    }
+}
+
+static void cache_link(request_rec *r, const char *request, const char *cache)
+{
+    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
+            &rrd_module);
+    const char *name = ap_strrchr_c(cache, '/') + 1;
+    apr_status_t rv;
+
+    if (!request) {
+        return;
+    }
+
+    rv = cache_write(r->pool, conf->cache, conf->cache_size, request, name,
+            strlen(name));
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r,
+                "mod_rrd: Could not link the request to the graph in '%s', "
+                "ignoring", request);
+    }
+}
+
+static int has_distribution(rrd_cmds_t *cmds)
+{
+    int i;
+
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+
+        if (RRD_CONF_DEF == cmd->type && cmd->d.distribution) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#if APR_HAS_THREADS
+/*
+ * A background render of a neighbouring window into the graph cache,
+ * owning its pool and copies of everything it needs.
+ */
+typedef struct rrd_prefetch_t {
+    apr_pool_t *pool;
+    server_rec *s;
+    apr_array_header_t *args;
+    const char *dir;
+    apr_off_t size;
+    const char *cache;
+} rrd_prefetch_t;
+
+static void * APR_THREAD_FUNC prefetch_task(apr_thread_t *thread, void *data)
+{
+    rrd_prefetch_t *prefetch = data;
+    rrd_instance_t *instance = NULL;
+    rrd_info_t *grinfo, *info;
+    apr_status_t rv;
+    int i, j;
+
+    /*
+     * Never queue ahead of a request, and take a copy of librrd only if
+     * free. Prefetches hold at most all copies but one, and only start
+     * while another copy is left free for the next request.
+     */
+    if (apr_atomic_inc32(&rrd_prefetch_rendering) + 1 < rrd_instance_count
+            && !apr_atomic_read32(&rrd_render_queue)) {
+        for (i = 0; i < rrd_instance_count; ++i) {
+            if (apr_thread_mutex_trylock(rrd_instances[i].mutex)
+                    == APR_SUCCESS) {
+                instance = &rrd_instances[i];
+                break;
+            }
+        }
+        for (j = i + 1; instance && j < rrd_instance_count; ++j) {
+            if (apr_thread_mutex_trylock(rrd_instances[j].mutex)
+                    == APR_SUCCESS) {
+                apr_thread_mutex_unlock(rrd_instances[j].mutex);
+                break;
+            }
+        }
+        if (instance && j == rrd_instance_count) {
+            instance_release(instance);
+            instance = NULL;
+        }
+    }
+
+    if (instance) {
+        grinfo = instance->graph_v(prefetch->args->nelts,
+                (char **)prefetch->args->elts);
+        for (info = grinfo; info; info = info->next) {
+            if (strcmp(info->key, "image") == 0) {
+                rv = cache_write(prefetch->pool, prefetch->dir,
+                        prefetch->size, prefetch->cache,
+                        (const char *)info->value.u_blo.ptr,
+                        info->value.u_blo.size);
+                if (rv != APR_SUCCESS) {
+                    ap_log_error(APLOG_MARK, APLOG_WARNING, rv, prefetch->s,
+                            "mod_rrd: Could not cache the prefetched graph "
+                            "in '%s', ignoring", prefetch->cache);
+                }
+                break;
+            }
+        }
+        if (grinfo) {
+            instance->info_free(grinfo);
+        }
+        instance->clear_error();
+        instance_release(instance);
+    }
+
+    apr_atomic_dec32(&rrd_prefetch_rendering);
+    apr_atomic_dec32(&rrd_prefetch_pending);
+    apr_pool_destroy(prefetch->pool);
+
+    return NULL;
+}
+#endif
+
+/*
+ * After a graph is rendered with an explicit window, queue renders of the
+ * windows a pan or zoom asks for next: the window before, the window
+ * after if it has happened yet, and the window zoomed out by two.
+ */
+static void prefetch_rrdgraph(request_rec *r, rrd_conf *conf,
+        rrd_cmds_t *cmds, apr_array_header_t *args)
+{
+#if APR_HAS_THREADS
+    const char *val;
+    char *last;
+    apr_int64_t start, end, span, windows[3][2];
+    time_t now = apr_time_sec(r->request_time);
+    int i, j, count = 0;
+
+    /* prefetches need a copy of librrd to spare */
+    if (!conf->prefetch || !conf->cache || !rrd_workers
+            || !rrd_instances[0].mutex || rrd_instance_count < 2) {
+        return;
+    }
+
+    /* only epoch times are predictable, as a client pans with them */
+    if (!(val = lookup_arg(args, "--start"))
+            || (start = apr_strtoi64(val, &last, 10), *last)
+            || !(val = lookup_arg(args, "--end"))
+            || (end = apr_strtoi64(val, &last, 10), *last)
+            || (span = end - start) <= 0) {
+        return;
+    }
+
+    /* the distribution callback reads from the request, which is gone */
+    if (has_distribution(cmds)) {
+        return;
+    }
+
+    windows[count][0] = start - span;
+    windows[count++][1] = start;
+    if (end + span <= now) {
+        windows[count][0] = end;
+        windows[count++][1] = end + span;
+    }
+    windows[count][0] = start - span / 2;
+    windows[count++][1] = end + span / 2;
+
+    for (i = 0; i < count; ++i) {
+        apr_array_header_t *window;
+        rrd_prefetch_t *prefetch;
+        apr_pool_t *pool;
+        apr_file_t *file;
+        apr_finfo_t finfo;
+        const char *cache;
+
+        if (apr_atomic_read32(&rrd_prefetch_pending) >= RRD_PREFETCH_MAX) {
+            break;
+        }
+
+        /* the same arguments a request for the window would generate */
+        window = apr_array_copy(r->pool, args);
+        for (j = 4; j + 1 < window->nelts; ++j) {
+            const char *arg = APR_ARRAY_IDX(window, j, const char *);
+
+            if (strcmp(arg, "--start") == 0) {
+                APR_ARRAY_IDX(window, ++j, const char *) = apr_psprintf(
+                        r->pool, "%" APR_INT64_T_FMT, windows[i][0]);
+            }
+            else if (strcmp(arg, "--end") == 0) {
+                APR_ARRAY_IDX(window, ++j, const char *) = apr_psprintf(
+                        r->pool, "%" APR_INT64_T_FMT, windows[i][1]);
+            }
+        }
+
+        cache = cache_filename(r, conf, window);
+        if (cache_lookup(r, conf, cache, &file, &finfo) == RRD_CACHE_FRESH) {
+            apr_file_close(file);
+            continue;
+        }
+        if (file) {
+            apr_file_close(file);
+        }
+
+        /* the request is gone by the time this runs, copy everything */
+        pool = allocator_pool(NULL);
+        if (!pool) {
+            break;
+        }
+
+        prefetch = apr_palloc(pool, sizeof(rrd_prefetch_t));
+        prefetch->pool = pool;
+        prefetch->s = r->server;
+        prefetch->dir = apr_pstrdup(pool, conf->cache);
+        prefetch->size = conf->cache_size;
+        prefetch->cache = apr_pstrdup(pool, cache);
+        prefetch->args = apr_array_make(pool, window->nelts,
+                sizeof(const char *));
+        for (j = 0; j < window->nelts; ++j) {
+            APR_ARRAY_PUSH(prefetch->args, const char *) = apr_pstrdup(pool,
+                    APR_ARRAY_IDX(window, j, const char *));
+        }
+
+        apr_atomic_inc32(&rrd_prefetch_pending);
+        if (apr_thread_pool_push(rrd_workers, prefetch_task, prefetch,
+                APR_THREAD_TASK_PRIORITY_LOWEST, NULL) != APR_SUCCESS) {
+            apr_atomic_dec32(&rrd_prefetch_pending);
+            apr_pool_destroy(pool);
+            break;
+        }
+    }
+#endif
+}
+
+
+static int sketch_compare_opt(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static int sketch_param(void *rec, const char *key, const char *val)
+{
+    apr_array_header_t *opts = rec;
+
+    /* every page of the same graph is the same graph */
+    if (strcmp(key, "cursor")) {
+        APR_ARRAY_PUSH(opts, const char *) = apr_pstrcat(opts->pool, key,
+                "=", val, NULL);
+    }
+
+    return 1;
+}
+
+static const char *sketch_spec(request_rec *r, rrd_cmds_t *cmds)
+{
+    apr_array_header_t *opts, *elts;
+    int i;
+
+    opts = apr_array_make(r->pool, 8, sizeof(const char *));
+    elts = apr_array_make(r->pool, 8, sizeof(const char *));
+
+    /* options sorted, elements in order, and the time window left out */
+    for (i = 0; i < cmds->opts->nelts; ++i) {
+        rrd_opt_t *opt = &APR_ARRAY_IDX(cmds->opts, i, rrd_opt_t);
+
+        if (strcmp(opt->key, "start") && strcmp(opt->key, "end")) {
+            APR_ARRAY_PUSH(opts, const char *) = opt->val ?
+                    apr_pstrcat(r->pool, opt->key, "=", opt->val, NULL) :
+                    opt->key;
+        }
+    }
+    apr_table_do(sketch_param, opts, cmds->params, NULL);
+    qsort(opts->elts, opts->nelts, sizeof(const char *), sketch_compare_opt);
+
+    /* elements of the configuration are the same for every request */
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+
+        if (cmd->element) {
+            APR_ARRAY_PUSH(elts, const char *) = cmd->element;
+        }
+    }
+
+    return apr_pstrcat(r->pool, r->uri, "?", apr_array_pstrcat(r->pool, opts, '&'),
+            opts->nelts && elts->nelts ? "&" : "",
+            apr_array_pstrcat(r->pool, elts, '&'), NULL);
+}
+
+/*
+ * The sketch is indexed twice in shared memory, so that neither a known
+ * spec nor the lightest spec to evict is found by scanning every slot
+ * under the global lock: an open addressed hash of spec to slot, and a
+ * min heap of slots on their weight.
+ */
+static int sketch_find(apr_uint64_t hash)
+{
+    int mask = rrd_sketch_buckets - 1;
+    int b = (int)(hash & mask), slot;
+
+    while ((slot = rrd_sketch_index[b])) {
+        if (rrd_sketch[slot - 1].hash == hash) {
+            return slot - 1;
+        }
+        b = (b + 1) & mask;
+    }
+
+    return -1;
+}
+
+static void sketch_insert(int slot)
+{
+    int mask = rrd_sketch_buckets - 1;
+    int b = (int)(rrd_sketch[slot].hash & mask);
+
+    while (rrd_sketch_index[b]) {
+        b = (b + 1) & mask;
+    }
+    rrd_sketch_index[b] = slot + 1;
+}
+
+static void sketch_remove(int slot)
+{
+    int mask = rrd_sketch_buckets - 1;
+    int b = (int)(rrd_sketch[slot].hash & mask), j, home;
+
+    while (rrd_sketch_index[b] != slot + 1) {
+        b = (b + 1) & mask;
+    }
+    rrd_sketch_index[b] = 0;
+
+    /* pull back the specs that probed past the hole */
+    for (j = (b + 1) & mask; rrd_sketch_index[j]; j = (j + 1) & mask) {
+        home = (int)(rrd_sketch[rrd_sketch_index[j] - 1].hash & mask);
+        if (b < j ? (home > b && home <= j) : (home > b || home <= j)) {
+            continue;
+        }
+        rrd_sketch_index[b] = rrd_sketch_index[j];
+        rrd_sketch_index[j] = 0;
+        b = j;
+    }
+}
+
+static void sketch_sift(int pos)
+{
+    int child, least, swap;
+
+    /* weights only grow, so a slot only ever moves down */
+    for (;;) {
+        least = pos;
+        for (child = 2 * pos + 1; child <= 2 * pos + 2
+                && child < rrd_sketch_count; ++child) {
+            if (rrd_sketch[rrd_sketch_heap[child]].weight
+                    < rrd_sketch[rrd_sketch_heap[least]].weight) {
+                least = child;
+            }
+        }
+        if (least == pos) {
+            return;
+        }
+        swap = rrd_sketch_heap[pos];
+        rrd_sketch_heap[pos] = rrd_sketch_heap[least];
+        rrd_sketch_heap[least] = swap;
+        rrd_sketch[rrd_sketch_heap[pos]].heap = pos;
+        rrd_sketch[rrd_sketch_heap[least]].heap = least;
+        pos = least;
+    }
+}
+
+static void sketch_record(request_rec *r, rrd_cmds_t *cmds, int cached)
+{
+    rrd_hitter_t *hitter;
+    apr_uint64_t hash = APR_UINT64_C(14695981039346656037), files = 0;
+    const char *spec, *c;
+    int i, slot;
+
+    if (!rrd_sketch) {
+        return;
+    }
+
+    spec = sketch_spec(r, cmds);
+    for (c = spec; *c; ++c) {
+        hash = (hash ^ (unsigned char)*c) * APR_UINT64_C(1099511628211);
+    }
+
+    /* a cache hit matched no files */
+    for (i = 0; !cached && i < cmds->cmds->nelts; ++i) {
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+
+        if (RRD_CONF_DEF == cmd->type && !cmd->d.alias) {
+            files += cmd->d.requests->nelts;
+        }
+    }
+
+    if (apr_global_mutex_lock(rrd_sketch_mutex) != APR_SUCCESS) {
+        return;
+    }
+
+    slot = sketch_find(hash);
+
+    /* hits cost nothing, so are only counted against specs already known */
+    if (cached) {
+        if (slot >= 0) {
+            rrd_sketch[slot].cached++;
+        }
+        apr_global_mutex_unlock(rrd_sketch_mutex);
+        return;
+    }
+
+    /* not yet counted, take over the lightest spec and its weight */
+    if (slot < 0) {
+        slot = rrd_sketch_heap[0];
+        hitter = &rrd_sketch[slot];
+        if (hitter->hits) {
+            sketch_remove(slot);
+        }
+        hitter->error = hitter->weight;
+        hitter->busy = 0;
+        hitter->hits = 0;
+        hitter->cached = 0;
+        hitter->files = 0;
+        hitter->hash = hash;
+        apr_cpystrn(hitter->spec, spec, RRD_SKETCH_SPEC);
+        sketch_insert(slot);
+    }
+
+    hitter = &rrd_sketch[slot];
+    hitter->weight += (apr_uint64_t) cmds->rendered * (files ? files : 1);
+    hitter->busy += cmds->rendered;
+    hitter->hits++;
+    hitter->files += files;
+    sketch_sift(hitter->heap);
+
+    apr_global_mutex_unlock(rrd_sketch_mutex);
+}
+
+static int sketch_compare(const void *a, const void *b)
+{
+    const rrd_hitter_t *ha = a, *hb = b;
+
+    return ha->weight < hb->weight ? 1 : ha->weight > hb->weight ? -1 : 0;
+}
+
+static rrd_hitter_t *sketch_snapshot(apr_pool_t *p, int *count)
+{
+    rrd_hitter_t *hitters;
+    int i, n = 0;
+
+    *count = 0;
+    if (!rrd_sketch
+            || apr_global_mutex_lock(rrd_sketch_mutex) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    hitters = apr_palloc(p, rrd_sketch_count * sizeof(rrd_hitter_t));
+    for (i = 0; i < rrd_sketch_count; ++i) {
+        if (rrd_sketch[i].hits) {
+            hitters[n++] = rrd_sketch[i];
+        }
+    }
+
+    apr_global_mutex_unlock(rrd_sketch_mutex);
+
+    qsort(hitters, n, sizeof(rrd_hitter_t), sketch_compare);
+    *count = n;
+
+    return hitters;
+}
+
+/*
+ * Fetch one data source of a file. The error state of librrd is shared,
+ * so the fetch holds a copy of librrd, the one given when already held.
+ */
+static const char *fetch_series(apr_pool_t *p, rrd_instance_t *held,
+        const char *filename, const char *dsname, const char *cf,
+        time_t start, time_t end, unsigned long step, rrd_series_t *series)
+{
+    rrd_instance_t *instance = held ? held : instance_acquire(NULL);
+    char **ds_namv = NULL;
+    rrd_value_t *data = NULL;
+    unsigned long ds_cnt = 0, ds, i;
+    const char *err = NULL;
+
+    series->start = start;
+    series->end = end;
+    series->step = step;
+    series->rows = 0;
+    series->data = NULL;
+
+    if (instance->fetch_r(filename, apr_pstrndup(p, cf, strcspn(cf, ":")),
+            &series->start, &series->end, &series->step, &ds_cnt, &ds_namv,
+            &data) == -1) {
+        err = apr_pstrdup(p, instance->get_error());
+        instance->clear_error();
+        if (!held) {
+            instance_release(instance);
+        }
+        return err;
+    }
+
+    /* a data source of * is the first in the file */
+    for (ds = 0; ds < ds_cnt; ++ds) {
+        if (strcmp(dsname, "*") == 0 || strcmp(ds_namv[ds], dsname) == 0) {
+            break;
+        }
+    }
+
+    if (ds == ds_cnt) {
+        err = apr_psprintf(p, "Data source '%s' was not found", dsname);
+    }
+    else if (series->step) {
+        /* the first row is the one ending at start + step */
+        series->rows = (series->end - series->start) / series->step;
+        series->data = apr_palloc(p, series->rows * sizeof(rrd_value_t));
+        for (i = 0; i < series->rows; ++i) {
+            series->data[i] = data[i * ds_cnt + ds];
+        }
+    }
+
+    for (i = 0; i < ds_cnt; ++i) {
+        instance->freemem(ds_namv[i]);
+    }
+    instance->freemem(ds_namv);
+    instance->freemem(data);
+
+    if (!held) {
+        instance_release(instance);
+    }
+
+    return err;
+}
+
+/*
+ * The step rrdgraph will consolidate to, the coarsest archive step of the
+ * first file of each DEF covering the start of the window, so that
+ * partitions never split a consolidated row.
+ */
+static unsigned long partition_step(request_rec *r, rrd_cmds_t *cmds,
+        time_t start, unsigned long step, apr_int64_t *partition)
+{
+    apr_hash_t *probed = apr_hash_make(r->pool);
+    unsigned long coarsest = step, lcm = step;
+    int i;
+
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+        rrd_series_t series;
+        const char *source, *key;
+        unsigned long a, b;
+
+        if (RRD_CONF_DEF != cmd->type || cmd->d.alias || cmd->d.distribution
+                || !cmd->d.requests->nelts) {
+            continue;
+        }
+
+        /* every data source of a file shares its archives */
+        source = source_filename(APR_ARRAY_IDX(cmd->d.requests, 0,
+                request_rec *));
+        key = apr_pstrcat(r->pool, source, "\n", cmd->d.cf, NULL);
+        if (apr_hash_get(probed, key, APR_HASH_KEY_STRING)) {
+            continue;
+        }
+        apr_hash_set(probed, key, APR_HASH_KEY_STRING, key);
+
+        /* one row is enough to learn which archive is picked */
+        if (fetch_series(r->pool, NULL, source, cmd->d.dsname, cmd->d.cf, start,
+                start + step, step, &series) || !series.step) {
+            continue;
+        }
+
+        if (series.step > coarsest) {
+            coarsest = series.step;
+        }
+
+        /* partitions hold a whole number of rows of every archive */
+        for (a = lcm, b = series.step; b; ) {
+            unsigned long t = a % b;
+            a = b;
+            b = t;
+        }
+        if (lcm / a <= RRD_PARTITION_MAX / series.step) {
+            lcm = lcm / a * series.step;
+        }
+    }
+
+    if (lcm < coarsest) {
+        lcm = coarsest;
+    }
+    *partition = ((*partition + lcm - 1) / lcm) * lcm;
+
+    return coarsest;
+}
+
+/*
+ * A partition failed after the response started, and the status can no
+ * longer change. End the response as broken, so that a chunked response
+ * is left unterminated and the connection is closed, rather than look
+ * complete to the client.
+ */
+static int partition_abort(request_rec *r, apr_bucket_brigade *bb, int done)
+{
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
+            "mod_rrd: Aborting the export after %d partitions were sent",
+            done);
+
+    r->connection->keepalive = AP_CONN_CLOSE;
+    APR_BRIGADE_INSERT_TAIL(bb, ap_bucket_error_create(HTTP_BAD_GATEWAY,
+            NULL, r->pool, r->connection->bucket_alloc));
+    APR_BRIGADE_INSERT_TAIL(bb,
+            apr_bucket_eos_create(r->connection->bucket_alloc));
+    ap_pass_brigade(r->output_filters, bb);
+    apr_brigade_cleanup(bb);
+
+    return OK;
+}
+
+#if APR_HAS_THREADS
+/*
+ * Partitions are rendered ahead on the worker threads, each on its own
+ * copy of librrd, and streamed in order.
+ */
+typedef struct rrd_partitions_t {
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    volatile apr_uint32_t waiting;
+} rrd_partitions_t;
+
+typedef struct rrd_partition_t {
+    rrd_partitions_t *partitions;
+    apr_pool_t *pool;
+    apr_array_header_t *args;
+    int skip;
+    const char *buf;
+    apr_size_t len;
+    const char *err;
+    apr_interval_time_t rendered;
+    int done;
+} rrd_partition_t;
+
+static void partition_render(rrd_partition_t *part)
+{
+    rrd_info_t *grinfo, *info;
+    rrd_instance_t *instance;
+    apr_time_t begin;
+
+    instance = instance_acquire(&part->partitions->waiting);
+    begin = apr_time_now();
+
+    grinfo = instance->graph_v(part->args->nelts, (char **)part->args->elts);
+    if (grinfo == NULL) {
+        const char *err = instance->get_error();
+        part->err = apr_pstrdup(part->pool, err ? err : "");
+    }
+    else {
+        for (info = grinfo; info; info = info->next) {
+            if (strcmp(info->key, "image") == 0) {
+                const char *buf = (const char *)info->value.u_blo.ptr;
+                apr_size_t len = info->value.u_blo.size;
+                int skip = part->skip;
+
+                /* drop leading lines, such as a repeated header */
+                while (skip-- > 0 && len) {
+                    const char *eol = memchr(buf, '\n', len);
+                    if (!eol) {
+                        len = 0;
+                        break;
+                    }
+                    len -= eol + 1 - buf;
+                    buf = eol + 1;
+                }
+
+                part->buf = apr_pmemdup(part->pool, buf, len);
+                part->len = len;
+                break;
+            }
+        }
+        instance->info_free(grinfo);
+    }
+    instance->clear_error();
+
+    part->rendered = apr_time_now() - begin;
+
+    instance_release(instance);
+}
+
+static void * APR_THREAD_FUNC partition_task(apr_thread_t *thread,
+        void *data)
+{
+    rrd_partition_t *part = data;
+    rrd_partitions_t *partitions = part->partitions;
+
+    partition_render(part);
+
+    apr_thread_mutex_lock(partitions->mutex);
+    part->done = 1;
+    apr_thread_cond_broadcast(partitions->cond);
+    apr_thread_mutex_unlock(partitions->mutex);
+
+    return NULL;
+}
+
+static void partition_wait(rrd_partitions_t *partitions,
+        rrd_partition_t *part)
+{
+    apr_thread_mutex_lock(partitions->mutex);
+    while (!part->done) {
+        apr_thread_cond_wait(partitions->cond, partitions->mutex);
+    }
+    apr_thread_mutex_unlock(partitions->mutex);
+}
+
+static int get_rrdgraph_parallel(request_rec *r, rrd_cmds_t *cmds,
+        apr_array_header_t *args, time_t start, time_t end,
+        unsigned long step, apr_int64_t partition, apr_pool_t *pool,
+        apr_bucket_brigade *bb)
+{
+    rrd_partitions_t partitions;
+    rrd_partition_t *parts;
+    apr_status_t rv;
+    time_t from, to;
+    int count = 0, submitted = 0, i, ret = OK;
+
+    for (from = start; from < end; from = (from / partition + 1) * partition) {
+        count++;
+    }
+    parts = apr_pcalloc(r->pool, count * sizeof(rrd_partition_t));
+
+    partitions.waiting = 0;
+    apr_thread_mutex_create(&partitions.mutex, APR_THREAD_MUTEX_DEFAULT,
+            r->pool);
+    apr_thread_cond_create(&partitions.cond, r->pool);
+
+    for (i = 0, from = start; from < end; from = to, ++i) {
+        rrd_partition_t *part = &parts[i];
+
+        /* partition boundaries fall on multiples of the partition size */
+        to = (from / partition + 1) * partition;
+        if (to > end) {
+            to = end;
+        }
+
+        part->partitions = &partitions;
+        part->args = partition_args(r, args, from, to, step);
+
+        /* only the first partition keeps the header line */
+        part->skip = i ? 1 : 0;
+
+        apr_pool_create(&part->pool, pool);
+    }
+
+    for (i = 0; i < count; ++i) {
+        rrd_partition_t *part = &parts[i];
+
+        /* keep the copies of librrd busy with the partitions that follow */
+        while (submitted < count && submitted < i + rrd_instance_count) {
+            rrd_partition_t *next = &parts[submitted++];
+
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                    "mod_rrd: rendering partition %d of %d, step %lu",
+                    submitted, count, step);
+
+            if (apr_thread_pool_push(rrd_workers, partition_task, next,
+                    APR_THREAD_TASK_PRIORITY_HIGHEST, r) != APR_SUCCESS) {
+                partition_render(next);
+                next->done = 1;
+            }
+        }
+
+        partition_wait(&partitions, part);
+        cmds->rendered += part->rendered;
+
+        if (part->err) {
+            log_message(r, APR_SUCCESS, "Call to rrd_graph_v failed",
+                    part->err);
+            ret = i ? partition_abort(r, bb, i) : HTTP_INTERNAL_SERVER_ERROR;
+            break;
+        }
+
+        /* send each partition on as soon as it is ready */
+        apr_brigade_write(bb, NULL, NULL, part->buf, part->len);
+        APR_BRIGADE_INSERT_TAIL(bb,
+                apr_bucket_flush_create(r->connection->bucket_alloc));
+        rv = ap_pass_brigade(r->output_filters, bb);
+        apr_brigade_cleanup(bb);
+        if (rv != APR_SUCCESS || r->connection->aborted) {
+            ap_log_rerror(
+                    APLOG_MARK, APLOG_DEBUG, rv, r, "rrd_handler: ap_pass_brigade returned %i", rv);
+            break;
+        }
+    }
+
+    /* the workers still own the partitions in flight, wait for them */
+    while (++i < submitted) {
+        partition_wait(&partitions, &parts[i]);
+    }
+    apr_pool_destroy(pool);
+
+    return ret;
+}
+#endif
+
+static int get_rrdgraph_partitioned(request_rec *r, rrd_cmds_t *cmds,
+        apr_array_header_t *args, apr_int64_t partition,
+        apr_bucket_brigade *bb)
+{
+    time_t start, end, from, to;
+    unsigned long step;
+#if APR_HAS_THREADS
+    apr_pool_t *pool;
+#endif
+    apr_status_t rv;
+    int ret, done = 0;
+
+    ret = parse_window(r, args, &start, &end, &step);
+    if (OK != ret) {
+        return ret;
+    }
+
+    step = partition_step(r, cmds, start, step, &partition);
+
+#if APR_HAS_THREADS
+    /*
+     * Partitions render side by side only on copies of librrd to spare,
+     * and the distribution callback reads from the request, render it here.
+     */
+    if (rrd_workers && rrd_instance_count > 1 && !has_distribution(cmds)
+            && (pool = worker_pool(r))) {
+        return get_rrdgraph_parallel(r, cmds, args, start, end, step,
+                partition, pool, bb);
+    }
+#endif
+
+    for (from = start; from < end; from = to) {
+
+        /* partition boundaries fall on multiples of the partition size */
+        to = (from / partition + 1) * partition;
+        if (to > end) {
+            to = end;
+        }
+
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                "mod_rrd: rendering partition %ld to %ld, step %lu",
+                (long) from, (long) to, step);
+
+        /* only the first partition keeps the header line */
+        ret = render_rrdgraph(r, cmds, partition_args(r, args, from, to, step),
+                bb, NULL, done ? 1 : 0);
+        if (OK != ret) {
+            return done ? partition_abort(r, bb, done) : ret;
+        }
+
+        /* send each partition on as soon as it is ready */
+        APR_BRIGADE_INSERT_TAIL(bb,
+                apr_bucket_flush_create(r->connection->bucket_alloc));
+        rv = ap_pass_brigade(r->output_filters, bb);
+        apr_brigade_cleanup(bb);
+        if (rv != APR_SUCCESS || r->connection->aborted) {
+            ap_log_rerror(
+                    APLOG_MARK, APLOG_DEBUG, rv, r, "rrd_handler: ap_pass_brigade returned %i", rv);
+            return OK;
+        }
+
+        done++;
+    }
+
+    return OK;
+}
+
+static int envelope_rrdgraph(request_rec *r, rrd_cmds_t *cmds,
+        apr_bucket_brigade *bb, apr_bucket_brigade *ib)
+{
+    char *buf, *encoded;
+    apr_size_t len;
+    apr_status_t rv;
+
+    /* the image and its metadata from the same render, in one object */
+    rv = apr_brigade_pflatten(bb, &buf, &len, r->pool);
+    if (APR_SUCCESS != rv) {
+        log_message(r, rv, "Could not read the rendered graph", NULL);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    apr_brigade_cleanup(bb);
+
+    encoded = apr_palloc(r->pool, apr_base64_encode_len((int)len));
+    apr_base64_encode_binary(encoded, (const unsigned char *)buf, (int)len);
+
+    apr_brigade_puts(bb, NULL, NULL, "{\"info\":");
+    APR_BRIGADE_CONCAT(bb, ib);
+    apr_brigade_printf(bb, NULL, NULL,
+            ",\"format\":\"%s\",\"content-type\":\"%s\",\"image\":\"",
+            pescape_json(r->pool, cmds->format),
+            pescape_json(r->pool, lookup_content_type(cmds->format)));
+    apr_brigade_puts(bb, NULL, NULL, encoded);
+    apr_brigade_puts(bb, NULL, NULL, "\"}\n");
+
+    ap_set_content_type(r, "application/json");
+
+    return OK;
+}
+
+static int get_rrdgraph(request_rec *r)
+{
+    apr_array_header_t *args;
+    apr_bucket_brigade *bb = apr_brigade_create(r->pool,
+            r->connection->bucket_alloc);
+    apr_bucket_brigade *ib = NULL;
+    rrd_cmds_t *cmds;
+    const char *with, *cache, *request;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    rrd_cache_e state;
+    rrd_tier_e tier;
+
+    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
+            &rrd_module);
+
+    int ret;
+
+    /* pull apart the query string, reject unrecognised options */
+    ret = parse_query(r, &cmds);
+    if (OK != ret) {
+        return ret;
+    }
+
+    with = apr_table_get(cmds->params, "with");
+    if (with) {
+        if (strcmp(with, "info")) {
+            log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "With must be info: %s", with), NULL);
+            return HTTP_BAD_REQUEST;
+        }
+        ib = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    }
+
+    /* how loaded are we, and have we served this request before */
+    tier = degrade_tier(r, conf);
+    request = ib || apr_table_get(cmds->params, "limit")
+            || apr_table_get(cmds->params, "cursor") ?
+                    NULL : cache_request(r, conf);
+    state = cache_follow(r, conf, request, &file, &finfo);
+
+    if (RRD_CACHE_FRESH == state || (RRD_CACHE_STALE == state && tier)) {
+        ap_set_content_type(r, lookup_content_type(conf->format ?
+                conf->format : parse_rrdgraph_suffix(r)));
+        cache_serve(r, state, file, &finfo, bb);
+        sketch_record(r, cmds, 1);
+        return pass_brigade(r, bb);
+    }
+    if (file) {
+        apr_file_close(file);
+    }
+
+    /* nothing to serve, and too busy to even match the files */
+    if (RRD_TIER_REJECT == tier) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, APR_SUCCESS, r,
+                "mod_rrd: Too busy to render the graph, rejecting");
+        apr_table_setn(r->err_headers_out, "X-RRD-Degraded",
+                rrd_tiers[RRD_TIER_REJECT]);
+        apr_table_setn(r->err_headers_out, "Retry-After",
+                apr_itoa(r->pool, RRD_WAIT_EXPIRY));
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    /* resolve permissions and wildcards of rrd files */
+    ret = resolve_rrds(r, cmds);
+    if (OK != ret) {
+        return ret;
+    }
+
+    /* cut long exports down to one page of matches */
+    ret = page_rrds(r, conf, cmds);
+    if (OK != ret) {
+        cleanup_args(r, cmds);
+        return ret;
+    }
+
+    /* create the args string for rrd_graph */
+    ret = generate_args(r, cmds, &args);
+    if (OK != ret) {
+        return ret;
+    }
+
+    /* what do we already have under these arguments */
+    cache = ib ? NULL : cache_filename(r, conf, args);
+    state = cache_lookup(r, conf, cache, &file, &finfo);
+
+    /* a recent enough graph, or any graph at all when overloaded */
+    if (RRD_CACHE_FRESH == state || (RRD_CACHE_STALE == state && tier)) {
+        cache_serve(r, state, file, &finfo, bb);
+        cache_link(r, request, cache);
+
+        /* a pan onto a prefetched window prefetches the next one */
+        if (RRD_CACHE_FRESH == state && !tier) {
+            prefetch_rrdgraph(r, conf, cmds, args);
+        }
+    }
+    else {
+        if (file) {
+            apr_file_close(file);
+        }
+
+        /* cold archives are decompressed only once they are rendered */
+        if (cold_rrds(r, cmds)) {
+            ret = generate_args(r, cmds, &args);
+            if (OK != ret) {
+                cleanup_args(r, cmds);
+                return ret;
+            }
+            cache = NULL;
+        }
+
+        /* cheaper graphs when overloaded, never cached */
+        if (tier >= RRD_TIER_FANOUT) {
+            degrade_fanout(r, conf, cmds);
+            ret = generate_args(r, cmds, &args);
+            if (OK != ret) {
+                cleanup_args(r, cmds);
+                return ret;
+            }
+            if (tier >= RRD_TIER_REDUCE) {
+                args = degrade_reduce(r, args);
+            }
+            apr_table_setn(r->headers_out, "X-RRD-Degraded", rrd_tiers[tier]);
+            cache = NULL;
+        }
+
+        /* long line based exports are streamed a partition at a time */
+        if (conf->partition && is_line_format(cmds->format) && !ib) {
+            ret = get_rrdgraph_partitioned(r, cmds, args, conf->partition,
+                    bb);
+        }
+        else {
+            ret = render_rrdgraph(r, cmds, args, bb, ib, 0);
+            if (OK == ret && cache) {
+                cache_store(r, cache, bb);
+                cache_link(r, request, cache);
+                if (!tier) {
+                    prefetch_rrdgraph(r, conf, cmds, args);
+                }
+            }
+            if (OK == ret && ib) {
+                ret = envelope_rrdgraph(r, cmds, bb, ib);
+            }
+            if (OK == ret) {
+                apr_off_t len;
+
+                apr_brigade_length(bb, 1, &len);
+                ap_set_content_length(r, len);
+            }
+        }
+    }
+
+    /* count the cost of this graph against its spec */
+    sketch_record(r, cmds, RRD_CACHE_FRESH == state
+            || (RRD_CACHE_STALE == state && tier));
+
+    /* trigger an early cleanup to save memory */
+    cleanup_args(r, cmds);
+
+    /* send our response down the stack */
+    if (OK == ret) {
+        return pass_brigade(r, bb);
+    }
+
+    return ret;
+}
+
+/*
+ * Each DEF names one file, shown as the path relative to the request
+ * that matched it, and never as a decompressed copy.
+ */
+static const char *explain_arg(request_rec *r, apr_hash_t *paths,
+        const char *arg)
+{
+    const char *file, *c, *display;
+
+    if (strncmp(arg, "DEF:", 4) || !(file = strchr(arg, '='))) {
+        return arg;
+    }
+
+    /* the file ends at the first colon not escaped */
+    for (c = ++file; *c && (*c != ':' || c[-1] == '\\'); ++c);
+
+    display = apr_hash_get(paths, file, c - file);
+    if (!display) {
+        return arg;
+    }
+
+    return apr_pstrcat(r->pool, apr_pstrndup(r->pool, arg, file - arg),
+            display, c, NULL);
+}
+
+/*
+ * What reading a match would return. The subrequest checked access, but
+ * the file may still be unreadable by httpd, and a cold archive may have
+ * no copy yet.
+ */
+static int explain_status(request_rec *r, request_rec *rr, const char **cold)
+{
+    apr_file_t *file;
+    apr_status_t rv;
+
+    *cold = NULL;
+    rv = apr_file_open(&file, rr->filename, APR_FOPEN_READ | APR_FOPEN_BINARY,
+            APR_FPROT_OS_DEFAULT, r->pool);
+    if (APR_SUCCESS != rv) {
+        return APR_STATUS_IS_ENOENT(rv) ? HTTP_NOT_FOUND :
+                APR_STATUS_IS_EACCES(rv) ? HTTP_FORBIDDEN :
+                HTTP_INTERNAL_SERVER_ERROR;
+    }
+    apr_file_close(file);
+
+#if HAVE_ZSTD
+    if (apr_table_get(rr->notes, "rrd-cold")) {
+        apr_finfo_t finfo;
+
+        *cold = apr_stat(&finfo, source_filename(rr), APR_FINFO_MTIME,
+                r->pool) == APR_SUCCESS && finfo.mtime >= rr->finfo.mtime ?
+                "copied" : "compressed";
+    }
+#endif
+
+    return HTTP_OK;
+}
+
+static int get_rrdexplain(request_rec *r)
+{
+    apr_array_header_t *args;
+    apr_bucket_brigade *bb = apr_brigade_create(r->pool,
+            r->connection->bucket_alloc);
+    apr_hash_t *paths = apr_hash_make(r->pool);
+    rrd_cmds_t *cmds;
+    apr_time_t begin, parsed, resolved, generated;
+    apr_int64_t files = 0, rows = 0;
+    time_t start, end;
+    unsigned long step;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    rrd_cache_e state;
+    int i, j, first = 1;
+
+    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
+            &rrd_module);
+
+    int ret;
+
+    begin = apr_time_now();
+
+    /* pull apart the query string, reject unrecognised options */
+    ret = parse_query(r, &cmds);
+    if (OK != ret) {
+        return ret;
+    }
+    parsed = apr_time_now();
+
+    /* resolve permissions and wildcards of rrd files, touching nothing */
+    cmds->explain = 1;
+    ret = resolve_rrds(r, cmds);
+    if (OK != ret) {
+        return ret;
+    }
+    resolved = apr_time_now();
+
+    /* create the args string for rrd_graph, which we never call */
+    ret = generate_args(r, cmds, &args);
+    if (OK != ret) {
+        cleanup_args(r, cmds);
+        return ret;
+    }
+    generated = apr_time_now();
+
+    ret = parse_window(r, args, &start, &end, &step);
+    if (OK != ret) {
+        cleanup_args(r, cmds);
+        return ret;
+    }
+
+    state = cache_lookup(r, conf, cache_filename(r, conf, args), &file, &finfo);
+    if (file) {
+        apr_file_close(file);
+    }
+
+    apr_brigade_puts(bb, NULL, NULL, "{\"defs\":[");
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+
+        if (RRD_CONF_DEF != cmd->type) {
+            continue;
+        }
+
+        apr_brigade_printf(bb, NULL, NULL,
+                "%s{\"vname\":\"%s\",\"path\":\"%s\",\"base\":\"%s\","
+                "\"dsname\":\"%s\",\"cf\":\"%s\",%s%s%s\"matches\":[",
+                first ? "" : ",",
+                pescape_json(r->pool, cmd->d.vname),
+                pescape_json(r->pool, cmd->d.pattern),
+                pescape_json(r->pool, cmd->d.base),
+                pescape_json(r->pool, cmd->d.dsname),
+                pescape_json(r->pool, cmd->d.cf),
+                cmd->d.alias ? "\"alias\":\"" : "",
+                cmd->d.alias ? pescape_json(r->pool, cmd->d.alias->d.vname) : "",
+                cmd->d.alias ? "\"," : "");
+        first = 0;
+
+        for (j = 0; j < cmd->d.requests->nelts; ++j) {
+            request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, j, request_rec *);
+            const char *cold;
+            int status = explain_status(r, rr, &cold);
+
+            apr_brigade_printf(bb, NULL, NULL,
+                    "%s{\"path\":\"%s\",\"status\":%d%s%s%s}", j ? "," : "",
+                    pescape_json(r->pool, relative_path(r, rr->filename)),
+                    status, cold ? ",\"cold\":\"" : "", cold ? cold : "",
+                    cold ? "\"" : "");
+
+            /* only the files that can be read cost anything */
+            if (HTTP_OK == status && !cmd->d.alias) {
+                files++;
+            }
+
+            apr_hash_set(paths, pescape_colon(r->pool, source_filename(rr)),
+                    APR_HASH_KEY_STRING, pescape_colon(r->pool,
+                            relative_path(r, rr->filename)));
+        }
+
+        apr_brigade_puts(bb, NULL, NULL, "],\"rejected\":[");
+        for (j = 0; j < cmd->d.rejected->nelts; ++j) {
+            rrd_reject_t *reject = &APR_ARRAY_IDX(cmd->d.rejected, j,
+                    rrd_reject_t);
+
+            apr_brigade_printf(bb, NULL, NULL,
+                    "%s{\"path\":\"%s\",\"status\":%d}", j ? "," : "",
+                    pescape_json(r->pool,
+                            relative_path(r, reject->filename)),
+                    reject->status);
+        }
+        apr_brigade_puts(bb, NULL, NULL, "]}");
+    }
+    rows = files * ((end - start) / step);
+
+    apr_brigade_puts(bb, NULL, NULL, "],\"argv\":[");
+    for (i = 0; i < args->nelts; ++i) {
+        apr_brigade_printf(bb, NULL, NULL, "%s\"%s\"", i ? "," : "",
+                pescape_json(r->pool, explain_arg(r, paths,
+                        APR_ARRAY_IDX(args, i, const char *))));
+    }
+
+    apr_brigade_printf(bb, NULL, NULL,
+            "],\"cost\":{\"files\":%" APR_INT64_T_FMT ",\"elements\":%d,"
+            "\"start\":%ld,\"end\":%ld,\"step\":%lu,\"rows\":%"
+            APR_INT64_T_FMT "},\"timings\":{\"parse\":%" APR_TIME_T_FMT
+            ",\"resolve\":%" APR_TIME_T_FMT ",\"generate\":%" APR_TIME_T_FMT
+            "},\"cache\":\"%s\",\"degrade\":\"%s\",\"queue\":%u,\"wait\":%u}\n",
+            files, args->nelts - 4, (long) start, (long) end, step,
+            rows, parsed - begin, resolved - parsed, generated - resolved,
+            rrd_caches[state], rrd_tiers[degrade_tier(r, conf)],
+            apr_atomic_read32(&rrd_render_queue),
+            apr_atomic_read32(&rrd_render_wait));
+
+    /* trigger an early cleanup to save memory */
+    cleanup_args(r, cmds);
+
+    ap_set_content_type(r, "application/json");
+
+    /* send our response down the stack */
+    return pass_brigade(r, bb);
+}
+
+#if HAVE_RRD_FETCH_CB_REGISTER
+static int compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+
+    return da < db ? -1 : da > db ? 1 : 0;
+}
+
+static double quantile(const double *sorted, int n, double q)
+{
+    double pos = q * (n - 1);
+    int i = (int)pos;
+
+    if (i + 1 >= n) {
+        return sorted[n - 1];
+    }
+    return sorted[i] + (sorted[i + 1] - sorted[i]) * (pos - i);
+}
+
+static char *instance_strdup(rrd_instance_t *instance, const char *str)
+{
+    apr_size_t len = strlen(str) + 1;
+    char *dup = instance->malloc(len);
+
+    if (dup) {
+        memcpy(dup, str, len);
+    }
+    return dup;
+}
+
+/*
+ * Fetch callback for DEFs with the distribution option, where the file
+ * name is cb//mod_rrd/<index of the DEF>. Every file matching the DEF is
+ * fetched, and the min, quartiles and max across the files are returned
+ * as five data sources for each step.
+ */
+static int distribution_cb(const char *filename, enum cf_en cf_idx,
+        time_t *start, time_t *end, unsigned long *step,
+        unsigned long *ds_cnt, char ***ds_namv, rrd_value_t **data)
+{
+    static const char *names[] = { "min", "p25", "median", "p75", "max" };
+    rrd_fetch_t *fetch = fetch_ctx_get();
+    rrd_series_t *series;
+    rrd_instance_t *instance;
+    rrd_cmd_t *cmd;
+    apr_pool_t *ptemp;
+    double *vals;
+    unsigned long rows, i;
+    int index, nfiles, j, n;
+
+    /* not our render, and no way to know which copy of librrd is calling */
+    if (!fetch) {
+        return -1;
+    }
+
+    /* memory and errors belong to the copy of librrd calling us */
+    instance = fetch->instance;
+
+    if (!strncmp(filename, "cb//", 4)) {
+        filename += 4;
+    }
+    if (strncmp(filename, "mod_rrd/", 8)
+            || (index = atoi(filename + 8)) < 0
+            || index >= fetch->cmds->cmds->nelts) {
+        instance->set_error("mod_rrd: unknown distribution '%s'", filename);
+        return -1;
+    }
+
+    cmd = &APR_ARRAY_IDX(fetch->cmds->cmds, index, rrd_cmd_t);
+    if (RRD_CONF_DEF != cmd->type || !cmd->d.distribution || !*step) {
+        instance->set_error("mod_rrd: unknown distribution '%s'", filename);
+        return -1;
+    }
+
+    /* align the window to the step */
+    *start -= *start % *step;
+    *end += (*step - *end % *step) % *step;
+    rows = (*end - *start) / *step;
+
+    apr_pool_create(&ptemp, fetch->r->pool);
+
+    nfiles = cmd->d.requests->nelts;
+    series = apr_pcalloc(ptemp, nfiles * sizeof(rrd_series_t));
+    vals = apr_palloc(ptemp, (nfiles + 1) * sizeof(double));
+
+    for (j = 0; j < nfiles; ++j) {
+        request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, j, request_rec *);
+        const char *err = fetch_series(ptemp, fetch->instance,
+                source_filename(rr), cmd->d.dsname, cmd->d.cf, *start, *end,
+                *step, &series[j]);
+        if (err) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, fetch->r,
+                    "mod_rrd: Could not fetch '%s' for the distribution, ignoring: %s",
+                    rr->filename, err);
+        }
+    }
+
+    *ds_cnt = 5;
+    *ds_namv = instance->malloc(5 * sizeof(char *));
+    *data = instance->malloc(rows * 5 * sizeof(rrd_value_t));
+    if (!*ds_namv || !*data) {
+        instance->free(*ds_namv);
+        instance->free(*data);
+        apr_pool_destroy(ptemp);
+        instance->set_error("mod_rrd: out of memory");
+        return -1;
+    }
+    for (j = 0; j < 5; ++j) {
+        (*ds_namv)[j] = instance_strdup(instance, names[j]);
+    }
+
+    /* sort the known values of each step across the files */
+    for (i = 0; i < rows; ++i) {
+        time_t t = *start + (i + 1) * *step;
+        rrd_value_t *row = *data + i * 5;
+
+        for (j = 0, n = 0; j < nfiles; ++j) {
+            rrd_series_t *s = &series[j];
+            time_t k;
+
+            if (!s->step || t <= s->start) {
+                continue;
+            }
+            k = (t - s->start - 1) / s->step;
+            if (k < s->rows && !isnan(s->data[k])) {
+                vals[n++] = s->data[k];
+            }
+        }
+
+        if (!n) {
+            row[0] = row[1] = row[2] = row[3] = row[4] = NAN;
+            continue;
+        }
+
+        qsort(vals, n, sizeof(double), compare_double);
+        row[0] = vals[0];
+        row[1] = quantile(vals, n, 0.25);
+        row[2] = quantile(vals, n, 0.5);
+        row[3] = quantile(vals, n, 0.75);
+        row[4] = vals[n - 1];
+    }
+
+    apr_pool_destroy(ptemp);
+
+    return 0;
+}
+#endif
+
+static unsigned char *png_uint32(unsigned char *buf, apr_uint32_t val)
+{
+    *buf++ = (val >> 24) & 0xff;
+    *buf++ = (val >> 16) & 0xff;
+    *buf++ = (val >> 8) & 0xff;
+    *buf++ = val & 0xff;
+    return buf;
+}
+
+static void png_chunk(apr_bucket_brigade *bb, const char *type,
+        unsigned char *chunk, apr_size_t len)
+{
+    /* chunk points at 8 bytes of space for the length and type, followed
+     * by the data, followed by 4 bytes of space for the crc */
+    png_uint32(chunk, len);
+    memcpy(chunk + 4, type, 4);
+    png_uint32(chunk + 8 + len, crc32(0, chunk + 4, len + 4));
+    apr_brigade_write(bb, NULL, NULL, (const char *)chunk, len + 12);
+}
+
+/*
+ * Write an RGB image as a PNG. Each scanline is filtered against the
+ * pixel to its left, and the compressed stream is written out as IDAT
+ * chunks as it fills, so that no second copy of the image is made.
+ */
+static apr_status_t write_png(apr_pool_t *p, apr_bucket_brigade *bb,
+        const unsigned char *rgb, int width, int height)
+{
+    static const unsigned char signature[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    apr_size_t stride = 3 * (apr_size_t)width, i;
+    unsigned char *chunk, *buf, *line;
+    z_stream z;
+    int y, zrv;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit(&z, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        return APR_ENOMEM;
+    }
+
+    apr_brigade_write(bb, NULL, NULL, (const char *)signature,
+            sizeof(signature));
+
+    /* IHDR: 8 bit RGB, no interlace */
+    chunk = apr_pcalloc(p, 13 + 12);
+    buf = png_uint32(chunk + 8, width);
+    buf = png_uint32(buf, height);
+    buf[0] = 8;
+    buf[1] = 2;
+    png_chunk(bb, "IHDR", chunk, 13);
+
+    /* IDAT: the rows, each a sub filter byte and the pixel differences */
+    chunk = apr_palloc(p, RRD_PNG_CHUNK + 12);
+    line = apr_palloc(p, 1 + stride);
+    z.next_out = chunk + 8;
+    z.avail_out = RRD_PNG_CHUNK;
+    for (y = 0; y <= height; ++y) {
+        if (y < height) {
+            const unsigned char *row = rgb + y * stride;
+
+            line[0] = 1;
+            for (i = 0; i < stride; ++i) {
+                line[1 + i] = row[i] - (i >= 3 ? row[i - 3] : 0);
+            }
+            z.next_in = line;
+            z.avail_in = 1 + stride;
+        }
+
+        do {
+            zrv = deflate(&z, y < height ? Z_NO_FLUSH : Z_FINISH);
+            if (!z.avail_out || (Z_STREAM_END == zrv
+                    && z.avail_out < RRD_PNG_CHUNK)) {
+                png_chunk(bb, "IDAT", chunk, RRD_PNG_CHUNK - z.avail_out);
+                z.next_out = chunk + 8;
+                z.avail_out = RRD_PNG_CHUNK;
+            }
+        } while (y < height ? z.avail_in : Z_STREAM_END != zrv);
+    }
+    deflateEnd(&z);
+
+    chunk = apr_palloc(p, 12);
+    png_chunk(bb, "IEND", chunk, 0);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Average the rows of a series falling into each column of the window,
+ * leaving NAN where none fall, and summarise the columns.
+ */
+static void series_columns(rrd_series_t *series, time_t start, time_t end,
+        double *cols, int *counts, int width, rrd_columns_t *summary)
+{
+    unsigned long n;
+    int x;
+
+    for (x = 0; x < width; ++x) {
+        cols[x] = 0;
+        counts[x] = 0;
+    }
+
+    for (n = 0; n < series->rows; ++n) {
+        time_t t = series->start + (n + 1) * series->step;
+        double v = series->data[n];
+
+        if (isnan(v) || t <= start || t > end) {
+            continue;
+        }
+        x = (double)(t - start - 1) * width / (end - start);
+        cols[x] += v;
+        counts[x]++;
+    }
+
+    summary->min = summary->max = summary->last = NAN;
+    summary->sum = 0;
+    summary->n = 0;
+    for (x = 0; x < width; ++x) {
+        if (!counts[x]) {
+            cols[x] = NAN;
+            continue;
+        }
+        cols[x] /= counts[x];
+        if (isnan(summary->min) || cols[x] < summary->min) {
+            summary->min = cols[x];
+        }
+        if (isnan(summary->max) || cols[x] > summary->max) {
+            summary->max = cols[x];
+        }
+        summary->sum += cols[x];
+        summary->last = cols[x];
+        summary->n++;
+    }
+}
+
+static void heatmap_colour(double val, unsigned char *rgb)
+{
+    /* blue, cyan, green, yellow, red */
+    static const unsigned char stops[5][3] = {
+        { 0x00, 0x00, 0xff },
+        { 0x00, 0xff, 0xff },
+        { 0x00, 0xff, 0x00 },
+        { 0xff, 0xff, 0x00 },
+        { 0xff, 0x00, 0x00 }
+    };
+    double pos, frac;
+    int i, k;
+
+    if (isnan(val)) {
+        rgb[0] = rgb[1] = rgb[2] = 0xee;
+        return;
+    }
+
+    pos = (val < 0 ? 0 : val > 1 ? 1 : val) * 4;
+    i = pos >= 4 ? 3 : (int)pos;
+    frac = pos - i;
+    for (k = 0; k < 3; ++k) {
+        rgb[k] = stops[i][k] + (stops[i + 1][k] - stops[i][k]) * frac;
+    }
+}
+
+static int heatmap_compare(const void *a, const void *b)
+{
+    const rrd_row_t *ra = a, *rb = b;
+
+    /* highest first, rows without data last, otherwise keep match order */
+    if (isnan(ra->summary) || isnan(rb->summary)) {
+        if (isnan(ra->summary) && !isnan(rb->summary)) {
+            return 1;
+        }
+        if (!isnan(ra->summary) && isnan(rb->summary)) {
+            return -1;
+        }
+    }
+    else if (ra->summary != rb->summary) {
+        return ra->summary < rb->summary ? 1 : -1;
+    }
+    return ra->index - rb->index;
+}
+
+/*
+ * Images rasterised by mod_rrd are held in memory whole, and are bounded
+ * in each side and in total.
+ */
+static int check_image_size(request_rec *r, const char *what,
+        apr_int64_t width, apr_int64_t height, apr_int64_t pixels)
+{
+    if (width > RRD_IMAGE_SIDE || height > RRD_IMAGE_SIDE) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "%s width and height must be at most %d pixels: "
+                        "%" APR_INT64_T_FMT "x%" APR_INT64_T_FMT,
+                        what, RRD_IMAGE_SIDE, width, height), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    if (pixels > RRD_IMAGE_PIXELS) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "%s must be at most %d pixels in total: %"
+                        APR_INT64_T_FMT, what, RRD_IMAGE_PIXELS, pixels),
+                NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    return OK;
+}
+
+/*
+ * Read a side of an image from the options, leaving the default when
+ * not given.
+ */
+static int image_side(request_rec *r, apr_array_header_t *args,
+        const char *what, const char *arg, int least, int *side)
+{
+    const char *val = lookup_arg(args, arg);
+    apr_int64_t size;
+    char *end;
+
+    if (!val) {
+        return OK;
+    }
+
+    size = apr_strtoi64(val, &end, 10);
+    if (*end || end == val || size < least || size > RRD_IMAGE_SIDE) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "%s %s must be a number of pixels from %d to %d: %s",
+                        what, arg + 2, least, RRD_IMAGE_SIDE, val), NULL);
+        return HTTP_BAD_REQUEST;
+    }
+
+    *side = (int)size;
+    return OK;
+}
+
+static int get_rrdheatmap(request_rec *r)
+{
+    apr_array_header_t *args;
+    apr_bucket_brigade *bb = apr_brigade_create(r->pool,
+            r->connection->bucket_alloc);
+    rrd_cmds_t *cmds;
+    rrd_cmd_t *def = NULL;
+    rrd_row_t *rows;
+    double *cells, lower = NAN, upper = NAN;
+    unsigned char *rgb;
+    const char *vname, *sort, *val;
+    time_t start, end;
+    unsigned long step;
+    int width = 400, height = 100, rowheight, nrows, i, x, y, *counts;
+
+    apr_status_t rv;
+    int ret;
+
+    /* pull apart the query string, reject unrecognised options */
+    ret = parse_query(r, &cmds);
+    if (OK != ret) {
+        return ret;
+    }
+
+    /* resolve permissions and wildcards of rrd files */
+    ret = resolve_rrds(r, cmds);
+    if (OK != ret) {
+        return ret;
+    }
+
+    /* evaluate the options, we never pass these to rrdgraph */
+    ret = generate_args(r, cmds, &args);
+    if (OK != ret) {
+        return ret;
+    }
+
+    ret = parse_window(r, args, &start, &end, &step);
+    if (OK != ret) {
+        return ret;
+    }
+
+    ret = image_side(r, args, "Heatmap", "--width", 1, &width);
+    if (OK == ret) {
+        ret = image_side(r, args, "Heatmap", "--height", 1, &height);
+    }
+    if (OK != ret) {
+        cleanup_args(r, cmds);
+        return ret;
+    }
+    if ((val = lookup_arg(args, "--lower-limit"))) {
+        lower = strtod(val, NULL);
+    }
+    if ((val = lookup_arg(args, "--upper-limit"))) {
+        upper = strtod(val, NULL);
+    }
+
+    /* the heatmap shows the named DEF, or the first DEF */
+    vname = apr_table_get(cmds->params, "heatmap");
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+
+        if (RRD_CONF_DEF == cmd->type
+                && (!vname || strcmp(vname, cmd->d.vname) == 0)) {
+            def = cmd;
+            break;
+        }
+    }
+    if (!def) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "Heatmap DEF '%s' was not found", vname ? vname : ""), NULL);
+        cleanup_args(r, cmds);
+        return HTTP_BAD_REQUEST;
+    }
+
+    sort = apr_table_get(cmds->params, "heatmap-sort");
+    if (sort && strcmp(sort, "min") && strcmp(sort, "max")
+            && strcmp(sort, "average") && strcmp(sort, "last")) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "Heatmap sort must be one of min, max, average or last: %s",
+                        sort), NULL);
+        cleanup_args(r, cmds);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* each file is at least one pixel row, however many match */
+    nrows = def->d.requests->nelts;
+    ret = check_image_size(r, "Heatmap", width, height,
+            (apr_int64_t)width * (nrows > height ? nrows : height));
+    if (OK != ret) {
+        cleanup_args(r, cmds);
+        return ret;
+    }
+
+    /* one row per matching file, one column per time bucket */
+    rows = apr_palloc(r->pool, nrows * sizeof(rrd_row_t));
+    cells = apr_palloc(r->pool, (apr_size_t)nrows * width * sizeof(double));
+    counts = apr_palloc(r->pool, width * sizeof(int));
+
+    for (y = 0; y < nrows; ++y) {
+        request_rec *rr = APR_ARRAY_IDX(def->d.requests, y, request_rec *);
+        double *row = cells + (apr_size_t)y * width;
+        rrd_columns_t summary;
+        rrd_series_t series;
+        const char *err;
+
+        err = fetch_series(r->pool, NULL, cold_source(r, rr), def->d.dsname, def->d.cf,
+                start, end, step, &series);
+        if (err) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, r,
+                    "mod_rrd: Could not fetch '%s' for the heatmap, ignoring: %s",
+                    rr->filename, err);
+        }
+
+        /* average the rows falling into each column */
+        series_columns(&series, start, end, row, counts, width, &summary);
+
+        rows[y].index = y;
+        rows[y].summary = !sort ? 0 :
+                !strcmp(sort, "min") ? summary.min :
+                !strcmp(sort, "max") ? summary.max :
+                !strcmp(sort, "last") ? summary.last :
+                summary.n ? summary.sum / summary.n : NAN;
+
+        /* scale to the limits unless given explicitly */
+        if (!lookup_arg(args, "--lower-limit") && !isnan(summary.min)
+                && (isnan(lower) || summary.min < lower)) {
+            lower = summary.min;
+        }
+        if (!lookup_arg(args, "--upper-limit") && !isnan(summary.max)
+                && (isnan(upper) || summary.max > upper)) {
+            upper = summary.max;
+        }
+    }
+
+    /* we have the data, the files are no longer needed */
+    cleanup_args(r, cmds);
+
+    if (sort) {
+        qsort(rows, nrows, sizeof(rrd_row_t), heatmap_compare);
+    }
+
+    /* rasterise, each file gets the same number of pixel rows */
+    rowheight = nrows && height > nrows ? height / nrows : 1;
+    height = nrows ? nrows * rowheight : height;
+    rgb = apr_palloc(r->pool, (apr_size_t)width * height * 3);
+
+    for (y = 0; y < height; ++y) {
+        unsigned char *pixel = rgb + (apr_size_t)y * width * 3;
+        double *row = nrows ? cells + (apr_size_t)rows[y / rowheight].index * width : NULL;
+
+        for (x = 0; x < width; ++x, pixel += 3) {
+            double v = row ? row[x] : NAN;
+            heatmap_colour(upper > lower ? (v - lower) / (upper - lower) :
+                    isnan(v) ? v : 0.5, pixel);
+        }
+    }
+
+    rv = write_png(r->pool, bb, rgb, width, height);
+    if (APR_SUCCESS != rv) {
+        log_message(r, rv, "Heatmap could not be compressed", NULL);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ap_set_content_type(r, "image/png");
+    {
+        apr_off_t len;
+
+        apr_brigade_length(bb, 1, &len);
+        ap_set_content_length(r, len);
+    }
+
+    /* send our response down the stack */
+    return pass_brigade(r, bb);
+}
+static const char *atlas_cachename(request_rec *r, rrd_conf *conf,
+        apr_array_header_t *args, rrd_cmd_t *def, int columns,
+        const char *suffix)
+{
+    apr_array_header_t *keys;
+    int i;
+
+    if (!conf->cache) {
+        return NULL;
+    }
+
+    /* the options and every file as of its last change, in either format */
+    keys = apr_array_make(r->pool, args->nelts + def->d.requests->nelts + 3,
+            sizeof(const char *));
+    APR_ARRAY_PUSH(keys, const char *) = "atlas";
+    APR_ARRAY_PUSH(keys, const char *) = suffix;
+    APR_ARRAY_PUSH(keys, const char *) = apr_itoa(r->pool, columns);
+    for (i = 4; i < args->nelts; ++i) {
+        APR_ARRAY_PUSH(keys, const char *) = APR_ARRAY_IDX(args, i, const char *);
+    }
+    for (i = 0; i < def->d.requests->nelts; ++i) {
+        request_rec *rr = APR_ARRAY_IDX(def->d.requests, i, request_rec *);
+
+        APR_ARRAY_PUSH(keys, const char *) = apr_psprintf(r->pool,
+                "%s %" APR_TIME_T_FMT, rr->filename, rr->finfo.mtime);
+    }
+
+    return cache_filename(r, conf, keys);
+}
+
+/*
+ * Draw one tile of the atlas as a sparkline, scaled to its own range.
+ */
+static void atlas_tile(unsigned char *rgb, int stride, const double *cols,
+        int width, int height, double min, double max)
+{
+    int x, y;
+
+    for (x = 0; x < width; ++x) {
+        double v = cols[x];
+        int top = isnan(v) ? height : height - 2 - (max > min ?
+                (int)((v - min) / (max - min) * (height - 3)) : (height - 3) / 2);
+
+        for (y = 0; y < height; ++y) {
+            unsigned char *pixel = rgb + ((apr_size_t)y * stride + x) * 3;
+
+            /* a light rule on the right and bottom keeps tiles apart */
+            if (x == width - 1 || y == height - 1) {
+                pixel[0] = pixel[1] = pixel[2] = 0xcc;
+            }
+            else if (isnan(v)) {
+                pixel[0] = pixel[1] = pixel[2] = 0xee;
+            }
+            else if (y == top) {
+                pixel[0] = 0x00, pixel[1] = 0x5a, pixel[2] = 0xc8;
+            }
+            else if (y > top) {
+                pixel[0] = 0xcc, pixel[1] = 0xdd, pixel[2] = 0xff;
+            }
+            else {
+                pixel[0] = pixel[1] = pixel[2] = 0xff;
+            }
+        }
+    }
+}
+
+static int get_rrdatlas(request_rec *r)
+{
+    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
+            &rrd_module);
+    apr_array_header_t *args;
+    apr_bucket_brigade *bb = apr_brigade_create(r->pool,
+            r->connection->bucket_alloc);
+    apr_bucket_brigade *png = apr_brigade_create(r->pool,
+            r->connection->bucket_alloc);
+    apr_bucket_brigade *json = apr_brigade_create(r->pool,
+            r->connection->bucket_alloc);
+    rrd_cmds_t *cmds;
+    rrd_cmd_t *def = NULL;
+    const char *vname, *val, *format, *png_cache, *json_cache;
+    double *cols;
+    unsigned char *rgb;
+    time_t start, end;
+    unsigned long step;
+    int width = RRD_ATLAS_WIDTH, height = RRD_ATLAS_HEIGHT;
+    int columns = RRD_ATLAS_COLUMNS, ntiles, nrows, i, *counts;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_off_t len;
+
+    apr_status_t rv;
+    int ret;
+
+    /* pull apart the query string, reject unrecognised options */
+    ret = parse_query(r, &cmds);
+    if (OK != ret) {
+        return ret;
+    }
+
+    if ((val = apr_table_get(cmds->params, "atlas-columns"))) {
+        columns = atoi(val);
+        if (columns < 1) {
+            log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "Atlas columns must be a positive number: %s",
+                            val), NULL);
+            return HTTP_BAD_REQUEST;
+        }
+    }
+
+    /* without a DEF, every RRD in the directory and the chosen data source */
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        if (RRD_CONF_DEF == APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t).type) {
+            break;
+        }
+    }
+    if (i == cmds->cmds->nelts) {
+        const char *ds = apr_table_get(cmds->params, "atlas-ds");
+        const char *cf = apr_table_get(cmds->params, "atlas-cf");
+
+        if (ds && (!*ds || strlen(ds) > 19 || ds[strspn(ds,
+                "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                "0123456789_")])) {
+            log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "Atlas data source must be a data source name: %s",
+                            ds), NULL);
+            return HTTP_BAD_REQUEST;
+        }
+        if (cf && strcmp(cf, "AVERAGE") && strcmp(cf, "MIN")
+                && strcmp(cf, "MAX") && strcmp(cf, "LAST")) {
+            log_message(r, APR_SUCCESS,
+                    apr_psprintf(r->pool,
+                            "Atlas consolidation function must be one of "
+                            "AVERAGE, MIN, MAX or LAST: %s", cf), NULL);
+            return HTTP_BAD_REQUEST;
+        }
+
+        parse_element(r->pool, apr_psprintf(r->pool, "DEF:atlas=*.rrd:%s:%s",
+                ds ? ds : "*", cf ? cf : "AVERAGE"), NULL, NULL, cmds->cmds);
+    }
+
+    /* resolve permissions and wildcards of rrd files */
+    ret = resolve_rrds(r, cmds);
+    if (OK != ret) {
+        return ret;
+    }
+
+    /* evaluate the options, we never pass these to rrdgraph */
+    ret = generate_args(r, cmds, &args);
+    if (OK != ret) {
+        return ret;
+    }
+
+    ret = parse_window(r, args, &start, &end, &step);
+    if (OK != ret) {
+        cleanup_args(r, cmds);
+        return ret;
+    }
+
+    /* the size options are the size of each tile, with room for a line */
+    ret = image_side(r, args, "Atlas", "--width", 3, &width);
+    if (OK == ret) {
+        ret = image_side(r, args, "Atlas", "--height", 4, &height);
+    }
+    if (OK != ret) {
+        cleanup_args(r, cmds);
+        return ret;
+    }
+    if (!lookup_arg(args, "--step")) {
+        step = (end - start) / width;
+        if (!step) {
+            step = 1;
+        }
+    }
+
+    /* the atlas shows the named DEF, or the first DEF */
+    vname = apr_table_get(cmds->params, "atlas");
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+
+        if (RRD_CONF_DEF == cmd->type
+                && (!vname || strcmp(vname, cmd->d.vname) == 0)) {
+            def = cmd;
+            break;
+        }
+    }
+    if (!def) {
+        log_message(r, APR_SUCCESS,
+                apr_psprintf(r->pool,
+                        "Atlas DEF '%s' was not found", vname ? vname : ""), NULL);
+        cleanup_args(r, cmds);
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* the tiles are laid out in rows of columns, and bounded in total */
+    ntiles = def->d.requests->nelts;
+    if (columns > ntiles) {
+        columns = ntiles ? ntiles : 1;
+    }
+    nrows = ntiles ? (ntiles + columns - 1) / columns : 1;
+    ret = check_image_size(r, "Atlas", width, height,
+            (apr_int64_t)columns * width * nrows * height);
+    if (OK != ret) {
+        cleanup_args(r, cmds);
+        return ret;
+    }
+
+    /* the image and the index are made together, and cached together */
+    format = parse_rrdgraph_suffix(r);
+    png_cache = atlas_cachename(r, conf, args, def, columns, "png");
+    json_cache = atlas_cachename(r, conf, args, def, columns, "json");
+
+    if (cache_lookup(r, conf, strcasecmp(format, "JSON") ? png_cache : json_cache,
+            &file, &finfo) == RRD_CACHE_FRESH) {
+        cleanup_args(r, cmds);
+
+        apr_brigade_insert_file(bb, file, 0, finfo.size, r->pool);
+        len = finfo.size;
+    }
+    else {
+        if (file) {
+            apr_file_close(file);
+        }
+
+        /* one tile per matching file, filled a row at a time */
+        rgb = apr_palloc(r->pool,
+                (apr_size_t)columns * width * nrows * height * 3);
+        memset(rgb, 0xff, (apr_size_t)columns * width * nrows * height * 3);
+        cols = apr_palloc(r->pool, width * sizeof(double));
+        counts = apr_palloc(r->pool, width * sizeof(int));
+
+        apr_brigade_printf(json, NULL, NULL,
+                "{\"start\":%" APR_TIME_T_FMT ",\"end\":%" APR_TIME_T_FMT
+                ",\"width\":%d,\"height\":%d,\"columns\":%d,\"tiles\":[",
+                (apr_time_t)start, (apr_time_t)end, width, height, columns);
+
+        for (i = 0; i < ntiles; ++i) {
+            request_rec *rr = APR_ARRAY_IDX(def->d.requests, i, request_rec *);
+            int tx = (i % columns) * width, ty = (i / columns) * height;
+            rrd_columns_t summary;
+            rrd_series_t series;
+            const char *err;
+
+            err = fetch_series(r->pool, NULL, cold_source(r, rr), def->d.dsname,
+                    def->d.cf, start, end, step, &series);
+
+            /* average the rows falling into each column */
+            series_columns(&series, start, end, cols, counts, width, &summary);
+
+            atlas_tile(rgb + ((apr_size_t)ty * columns * width + tx) * 3,
+                    columns * width, cols, width, height, summary.min,
+                    summary.max);
+
+            apr_brigade_printf(json, NULL, NULL,
+                    "%s{\"path\":\"%s\",\"x\":%d,\"y\":%d,"
+                    "\"min\":%s,\"max\":%s,\"last\":%s%s%s%s}",
+                    i ? "," : "",
+                    pescape_json(r->pool, relative_path(r, rr->filename)),
+                    tx, ty, pjson_number(r->pool, summary.min),
+                    pjson_number(r->pool, summary.max),
+                    pjson_number(r->pool, summary.last),
+                    err ? ",\"error\":\"" : "",
+                    err ? pescape_json(r->pool, err) : "", err ? "\"" : "");
+        }
+
+        apr_brigade_puts(json, NULL, NULL, "]}\n");
+
+        /* we have the data, the files are no longer needed */
+        cleanup_args(r, cmds);
+
+        rv = write_png(r->pool, png, rgb, columns * width, nrows * height);
+        if (APR_SUCCESS != rv) {
+            log_message(r, rv, "Atlas could not be compressed", NULL);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (png_cache) {
+            cache_store(r, png_cache, png);
+            cache_store(r, json_cache, json);
+        }
+
+        if (strcasecmp(format, "JSON")) {
+            APR_BRIGADE_CONCAT(bb, png);
+        }
+        else {
+            APR_BRIGADE_CONCAT(bb, json);
+        }
+        apr_brigade_length(bb, 1, &len);
+    }
+
+    ap_set_content_type(r, lookup_content_type(format));
+    ap_set_content_length(r, len);
+
+    /* send our response down the stack */
+    return pass_brigade(r, bb);
+}
+
+
+static void index_summarise(apr_pool_t *p, const rrd_value_t *data,
+        unsigned long ds_cnt, unsigned long ds, time_t start,
+        unsigned long step, unsigned long rows, time_t end,
+        apr_interval_time_t size, int count, rrd_summary_t *buckets)
+{
+    int *counts = apr_pcalloc(p, count * sizeof(int));
+    unsigned long i;
+    int b;
+
+    for (b = 0; b < count; ++b) {
+        buckets[b].min = buckets[b].max = buckets[b].last = NAN;
+        buckets[b].avg = 0;
+    }
+
+    /* bucket zero is the most recent, ending at end */
+    for (i = 0; i < rows; ++i) {
+        time_t t = start + (i + 1) * step;
+        double v = data[i * ds_cnt + ds];
+        rrd_summary_t *bucket;
+
+        if (isnan(v) || t > end || t <= end - size * count) {
+            continue;
+        }
+
+        b = (end - t) / size;
+        bucket = &buckets[b];
+        bucket->min = isnan(bucket->min) || v < bucket->min ? v : bucket->min;
+        bucket->max = isnan(bucket->max) || v > bucket->max ? v : bucket->max;
+        bucket->avg += v;
+        bucket->last = v;
+        counts[b]++;
+    }
+
+    for (b = 0; b < count; ++b) {
+        buckets[b].avg = counts[b] ? buckets[b].avg / counts[b] : NAN;
+    }
+}
+
+/*
+ * Replace the minimum or maximum of each bucket with that of the MIN or
+ * MAX archive, as the averages flatten the extremes.
+ */
+static void index_bound(apr_pool_t *p, const rrd_value_t *data,
+        unsigned long ds_cnt, unsigned long ds, time_t start, unsigned long step,
+        unsigned long rows, time_t end, apr_interval_time_t size, int count,
+        int max, rrd_summary_t *buckets)
+{
+    int *seen = apr_pcalloc(p, count * sizeof(int));
+    unsigned long i;
+    int b;
+
+    for (i = 0; i < rows; ++i) {
+        time_t t = start + (i + 1) * step;
+        double v = data[i * ds_cnt + ds];
+        double *bound;
+
+        if (isnan(v) || t > end || t <= end - size * count) {
+            continue;
+        }
+
+        b = (end - t) / size;
+        bound = max ? &buckets[b].max : &buckets[b].min;
+        if (!seen[b]++ || (max ? v > *bound : v < *bound)) {
+            *bound = v;
+        }
+    }
+}
+
+/*
+ * Summarise each data source over the count buckets of the given size
+ * ending at end, from the AVERAGE archive and, where the file has them,
+ * the MIN and MAX archives.
+ */
+static const char *index_window(apr_pool_t *p, const char *filename,
+        time_t end, apr_interval_time_t size, int count, unsigned long step,
+        unsigned long *ds_cnt, char ***names, rrd_summary_t **buckets)
+{
+    static const char * const cfs[] = { "MIN", "MAX" };
+    rrd_instance_t *instance;
+    char **namv = NULL;
+    rrd_value_t *data = NULL;
+    time_t s = end - size * count, e = end;
+    unsigned long st = step, cnt = 0, i;
+    int c;
+
+    /* the error state of librrd is shared, hold a copy of it */
+    instance = instance_acquire(NULL);
+
+    if (instance->fetch_r(filename, "AVERAGE", &s, &e, &st, &cnt, &namv,
+            &data) == -1) {
+        const char *err = apr_pstrdup(p, instance->get_error());
+        instance->clear_error();
+        instance_release(instance);
+        return err;
+    }
+
+    *ds_cnt = cnt;
+    *names = apr_palloc(p, (cnt ? cnt : 1) * sizeof(char *));
+    *buckets = apr_pcalloc(p, (cnt ? cnt : 1) * count * sizeof(rrd_summary_t));
+
+    for (i = 0; i < cnt; ++i) {
+        (*names)[i] = apr_pstrdup(p, namv[i]);
+        index_summarise(p, data, cnt, i, s, st, st ? (e - s) / st : 0,
+                end, size, count, &(*buckets)[i * count]);
+        instance->freemem(namv[i]);
+    }
+    instance->freemem(namv);
+    instance->freemem(data);
+
+    for (c = 0; c < 2; ++c) {
+        unsigned long mcnt = 0;
+
+        s = end - size * count;
+        e = end;
+        st = step;
+        namv = NULL;
+        data = NULL;
+
+        /* not every file keeps the extremes */
+        if (instance->fetch_r(filename, cfs[c], &s, &e, &st, &mcnt, &namv,
+                &data) == -1) {
+            instance->clear_error();
+            continue;
+        }
+
+        for (i = 0; i < mcnt; ++i) {
+            if (mcnt == cnt && st) {
+                index_bound(p, data, mcnt, i, s, st, (e - s) / st, end, size,
+                        count, c, &(*buckets)[i * count]);
+            }
+            instance->freemem(namv[i]);
+        }
+        instance->freemem(namv);
+        instance->freemem(data);
+    }
+
+    instance_release(instance);
+
+    return NULL;
+}
+
+/*
+ * Read back a sidecar written by an earlier pass, or return NULL.
+ */
+static rrd_index_ds_t *index_read(apr_pool_t *p, const char *sidecar,
+        rrd_index_header_t *header)
+{
+    rrd_index_ds_t *dss = NULL;
+    apr_file_t *file;
+    apr_size_t len;
+
+    if (apr_file_open(&file, sidecar, APR_FOPEN_READ | APR_FOPEN_BINARY,
+            APR_FPROT_OS_DEFAULT, p) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    if (apr_file_read_full(file, header, sizeof(*header), &len) == APR_SUCCESS
+            && index_header_valid(header) && header->ds_cnt) {
+        dss = apr_palloc(p, header->ds_cnt * sizeof(rrd_index_ds_t));
+        if (apr_file_read_full(file, dss,
+                header->ds_cnt * sizeof(rrd_index_ds_t), &len)
+                != APR_SUCCESS) {
+            dss = NULL;
+        }
+    }
+
+    apr_file_close(file);
+
+    return dss;
+}
+
+/*
+ * Summarise each data source of an RRD file into hourly and daily buckets,
+ * and replace the sidecar atomically. Only the buckets since the last
+ * pass are fetched, the ring of earlier buckets is shifted along.
+ */
+static const char *index_build(apr_pool_t *p, const char *filename,
+        const char *sidecar)
+{
+    rrd_index_header_t header, old;
+    rrd_index_ds_t *dss, *olddss;
+    rrd_summary_t *hours = NULL, *days = NULL;
+    char **hour_names = NULL, **day_names = NULL;
+    unsigned long hour_cnt = 0, day_cnt = 0, i;
+    time_t now = time(NULL);
+    apr_int64_t hour_shift = RRD_INDEX_HOURS, day_shift = RRD_INDEX_DAYS;
+    int hour_count, day_count, b;
+    apr_file_t *file;
+    char *tmp, *slash;
+    const char *err = NULL;
+    apr_size_t len;
+    apr_status_t rv;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RRD_INDEX_MAGIC, sizeof(header.magic));
+    header.order = RRD_INDEX_ORDER;
+    header.hours = RRD_INDEX_HOURS;
+    header.days = RRD_INDEX_DAYS;
+    header.hour_end = (now / 3600 + 1) * 3600;
+    header.day_end = (now / 86400 + 1) * 86400;
+
+    /* the last bucket of the last pass was partial, fetch it again */
+    olddss = index_read(p, sidecar, &old);
+    if (olddss && header.hour_end >= old.hour_end
+            && header.day_end >= old.day_end) {
+        hour_shift = (header.hour_end - old.hour_end) / 3600;
+        day_shift = (header.day_end - old.day_end) / 86400;
+    }
+    else {
+        olddss = NULL;
+    }
+
+    for (;;) {
+        hour_count = olddss && hour_shift < RRD_INDEX_HOURS ?
+                hour_shift + 1 : RRD_INDEX_HOURS;
+        day_count = olddss && day_shift < RRD_INDEX_DAYS ?
+                day_shift + 1 : RRD_INDEX_DAYS;
+
+        /* the finest data for the hours, hourly or coarser for the days */
+        if ((err = index_window(p, filename, header.hour_end, 3600,
+                hour_count, 1, &hour_cnt, &hour_names, &hours))
+                || (err = index_window(p, filename, header.day_end, 86400,
+                day_count, 3600, &day_cnt, &day_names, &days))) {
+            return err;
+        }
+        if (hour_cnt != day_cnt) {
+            return "The data sources changed while indexing";
+        }
+
+        /* the data sources changed since the last pass, start again */
+        if (olddss && old.ds_cnt != hour_cnt) {
+            olddss = NULL;
+            continue;
+        }
+        for (i = 0; olddss && i < hour_cnt; ++i) {
+            if (strncmp(olddss[i].name, hour_names[i], RRD_INDEX_NAME)) {
+                olddss = NULL;
+            }
+        }
+        if (!olddss && (hour_count < RRD_INDEX_HOURS
+                || day_count < RRD_INDEX_DAYS)) {
+            continue;
+        }
+
+        break;
+    }
 
-static int generate_tick(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds,
-        apr_array_header_t *args, int *i)
-{
-    int j, k;
+    header.ds_cnt = hour_cnt;
+    dss = apr_pcalloc(p, (hour_cnt ? hour_cnt : 1) * sizeof(rrd_index_ds_t));
 
-    /* no reference */
-    if (!cmd->def) {
-        log_message(r, APR_SUCCESS,
-                apr_psprintf(r->pool,
-                        "TICK element referred to '%s', which does not exist",
-                        cmd->t.vname), NULL);
-        return HTTP_BAD_REQUEST;
-    }
+    for (i = 0; i < hour_cnt; ++i) {
+        apr_cpystrn(dss[i].name, hour_names[i], RRD_INDEX_NAME);
 
-    /* no results */
-    else if (cmd->def->num == 0) {
-        /* output nothing */
-    }
+        memcpy(dss[i].hours, &hours[i * hour_count],
+                hour_count * sizeof(rrd_summary_t));
+        for (b = hour_count; b < RRD_INDEX_HOURS; ++b) {
+            dss[i].hours[b] = olddss[i].hours[b - hour_shift];
+        }
 
-    /* one result */
-    else if (cmd->def->num == 1) {
-        const char *arg;
-        request_rec *rr = ((request_rec **)cmd->def->d.requests->elts)[0];
+        memcpy(dss[i].days, &days[i * day_count],
+                day_count * sizeof(rrd_summary_t));
+        for (b = day_count; b < RRD_INDEX_DAYS; ++b) {
+            dss[i].days[b] = olddss[i].days[b - day_shift];
+        }
+    }
 
-        const char *legend = cmd->t.legend;
-        if (cmd->t.elegend) {
-            const char *err = NULL;
-            legend = ap_expr_str_exec(rr, cmd->t.elegend, &err);
-            if (err) {
-                log_message(r, APR_SUCCESS,
-                    apr_psprintf(r->pool,
-                            "While evaluating an element expression: %s", err), NULL);
-                return HTTP_INTERNAL_SERVER_ERROR;
-            }
-            legend = pescape_colon(r->pool, legend);
+    /* write to a temporary file, then rename over the old sidecar */
+    slash = strrchr(sidecar, '/');
+    if (slash) {
+        apr_dir_make_recursive(apr_pstrndup(p, sidecar, slash - sidecar),
+                APR_FPROT_OS_DEFAULT, p);
+    }
+    tmp = apr_pstrcat(p, sidecar, ".XXXXXX", NULL);
+    rv = apr_file_mktemp(&file, tmp, APR_FOPEN_CREATE | APR_FOPEN_WRITE
+            | APR_FOPEN_EXCL | APR_FOPEN_BINARY, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_write_full(file, &header, sizeof(header), &len);
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_write_full(file, dss,
+                    hour_cnt * sizeof(rrd_index_ds_t), &len);
+        }
+        apr_file_close(file);
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_rename(tmp, sidecar, p);
+        }
+        if (rv != APR_SUCCESS) {
+            apr_file_remove(tmp, p);
         }
-        arg = apr_psprintf(r->pool, "TICK:%s%s%s:%s:%s%s%s",
-                cmd->t.vname,
-                cmd->t.colour ? "#" : "", cmd->t.colour ? cmd->t.colour : "",
-                cmd->t.fraction,
-                legend,
-                cmd->t.args[0] ? ":" : "", cmd->t.args);
-        APR_ARRAY_PUSH(args, const char *) = arg;
+    }
+    if (rv != APR_SUCCESS) {
+        char buf[HUGE_STRING_LEN];
+        err = apr_psprintf(p, "Could not write '%s': %s", sidecar,
+                apr_strerror(rv, buf, sizeof(buf)));
     }
 
-    /* more than one result */
-    else {
-        int skip = 0;
+    return err;
+}
 
-        /* handle each TICK: line */
-        for (j = 0; j < cmd->def->num; ++j) {
-            const char *arg;
-            request_rec *rr = ((request_rec **)cmd->def->d.requests->elts)[j];
+static void index_walk(apr_pool_t *p, rrd_indexer_t *ctx,
+        rrd_index_t *index, const char *path)
+{
+    apr_dir_t *dir;
+    apr_finfo_t dirent, finfo, sinfo;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
 
-            const char *legend = cmd->t.legend;
-            if (cmd->t.elegend) {
-                const char *err = NULL;
-                legend = ap_expr_str_exec(rr, cmd->t.elegend, &err);
-                if (err) {
-                    log_message(r, APR_SUCCESS,
-                        apr_psprintf(r->pool,
-                                "While evaluating an element expression: %s", err), NULL);
-                    return HTTP_INTERNAL_SERVER_ERROR;
-                }
-                legend = pescape_colon(r->pool, legend);
-            }
+    if (apr_dir_open(&dir, path, p) != APR_SUCCESS) {
+        return;
+    }
 
-            arg = apr_psprintf(r->pool, "TICK:%sw%d%s%s:%s:%s%s%s",
-                    cmd->t.vname, j,
-                    cmd->t.colour ? "#" : "", cmd->t.colour ? cmd->t.colour : "",
-                    cmd->t.fraction,
-                    legend,
-                    cmd->t.args[0] ? ":" : "", cmd->t.args);
-            APR_ARRAY_PUSH(args, const char *) = arg;
+    apr_pool_create(&ptemp, p);
 
-            for (k = *i + 1; k < cmds->cmds->nelts; ++k) {
-                rrd_cmd_t *pcmd = &((rrd_cmd_t *)cmds->cmds->elts)[k];
-                if (pcmd->def == cmd->def) {
-                    switch (pcmd->type) {
-                    case RRD_CONF_PRINT:
+    while (!rrd_index_stopping
+            && ((rv = apr_dir_read(&dirent, APR_FINFO_NAME | APR_FINFO_TYPE,
+                    dir)) == APR_SUCCESS || rv == APR_INCOMPLETE)) {
+        const char *fname, *sidecar, *err;
+        apr_size_t len;
 
-                        APR_ARRAY_PUSH(args, const char *) =
-                            apr_psprintf(r->pool, "PRINT:%sw%d:%s",
-                                pcmd->p.vname, j, pcmd->p.format);
+        if (!dirent.name || dirent.name[0] == '.') {
+            continue;
+        }
 
-                        break;
-                    case RRD_CONF_GPRINT:
+        apr_pool_clear(ptemp);
+        fname = apr_pstrcat(ptemp, path, "/", dirent.name, NULL);
 
-                        APR_ARRAY_PUSH(args, const char *) =
-                            apr_psprintf(r->pool, "GPRINT:%sw%d:%s",
-                                pcmd->p.vname, j, pcmd->p.format);
+        if (apr_stat(&finfo, fname, APR_FINFO_TYPE | APR_FINFO_MTIME, ptemp)
+                != APR_SUCCESS) {
+            continue;
+        }
 
-                        break;
-                    default:
-                        /* skip the print/grint */
-                        skip = k - *i - 1;
-                        /* jump out of the loop */
-                        k = cmds->cmds->nelts;
-                    }
-                }
-                else {
-                    /* skip the print/grint */
-                    skip = k - *i - 1;
-                    /* jump out of the loop */
-                    k = cmds->cmds->nelts;
-                }
-            }
+        if (finfo.filetype == APR_DIR) {
+            index_walk(ptemp, ctx, index, fname);
+            continue;
+        }
+
+        len = strlen(dirent.name);
+        if (finfo.filetype != APR_REG || len < 4
+                || strcmp(dirent.name + len - 4, ".rrd")) {
+            continue;
+        }
 
+        /* only files that changed since the last pass are summarised */
+        sidecar = apr_pstrcat(ptemp, index->dir, fname + strlen(index->root),
+                ".idx", NULL);
+        if (apr_stat(&sinfo, sidecar, APR_FINFO_MTIME, ptemp) == APR_SUCCESS
+                && sinfo.mtime >= finfo.mtime) {
+            continue;
+        }
+
+        err = index_build(ptemp, fname, sidecar);
+        if (err) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, ctx->s,
+                    "mod_rrd: Could not index '%s': %s", fname, err);
         }
-        *i += skip;
     }
 
-    return OK;
+    apr_pool_destroy(ptemp);
+    apr_dir_close(dir);
 }
 
-static int generate_area(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds,
-        apr_array_header_t *args, int *i)
+#if APR_HAS_FORK
+static void index_stop(int signo)
 {
-    int j, k;
+    rrd_index_stopping = 1;
+}
 
-    /* no reference */
-    if (!cmd->def) {
-        log_message(r, APR_SUCCESS,
-                apr_psprintf(r->pool,
-                        "AREA element referred to '%s', which does not exist",
-                        cmd->a.vname), NULL);
-        return HTTP_BAD_REQUEST;
-    }
+/*
+ * The indexer walks each index in turn at its interval, until told to
+ * stop or orphaned by the parent.
+ */
+static void index_run(rrd_indexer_t *ctx)
+{
+    apr_pool_t *ptemp;
+    pid_t parent = getppid();
+    int i;
 
-    /* no results */
-    else if (cmd->def->num == 0) {
-        /* output nothing */
-    }
+    apr_pool_create(&ptemp, ctx->pool);
 
-    /* one result */
-    else if (cmd->def->num == 1) {
-        const char *arg;
-        request_rec *rr = ((request_rec **)cmd->def->d.requests->elts)[0];
+    while (!rrd_index_stopping && getppid() == parent) {
+        apr_time_t now = apr_time_now();
 
-        const char *legend = cmd->a.legend;
-        if (cmd->a.elegend) {
-            const char *err = NULL;
-            legend = ap_expr_str_exec(rr, cmd->a.elegend, &err);
-            if (err) {
-                log_message(r, APR_SUCCESS,
-                    apr_psprintf(r->pool,
-                            "While evaluating an element expression: %s", err), NULL);
-                return HTTP_INTERNAL_SERVER_ERROR;
+        for (i = 0; i < ctx->indexes->nelts && !rrd_index_stopping; ++i) {
+            rrd_index_t *index = &APR_ARRAY_IDX(ctx->indexes, i, rrd_index_t);
+
+            if (now < index->next) {
+                continue;
             }
-            legend = pescape_colon(r->pool, legend);
+            index->next = now + index->interval;
+
+            apr_dir_make_recursive(index->dir, APR_FPROT_OS_DEFAULT, ptemp);
+            index_walk(ptemp, ctx, index, index->root);
+
+            apr_pool_clear(ptemp);
         }
 
-        arg = apr_psprintf(r->pool, "AREA:%s%s%s:%s%s%s",
-                cmd->a.vname,
-                cmd->a.colour ? "#" : "", cmd->a.colour ? cmd->a.colour : "",
-                legend,
-                cmd->a.args[0] ? ":" : "", cmd->a.args);
-        APR_ARRAY_PUSH(args, const char *) = arg;
+        apr_sleep(apr_time_from_sec(1));
     }
 
-    /* more than one result */
-    else {
-        int skip = 0;
+    apr_pool_destroy(ptemp);
+}
 
-        /* handle each AREA: line */
-        for (j = 0; j < cmd->def->num; ++j) {
-            const char *arg;
-            request_rec *rr = ((request_rec **)cmd->def->d.requests->elts)[j];
+static apr_status_t index_start(rrd_indexer_t *ctx);
 
-            const char *legend = cmd->a.legend;
-            if (cmd->a.elegend) {
-                const char *err = NULL;
-                legend = ap_expr_str_exec(rr, cmd->a.elegend, &err);
-                if (err) {
-                    log_message(r, APR_SUCCESS,
-                        apr_psprintf(r->pool,
-                                "While evaluating an element expression: %s", err), NULL);
-                    return HTTP_INTERNAL_SERVER_ERROR;
-                }
-                legend = pescape_colon(r->pool, legend);
-            }
+static void index_maintenance(int reason, void *data, int status)
+{
+    rrd_indexer_t *ctx = data;
+
+    switch (reason) {
+    case APR_OC_REASON_DEATH:
+    case APR_OC_REASON_LOST:
+        /* the indexer went away, start another */
+        apr_proc_other_child_unregister(ctx);
+        ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, ctx->s,
+                "mod_rrd: The index process exited, restarting");
+        index_start(ctx);
+        break;
+    case APR_OC_REASON_RESTART:
+        apr_proc_other_child_unregister(ctx);
+        break;
+    }
+}
 
-            arg = apr_psprintf(r->pool, "AREA:%sw%d%s%s:%s%s%s",
-                    cmd->a.vname, j,
-                    cmd->a.colour ? "#" : "", cmd->a.colour ? cmd->a.colour : "",
-                    legend,
-                    cmd->a.args[0] ? ":" : "", cmd->a.args);
-            APR_ARRAY_PUSH(args, const char *) = arg;
+/*
+ * The sidecars are kept up to date by one process of their own, forked
+ * from the parent and running with the privileges of the children.
+ */
+static apr_status_t index_start(rrd_indexer_t *ctx)
+{
+    apr_status_t rv;
 
-            for (k = *i + 1; k < cmds->cmds->nelts; ++k) {
-                rrd_cmd_t *pcmd = &((rrd_cmd_t *)cmds->cmds->elts)[k];
-                if (pcmd->def == cmd->def) {
-                    switch (pcmd->type) {
-                    case RRD_CONF_PRINT:
+    rv = apr_proc_fork(&ctx->proc, ctx->pool);
+    if (APR_INCHILD == rv) {
+        ap_close_listeners();
+        apr_signal(SIGCHLD, SIG_IGN);
+        apr_signal(SIGHUP, SIG_IGN);
+        apr_signal(SIGTERM, index_stop);
+
+        if (ap_run_drop_privileges(ctx->pool, ctx->s)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, APR_SUCCESS, ctx->s,
+                    "mod_rrd: Could not drop privileges, not indexing");
+            exit(1);
+        }
 
-                        APR_ARRAY_PUSH(args, const char *) =
-                            apr_psprintf(r->pool, "PRINT:%sw%d:%s",
-                                pcmd->p.vname, j, pcmd->p.format);
+        /* the indexer only ever needs the linked copy of librrd */
+        instance_linked(ctx->pool, 1);
+        index_run(ctx);
 
-                        break;
-                    case RRD_CONF_GPRINT:
+        exit(0);
+    }
+    if (APR_INPARENT != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, ctx->s,
+                "mod_rrd: Could not start the index process");
+        return rv;
+    }
 
-                        APR_ARRAY_PUSH(args, const char *) =
-                            apr_psprintf(r->pool, "GPRINT:%sw%d:%s",
-                                pcmd->p.vname, j, pcmd->p.format);
+    apr_pool_note_subprocess(ctx->pool, &ctx->proc, APR_KILL_AFTER_TIMEOUT);
+    apr_proc_other_child_register(&ctx->proc, index_maintenance, ctx, NULL,
+            ctx->pool);
 
-                        break;
-                    default:
-                        /* skip the print/grint */
-                        skip = k - *i - 1;
-                        /* jump out of the loop */
-                        k = cmds->cmds->nelts;
-                    }
-                }
-                else {
-                    /* skip the print/grint */
-                    skip = k - *i - 1;
-                    /* jump out of the loop */
-                    k = cmds->cmds->nelts;
-                }
-            }
+    return APR_SUCCESS;
+}
+#endif
 
-        }
-        *i += skip;
-    }
+static int index_compare_desc(const void *a, const void *b)
+{
+    const rrd_match_t *ma = a, *mb = b;
 
-    return OK;
+    return ma->indexed < mb->indexed ? 1 : ma->indexed > mb->indexed ? -1 : 0;
 }
 
-static int generate_line(request_rec *r, rrd_cmd_t *cmd, rrd_cmds_t *cmds,
-        apr_array_header_t *args, int *i)
+static int index_compare_asc(const void *a, const void *b)
 {
-    int j, k;
+    return index_compare_desc(b, a);
+}
+
+static int get_rrdindex(request_rec *r)
+{
+    rrd_server_conf *sconf = ap_get_module_config(r->server->module_config,
+            &rrd_module);
+    apr_bucket_brigade *bb = apr_brigade_create(r->pool,
+            r->connection->bucket_alloc);
+    rrd_cmds_t *cmds;
+    const char *stat, *op, *val;
+    double threshold = NAN;
+    time_t now = apr_time_sec(r->request_time), from;
+    apr_int64_t window = 86400;
+    int limit = 10, i, first = 1;
+
+    int ret;
+
+    /* pull apart the query string, reject unrecognised options */
+    ret = parse_query(r, &cmds);
+    if (OK != ret) {
+        return ret;
+    }
 
-    /* no reference */
-    if (!cmd->def) {
+    stat = (val = apr_table_get(cmds->params, "index-stat")) ? val : "max";
+    op = apr_table_get(cmds->params, "index-op");
+    if ((val = apr_table_get(cmds->params, "index-window"))) {
+        window = apr_atoi64(val);
+    }
+    if ((val = apr_table_get(cmds->params, "index-value"))) {
+        threshold = strtod(val, NULL);
+    }
+    if ((val = apr_table_get(cmds->params, "index-limit"))) {
+        limit = atoi(val);
+    }
+
+    if ((strcmp(stat, "min") && strcmp(stat, "max")
+            && strcmp(stat, "average") && strcmp(stat, "last"))
+            || (op && strcmp(op, "gt") && strcmp(op, "ge")
+                    && strcmp(op, "lt") && strcmp(op, "le"))
+            || (op && isnan(threshold))
+            || window <= 0 || window > RRD_INDEX_DAYS * 86400 || limit < 0) {
         log_message(r, APR_SUCCESS,
-                apr_psprintf(r->pool,
-                        "LINE element referred to '%s', which does not exist",
-                        cmd->l.vname), NULL);
+                "Index queries take index-stat=min|max|average|last, "
+                "index-op=gt|ge|lt|le with index-value, index-limit, "
+                "and an index-window of up to " APR_STRINGIFY(RRD_INDEX_DAYS)
+                " days", NULL);
         return HTTP_BAD_REQUEST;
     }
+    from = now - window;
 
-    /* no results */
-    else if (cmd->def->num == 0) {
-        /* output nothing */
+    /* resolve permissions and wildcards of rrd files */
+    ret = resolve_rrds(r, cmds);
+    if (OK != ret) {
+        return ret;
     }
 
-    /* one result */
-    else if (cmd->def->num == 1) {
-        const char *arg;
-        request_rec *rr = ((request_rec **)cmd->def->d.requests->elts)[0];
-
-        const char *legend = cmd->l.legend;
-        if (cmd->l.elegend) {
-            const char *err = NULL;
-            legend = ap_expr_str_exec(rr, cmd->l.elegend, &err);
-            if (err) {
-                log_message(r, APR_SUCCESS,
-                    apr_psprintf(r->pool,
-                            "While evaluating an element expression: %s", err), NULL);
-                return HTTP_INTERNAL_SERVER_ERROR;
-            }
-            legend = pescape_colon(r->pool, legend);
-        }
-        arg = apr_psprintf(r->pool, "%s:%s%s%s:%s%s%s",
-                cmd->l.line, cmd->l.vname,
-                cmd->l.colour ? "#" : "", cmd->l.colour ? cmd->l.colour : "",
-                legend,
-                cmd->l.args[0] ? ":" : "", cmd->l.args);
-        APR_ARRAY_PUSH(args, const char *) = arg;
-    }
+    apr_brigade_printf(bb, NULL, NULL,
+            "{\"stat\":\"%s\",\"window\":%" APR_INT64_T_FMT ",\"defs\":{",
+            stat, window);
 
-    /* more than one result */
-    else {
-        int skip = 0;
+    for (i = 0; i < cmds->cmds->nelts; ++i) {
+        rrd_cmd_t *cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+        apr_array_header_t *matches;
+        int j, unindexed = 0;
 
-        /* handle each LINE: line */
-        for (j = 0; j < cmd->def->num; ++j) {
-            const char *arg;
-            request_rec *rr = ((request_rec **)cmd->def->d.requests->elts)[j];
+        if (RRD_CONF_DEF != cmd->type) {
+            continue;
+        }
 
-            const char *legend = cmd->l.legend;
-            if (cmd->l.elegend) {
-                const char *err = NULL;
-                legend = ap_expr_str_exec(rr, cmd->l.elegend, &err);
-                if (err) {
-                    log_message(r, APR_SUCCESS,
-                        apr_psprintf(r->pool,
-                                "While evaluating an element expression: %s", err), NULL);
-                    return HTTP_INTERNAL_SERVER_ERROR;
-                }
-                legend = pescape_colon(r->pool, legend);
+        /* filter and rank from the index alone */
+        matches = apr_array_make(r->pool, cmd->d.requests->nelts,
+                sizeof(rrd_match_t));
+        for (j = 0; j < cmd->d.requests->nelts; ++j) {
+            request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, j, request_rec *);
+            const char *sidecar = index_sidecar(r->pool,
+                    sconf ? sconf->indexes : NULL, rr->filename);
+            double v = sidecar ? index_lookup(r->pool, sidecar,
+                    cmd->d.dsname, from, stat) : NAN;
+            rrd_match_t *match;
+
+            if (isnan(v)) {
+                unindexed++;
+                continue;
+            }
+            if (op && !((!strcmp(op, "gt") && v > threshold)
+                    || (!strcmp(op, "ge") && v >= threshold)
+                    || (!strcmp(op, "lt") && v < threshold)
+                    || (!strcmp(op, "le") && v <= threshold))) {
+                continue;
             }
 
-            arg = apr_psprintf(r->pool, "%s:%sw%d%s%s:%s%s%s",
-                    cmd->l.line, cmd->l.vname, j,
-                    cmd->l.colour ? "#" : "", cmd->l.colour ? cmd->l.colour : "",
-                    legend,
-                    cmd->l.args[0] ? ":" : "", cmd->l.args);
-            APR_ARRAY_PUSH(args, const char *) = arg;
-
-            for (k = *i + 1; k < cmds->cmds->nelts; ++k) {
-                rrd_cmd_t *pcmd = &((rrd_cmd_t *)cmds->cmds->elts)[k];
-                if (pcmd->def == cmd->def) {
-                    switch (pcmd->type) {
-                    case RRD_CONF_PRINT:
-
-                        APR_ARRAY_PUSH(args, const char *) =
-                            apr_psprintf(r->pool, "PRINT:%sw%d:%s",
-                                pcmd->p.vname, j, pcmd->p.format);
-
-                        break;
-                    case RRD_CONF_GPRINT:
-
-                        APR_ARRAY_PUSH(args, const char *) =
-                            apr_psprintf(r->pool, "GPRINT:%sw%d:%s",
-                                pcmd->p.vname, j, pcmd->p.format);
+            match = apr_array_push(matches);
+            match->rr = rr;
+            match->indexed = v;
+        }
 
-                        break;
-                    default:
-                        /* skip the print/grint */
-                        skip = k - *i - 1;
-                        /* jump out of the loop */
-                        k = cmds->cmds->nelts;
+        qsort(matches->elts, matches->nelts, sizeof(rrd_match_t),
+                op && op[0] == 'l' ? index_compare_asc : index_compare_desc);
+
+        apr_brigade_printf(bb, NULL, NULL,
+                "%s\"%s\":{\"matched\":%d,\"unindexed\":%d,\"candidates\":%d,"
+                "\"results\":[", first ? "" : ",",
+                pescape_json(r->pool, cmd->d.vname), cmd->d.requests->nelts,
+                unindexed, matches->nelts);
+        first = 0;
+
+        /* only the final few are read from the RRD files themselves */
+        for (j = 0; j < matches->nelts && j < limit; ++j) {
+            rrd_match_t *match = &APR_ARRAY_IDX(matches, j, rrd_match_t);
+            double exact = NAN, sum = 0;
+            rrd_series_t series;
+            unsigned long n, count = 0;
+
+            if (!fetch_series(r->pool, NULL, cold_source(r, match->rr), cmd->d.dsname,
+                    cmd->d.cf, from, now, 1, &series)) {
+                for (n = 0; n < series.rows; ++n) {
+                    double v = series.data[n];
+
+                    if (isnan(v)) {
+                        continue;
+                    }
+                    if (!strcmp(stat, "min")) {
+                        exact = isnan(exact) || v < exact ? v : exact;
                     }
+                    else if (!strcmp(stat, "max")) {
+                        exact = isnan(exact) || v > exact ? v : exact;
+                    }
+                    else if (!strcmp(stat, "last")) {
+                        exact = v;
+                    }
+                    sum += v;
+                    count++;
                 }
-                else {
-                    /* skip the print/grint */
-                    skip = k - *i - 1;
-                    /* jump out of the loop */
-                    k = cmds->cmds->nelts;
+                if (!strcmp(stat, "average") && count) {
+                    exact = sum / count;
                 }
             }
 
+            apr_brigade_printf(bb, NULL, NULL,
+                    "%s{\"path\":\"%s\",\"indexed\":%s,\"value\":%s}",
+                    j ? "," : "",
+                    pescape_json(r->pool,
+                            relative_path(r, match->rr->filename)),
+                    pjson_number(r->pool, match->indexed),
+                    pjson_number(r->pool, exact));
         }
-        *i += skip;
+
+        apr_brigade_puts(bb, NULL, NULL, "]}");
     }
 
-    return OK;
+    apr_brigade_puts(bb, NULL, NULL, "}}\n");
+
+    /* trigger an early cleanup to save memory */
+    cleanup_args(r, cmds);
+
+    ap_set_content_type(r, "application/json");
+
+    /* send our response down the stack */
+    return pass_brigade(r, bb);
 }
 
-static int generate_vdef(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
+static int read_body(request_rec *r, char **pbody, apr_size_t limit)
 {
-    int j;
-
-    /* no reference */
-    if (!cmd->def) {
-        log_message(r, APR_SUCCESS,
-                apr_psprintf(r->pool,
-                        "VDEF element referred to '%s', which does not exist",
-                        cmd->v.vname), NULL);
-        return HTTP_BAD_REQUEST;
-    }
+    apr_size_t len = 0, size = HUGE_STRING_LEN;
+    char *body;
+    long n = 0;
+    int ret;
 
-    /* no results */
-    else if (cmd->def->num == 0) {
-        /* output nothing */
+    ret = ap_setup_client_block(r, REQUEST_CHUNKED_DECHUNK);
+    if (OK != ret) {
+        return ret;
     }
 
-    /* one result */
-    else if (cmd->def->num == 1) {
-        APR_ARRAY_PUSH(args, const char *) =
-                apr_pstrcat(r->pool, "VDEF:", cmd->v.vname, "=",
-                        cmd->v.dsname, ",", cmd->v.rpn, NULL);
-    }
+    body = apr_palloc(r->pool, size + 1);
+    if (ap_should_client_block(r)) {
+        while ((n = ap_get_client_block(r, body + len, size - len)) > 0) {
+            len += n;
+            if (len == size) {
+                char *grown;
 
-    /* more than one result */
-    else {
-        /* handle each VDEF: line */
-        for (j = 0; j < cmd->def->num; ++j) {
-            const char *arg = apr_psprintf(r->pool, "VDEF:%sw%d=%sw%d,%s", cmd->v.vname,
-                j, cmd->v.dsname, j, cmd->v.rpn);
-            APR_ARRAY_PUSH(args, const char *) = arg;
+                if (size >= limit) {
+                    log_message(r, APR_SUCCESS,
+                            apr_psprintf(r->pool,
+                                    "Request body is larger than %" APR_SIZE_T_FMT
+                                    " bytes", limit), NULL);
+                    return HTTP_REQUEST_ENTITY_TOO_LARGE;
+                }
+                grown = apr_palloc(r->pool, size * 2 + 1);
+                memcpy(grown, body, len);
+                body = grown;
+                size *= 2;
+            }
+        }
+        if (n < 0) {
+            return HTTP_BAD_REQUEST;
         }
     }
+    body[len] = 0;
 
+    *pbody = body;
     return OK;
 }
 
-static int generate_cdef(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
+static const char *check_word(apr_pool_t *p, const char **line)
 {
-    int j, k;
-
-    /* no reference */
-    if (!cmd->def) {
-        log_message(r, APR_SUCCESS,
-                apr_psprintf(r->pool,
-                        "CDEF element '%s' referred to no existing definitions",
-                        cmd->c.vname), NULL);
-        return HTTP_BAD_REQUEST;
-    }
-
-    /* no results */
-    else if (cmd->def->num == 0) {
-        /* output nothing */
+    while (**line == ' ' || **line == '\t') {
+        ++*line;
     }
+    return **line ? getword_quote(p, line, ' ') : NULL;
+}
 
-    /* one result */
-    else if (cmd->def->num == 1) {
-        APR_ARRAY_PUSH(args, const char *) =
-                apr_pstrcat(r->pool, "CDEF:", cmd->c.vname, "=",
-                        cmd->c.rpn, NULL);
+/*
+ * Evaluate a check from the header of the file where that is enough, and
+ * otherwise from the fewest rows that cover the window: those of the
+ * coarsest archive of the consolidation function that fits within it.
+ */
+static void check_evaluate(apr_pool_t *p, rrd_check_t *check)
+{
+    rrd_instance_t *instance;
+    rrd_info_t *info, *i;
+    rrd_series_t series;
+    const char *ds = NULL, *type = NULL, *last = NULL;
+    char *key, *end;
+    double val = NAN, sum = 0;
+    unsigned long step = 0, width = 0, pdp = 0, rows = 0, n = 0, row;
+    time_t updated = 0;
+    int match = 0;
+
+    instance = instance_acquire(NULL);
+    info = instance->info_r(check->source);
+    if (!info) {
+        check->err = apr_pstrdup(p, instance->get_error());
+        instance->clear_error();
+        instance_release(instance);
+        return;
     }
 
-    /* more than one result */
-    else {
-        /* handle each CDEF: line */
-        for (j = 0; j < cmd->num; ++j) {
-            char *cdef;
-            int len;
+    for (i = info; i; i = i->next) {
+        if (!strcmp(i->key, "step")) {
+            step = i->value.u_cnt;
+        }
+        else if (!strcmp(i->key, "last_update")) {
+            updated = i->value.u_cnt;
+        }
+        else if (!strncmp(i->key, "ds[", 3) && (end = strchr(i->key, ']'))) {
+            key = apr_pstrndup(p, i->key + 3, end - i->key - 3);
 
-            /* first pass - work out the length */
-            len = apr_snprintf(NULL, 0, "CDEF:%sw%d=", cmd->c.vname, j);
-            for (k = 0; k < cmd->c.rpns->nelts; ++k) {
-                rrd_rpn_t *rp = (((rrd_rpn_t *)cmd->c.rpns->elts) + k);
-                if (k) {
-                    len++;
-                }
-                if (!rp->def || rp->def->num < 2) {
-                    len += apr_snprintf(NULL, 0, "%s", rp->rpn);
-                }
-                else {
-                    len += apr_snprintf(NULL, 0, "%sw%d", rp->rpn, j);
-                }
+            /* a data source of * is the first in the file */
+            if (!ds && (!strcmp(check->dsname, "*")
+                    || !strcmp(check->dsname, key))) {
+                ds = key;
+            }
+            if (ds && !strcmp(ds, key) && !strcmp(end, "].type")) {
+                type = apr_pstrdup(p, i->value.u_str);
+            }
+            if (ds && !strcmp(ds, key) && !strcmp(end, "].last_ds")) {
+                last = apr_pstrdup(p, i->value.u_str);
+            }
+        }
+        else if (!strncmp(i->key, "rra[", 4) && (end = strchr(i->key, ']'))) {
+            if (!strcmp(end, "].cf")) {
+                match = !strncasecmp(check->cf, i->value.u_str,
+                        strlen(i->value.u_str));
+                pdp = rows = 0;
+            }
+            else if (!strcmp(end, "].pdp_per_row")) {
+                pdp = i->value.u_cnt;
+            }
+            else if (!strcmp(end, "].rows")) {
+                rows = i->value.u_cnt;
             }
 
-            /* second pass, write the cdef */
-            cdef = apr_palloc(r->pool, len + 1);
-            APR_ARRAY_PUSH(args, const char *) = cdef;
-            cdef += apr_snprintf(cdef, len, "CDEF:%sw%d=", cmd->c.vname, j);
-            for (k = 0; k < cmd->c.rpns->nelts; ++k) {
-                rrd_rpn_t *rp = (((rrd_rpn_t *)cmd->c.rpns->elts) + k);
-                if (k) {
-                    *cdef++ = ',';
-                }
-                if (!rp->def || rp->def->num < 2) {
-                    cdef += apr_snprintf(cdef, len, "%s", rp->rpn);
-                }
-                else {
-                    cdef += apr_snprintf(cdef, len, "%sw%d", rp->rpn, j);
-                }
+            /* rows no wider than the window, reaching back to its start */
+            row = pdp * step;
+            if (match && pdp && rows && row > width
+                    && row <= (unsigned long) (check->end - check->start)
+                    && row * rows >= (unsigned long)
+                            (apr_time_sec(apr_time_now()) - check->start)) {
+                width = row;
             }
         }
     }
+    instance->info_free(info);
 
-    return OK;
-}
-
-static int generate_def(request_rec *r, rrd_cmd_t *cmd, apr_array_header_t *args)
-{
-    int j;
-
-    /* safety check - reject anything trying to set the daemon */
-    if (ap_strstr_c(cmd->d.cf, ":daemon=")) {
-        log_message(r, APR_SUCCESS,
-                    "DEF elements must not contain a 'daemon' parameter", NULL);
-        return HTTP_BAD_REQUEST;
+    if (!ds) {
+        check->err = apr_psprintf(p, "Data source '%s' was not found",
+                check->dsname);
+        instance_release(instance);
+        return;
     }
 
-    /* no results */
-    if (cmd->d.requests->nelts == 0) {
-        /* output nothing */
+    /* nothing written within the window, no value */
+    if (updated < check->start) {
+        instance_release(instance);
+        return;
     }
 
-    /* one result */
-    else if (cmd->d.requests->nelts == 1) {
-        request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, 0, request_rec *);
-        const char *arg = apr_psprintf(r->pool, "DEF:%s=%s:%s:%s", cmd->d.vname,
-        		pescape_colon(r->pool, rr->filename), cmd->d.dsname, cmd->d.cf);
-        APR_ARRAY_PUSH(args, const char *) = arg;
+    /* the last value given to a gauge is its last value */
+    if (!strncasecmp(check->cf, "LAST", 4) && type && !strcmp(type, "GAUGE")
+            && last) {
+        check->value = strtod(last, &end);
+        if (*end || end == last) {
+            check->value = NAN;
+        }
+        instance_release(instance);
+        return;
     }
 
-    /* more than one result */
-    else {
-        char *cdef;
-        int len = apr_snprintf(NULL, 0, "CDEF:%s=", cmd->d.vname);
+    check->err = fetch_series(p, instance, check->source, ds, check->cf,
+            check->start, check->end, width ? width : 1, &series);
+    instance_release(instance);
 
-        /* handle each DEF: line */
-        for (j = 0; j < cmd->d.requests->nelts; ++j) {
-            request_rec *rr = APR_ARRAY_IDX(cmd->d.requests, j, request_rec *);
-            const char *arg = apr_psprintf(r->pool, "DEF:%sw%d=%s:%s:%s", cmd->d.vname,
-                j, pescape_colon(r->pool, rr->filename), cmd->d.dsname, cmd->d.cf);
-            APR_ARRAY_PUSH(args, const char *) = arg;
-            len += apr_snprintf(NULL, 0, "%s%sw%d%s", j ? "," : "", cmd->d.vname, j, j ? ",+" : "");
+    /* consolidate the window the way the consolidation function would */
+    for (row = 0; !check->err && row < series.rows; ++row) {
+        double v = series.data[row];
+
+        if (isnan(v)) {
+            continue;
         }
+        if (!strncasecmp(check->cf, "MIN", 3)) {
+            val = isnan(val) || v < val ? v : val;
+        }
+        else if (!strncasecmp(check->cf, "MAX", 3)) {
+            val = isnan(val) || v > val ? v : val;
+        }
+        else if (!strncasecmp(check->cf, "LAST", 4)) {
+            val = v;
+        }
+        else {
+            sum += v;
+            n++;
+        }
+    }
+    if (!strncasecmp(check->cf, "AVERAGE", 7)) {
+        val = n ? sum / n : NAN;
+    }
+
+    check->value = val;
+}
+
+static int check_breach(rrd_threshold_t *rule, double v)
+{
+    return (!strcmp(rule->op, "gt") && v > rule->threshold)
+            || (!strcmp(rule->op, "ge") && v >= rule->threshold)
+            || (!strcmp(rule->op, "lt") && v < rule->threshold)
+            || (!strcmp(rule->op, "le") && v <= rule->threshold);
+}
+
+static const char *check_parse(request_rec *r, rrd_threshold_t *rule,
+        rrd_cmd_t *cmd, int index)
+{
+    rrd_instance_t *instance;
+    rrd_time_value_t start_tv, end_tv;
+    const char *line = rule->line, *threshold, *msg = NULL;
+    char *end, *err;
+
+    rule->path = check_word(r->pool, &line);
+    cmd->type = RRD_CONF_DEF;
+    cmd->d.vname = apr_psprintf(r->pool, "check%d", index);
+    cmd->d.path = rule->path;
+    cmd->d.dsname = check_word(r->pool, &line);
+    cmd->d.cf = check_word(r->pool, &line);
+    rule->window = check_word(r->pool, &line);
+    rule->op = check_word(r->pool, &line);
+    threshold = check_word(r->pool, &line);
+
+    if (!threshold || check_word(r->pool, &line)) {
+        return "Rules take a path, data source, consolidation function, "
+                "window, operator of gt, ge, lt or le, and threshold";
+    }
+
+    if (strcmp(rule->op, "gt") && strcmp(rule->op, "ge")
+            && strcmp(rule->op, "lt") && strcmp(rule->op, "le")) {
+        return apr_psprintf(r->pool, "Operator must be one of gt, ge, lt "
+                "or le: %s", rule->op);
+    }
 
-        /* calculate the CDEF summary line */
-        cdef = apr_palloc(r->pool, len + 1);
-        APR_ARRAY_PUSH(args, const char *) = cdef;
-        cdef += apr_snprintf(cdef, len, "CDEF:%s=", cmd->d.vname);
-        for (j = 0; j < cmd->d.requests->nelts; ++j) {
-            cdef += apr_snprintf(cdef, len, "%s%sw%d%s", j ? "," : "", cmd->d.vname, j, j ? ",+" : "");
-        }
+    rule->threshold = strtod(threshold, &end);
+    if (*end || end == threshold) {
+        return apr_psprintf(r->pool, "Threshold is not a number: %s",
+                threshold);
+    }
 
+    /* the window reaches back from now, in seconds or rrdtool units */
+    instance = instance_acquire(NULL);
+    if ((err = instance->parsetime(apr_pstrcat(r->pool, "end-", rule->window,
+            NULL), &start_tv)) || (err = instance->parsetime("now", &end_tv))) {
+        msg = apr_psprintf(r->pool, "Window could not be parsed: %s: %s",
+                rule->window, err);
+    }
+    else if (instance->proc_start_end(&start_tv, &end_tv, &rule->start,
+            &rule->end) == -1) {
+        msg = apr_psprintf(r->pool, "Window could not be resolved: %s: %s",
+                rule->window, instance->get_error());
+        instance->clear_error();
     }
+    instance_release(instance);
 
-    return OK;
+    return msg;
 }
 
-static int generate_args(request_rec *r, rrd_cmds_t *cmds, apr_array_header_t **pargs)
+static int post_rrdcheck(request_rec *r)
 {
-    apr_array_header_t *args;
-    rrd_cmd_t *cmd;
-    rrd_opt_t *opt;
-    const char *format;
-    int i, num = 4, ret = OK;
+    apr_bucket_brigade *bb = apr_brigade_create(r->pool,
+            r->connection->bucket_alloc);
+    apr_array_header_t *rules;
+    rrd_cmds_t *cmds;
+    char *body, *line, *last;
+    int i, j, counts[3] = { 0, 0, 0 };
+    static const char *states[] = { "ok", "critical", "unknown" };
 
-    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
-            &rrd_module);
+    int ret;
 
-    /* count the options */
-    for (i = 0; i < cmds->opts->nelts; ++i) {
+    ret = read_body(r, &body, RRD_CHECK_BODY);
+    if (OK != ret) {
+        return ret;
+    }
 
-        opt = &((rrd_opt_t *)cmds->opts->elts)[i];
+    /* one rule per line, blank lines and comments ignored */
+    rules = apr_array_make(r->pool, 16, sizeof(rrd_threshold_t));
+    for (line = apr_strtok(body, "\r\n", &last); line;
+            line = apr_strtok(NULL, "\r\n", &last)) {
+        rrd_threshold_t *rule;
 
-        if (opt->val) {
-            num++;
+        while (*line == ' ' || *line == '\t') {
+            ++line;
+        }
+        if (!*line || *line == '#') {
+            continue;
         }
 
-        num++;
+        rule = apr_array_push(rules);
+        rule->line = line;
     }
-    /* count the number of elements we need */
-    for (i = 0; i < cmds->cmds->nelts; ++i) {
 
-        cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
-
-        if (cmd->def) {
-            num += cmd->def->d.requests->nelts;
+    cmds = apr_pcalloc(r->pool, sizeof(rrd_cmds_t));
+    cmds->names = apr_hash_make(r->pool);
+    cmds->defs = apr_hash_make(r->pool);
+    cmds->params = apr_table_make(r->pool, 1);
+    cmds->opts = apr_array_make(r->pool, 1, sizeof(rrd_opt_t));
+    cmds->cmds = apr_array_make(r->pool, rules->nelts, sizeof(rrd_cmd_t));
+
+    /* every rule is a DEF, so that wildcards and access work the same */
+    for (i = 0; i < rules->nelts; ++i) {
+        apr_array_push(cmds->cmds);
+    }
+    for (i = 0; i < rules->nelts; ++i) {
+        rrd_threshold_t *rule = &APR_ARRAY_IDX(rules, i, rrd_threshold_t);
+
+        rule->cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+        rule->err = check_parse(r, rule, rule->cmd, i);
+        if (!rule->err && OK != resolve_def(r, rule->cmd, cmds)) {
+            rule->err = apr_psprintf(r->pool, "Path could not be matched: %s",
+                    rule->path);
+        }
+        if (!rule->cmd->d.requests) {
+            rule->cmd->d.requests = apr_array_make(r->pool, 1,
+                    sizeof(request_rec *));
         }
-
-        num++;
     }
 
-    /* work out the format */
-    format = conf->format ? conf->format : parse_rrdgraph_suffix(r);
-
-    /* set the content type */
-    ap_set_content_type(r, lookup_content_type(format));
-
-    /* create arguments of the correct size */
-    args = *pargs = apr_array_make(r->pool, num, sizeof(const char *));
+    /* one check per matching file, each cheap enough to run in turn */
+    for (i = 0; i < rules->nelts; ++i) {
+        rrd_threshold_t *rule = &APR_ARRAY_IDX(rules, i, rrd_threshold_t);
+        apr_array_header_t *requests = rule->cmd->d.requests;
+
+        rule->checks = apr_pcalloc(r->pool,
+                requests->nelts * sizeof(rrd_check_t));
+        for (j = 0; !rule->err && j < requests->nelts; ++j) {
+            rrd_check_t *check = &rule->checks[j];
+
+            check->filename = APR_ARRAY_IDX(requests, j, request_rec *)->filename;
+            check->source = cold_source(r,
+                    APR_ARRAY_IDX(requests, j, request_rec *));
+            check->dsname = rule->cmd->d.dsname;
+            check->cf = rule->cmd->d.cf;
+            check->start = rule->start;
+            check->end = rule->end;
+            check->value = NAN;
+
+            check_evaluate(r->pool, check);
+        }
+    }
 
-    /* the argv array */
-    APR_ARRAY_PUSH(args, const char *) = "rrdgraph";
-    APR_ARRAY_PUSH(args, const char *) = "-";
-    APR_ARRAY_PUSH(args, const char *) = "--imgformat";
-    APR_ARRAY_PUSH(args, const char *) = format;
+    apr_brigade_puts(bb, NULL, NULL, "{\"rules\":[");
+    for (i = 0; i < rules->nelts; ++i) {
+        rrd_threshold_t *rule = &APR_ARRAY_IDX(rules, i, rrd_threshold_t);
+        apr_array_header_t *requests = rule->cmd->d.requests;
+        int state = 2, known = 0;
+
+        for (j = 0; !rule->err && j < requests->nelts; ++j) {
+            if (!isnan(rule->checks[j].value)) {
+                known++;
+                if (check_breach(rule, rule->checks[j].value)) {
+                    state = 1;
+                }
+            }
+        }
+        if (known && state != 1) {
+            state = 0;
+        }
+        counts[state]++;
+
+        apr_brigade_printf(bb, NULL, NULL,
+                "%s{\"rule\":\"%s\",\"status\":\"%s\"", i ? "," : "",
+                pescape_json(r->pool, rule->line), states[state]);
+        if (rule->err) {
+            apr_brigade_printf(bb, NULL, NULL, ",\"error\":\"%s\"",
+                    pescape_json(r->pool, rule->err));
+        }
+        apr_brigade_puts(bb, NULL, NULL, ",\"files\":[");
+        for (j = 0; !rule->err && j < requests->nelts; ++j) {
+            rrd_check_t *check = &rule->checks[j];
+
+            apr_brigade_printf(bb, NULL, NULL,
+                    "%s{\"path\":\"%s\",\"value\":%s,\"status\":\"%s\"",
+                    j ? "," : "",
+                    pescape_json(r->pool, relative_path(r, check->filename)),
+                    pjson_number(r->pool, check->value),
+                    states[isnan(check->value) ? 2 :
+                            check_breach(rule, check->value) ? 1 : 0]);
+            if (check->err) {
+                apr_brigade_printf(bb, NULL, NULL, ",\"error\":\"%s\"",
+                        pescape_json(r->pool, check->err));
+            }
+            apr_brigade_puts(bb, NULL, NULL, "}");
+        }
+        apr_brigade_puts(bb, NULL, NULL, "]}");
+    }
+    apr_brigade_printf(bb, NULL, NULL,
+            "],\"ok\":%d,\"critical\":%d,\"unknown\":%d}\n",
+            counts[0], counts[1], counts[2]);
 
-    /* first create the options */
-    for (i = 0; i < cmds->opts->nelts; ++i) {
+    /* trigger an early cleanup to save memory */
+    cleanup_args(r, cmds);
 
-        opt = &((rrd_opt_t *)cmds->opts->elts)[i];
+    ap_set_content_type(r, "application/json");
 
-        APR_ARRAY_PUSH(args, const char *) =
-                apr_pstrcat(r->pool, "--", opt->key, NULL);
-        if (opt->eval) {
-            const char *err = NULL;
+    /* send our response down the stack */
+    return pass_brigade(r, bb);
+}
 
-            APR_ARRAY_PUSH(args, const char *) = ap_expr_str_exec(r, opt->eval, &err);
-            if (err) {
-                log_message(r, APR_SUCCESS,
-                    apr_psprintf(r->pool,
-                            "While evaluating expressions for '%s': %s", opt->key, err), NULL);
-                return HTTP_INTERNAL_SERVER_ERROR;
+static int get_rrd(request_rec *r)
+{
+    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
+            &rrd_module);
+    /*
+     * if a file does not exist, assume it is a request for a graph, otherwise
+     * go with the original file.
+     */
+    if ((conf->format) ||
+    		(r->filename && r->finfo.filetype == APR_NOFILE && parse_rrdgraph_suffix(r))) {
+        switch (parse_rrdgraph_mode(r)) {
+        case RRD_MODE_HEATMAP:
+            return get_rrdheatmap(r);
+        case RRD_MODE_ATLAS:
+            return get_rrdatlas(r);
+        case RRD_MODE_INDEX:
+            return get_rrdindex(r);
+        case RRD_MODE_EXPLAIN:
+            /* the plan shows the paths behind each DEF, only if asked */
+            if (!conf->explain) {
+                return HTTP_NOT_FOUND;
             }
-
-        }
-        else if (opt->val) {
-            APR_ARRAY_PUSH(args, const char *) = opt->val;
+            return get_rrdexplain(r);
+        case RRD_MODE_CHECK:
+            return HTTP_METHOD_NOT_ALLOWED;
+        default:
+            return get_rrdgraph(r);
         }
+    }
 
+    return DECLINED;
+}
+
+static int post_rrd(request_rec *r)
+{
+    /* only checks take a body, and never for an existing file */
+    if (r->filename && r->finfo.filetype == APR_NOFILE
+            && RRD_MODE_CHECK == parse_rrdgraph_mode(r)) {
+        return post_rrdcheck(r);
     }
 
-    /* and finally create the elements */
-    for (i = 0; i < cmds->cmds->nelts; ++i) {
+    return HTTP_METHOD_NOT_ALLOWED;
+}
 
-        cmd = &((rrd_cmd_t *)cmds->cmds->elts)[i];
+static int rrd_fixups(request_rec *r)
+{
+    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
+            &rrd_module);
 
-        switch (cmd->type) {
-        case RRD_CONF_DEF:
+    if (!conf) {
+        return DECLINED;
+    }
 
-            ret = generate_def(r, cmd, args);
+    if (conf->graph) {
+    	r->handler = "rrdgraph";
+    	return OK;
+    }
 
-            break;
-        case RRD_CONF_CDEF:
+    return DECLINED;
+}
 
-            ret = generate_cdef(r, cmd, args);
+static int rrd_handler(request_rec *r)
+{
 
-            break;
-        case RRD_CONF_VDEF:
+    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
+            &rrd_module);
 
-            ret = generate_vdef(r, cmd, args);
+    if (!conf || !conf->graph) {
+        return DECLINED;
+    }
 
-            break;
-        case RRD_CONF_LINE:
+    /* A GET should return the CRL, OPTIONS should return the WADL */
+    ap_allow_methods(r, 1, "GET", "POST", "OPTIONS", NULL);
+    if (!strcmp(r->method, "GET")) {
+        return get_rrd(r);
+    }
+    else if (!strcmp(r->method, "POST")) {
+        return post_rrd(r);
+    }
+    else if (!strcmp(r->method, "OPTIONS")) {
+        return options_wadl(r, conf);
+    }
+    else {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
 
-            ret = generate_line(r, cmd, cmds, args, &i);
+}
 
-            break;
-        case RRD_CONF_AREA:
+static int rrd_status_handler(request_rec *r)
+{
+    rrd_hitter_t *hitters;
+    int i, count;
 
-            ret = generate_area(r, cmd, cmds, args, &i);
+    if (strcmp(r->handler, "rrd-status")) {
+        return DECLINED;
+    }
 
-            break;
-        case RRD_CONF_TICK:
+    ap_allow_methods(r, 1, "GET", NULL);
+    if (strcmp(r->method, "GET")) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
 
-            ret = generate_tick(r, cmd, cmds, args, &i);
+    hitters = sketch_snapshot(r->pool, &count);
 
-            break;
-        case RRD_CONF_SHIFT:
+    ap_set_content_type(r, "application/json");
 
-            ret = generate_shift(r, cmd, args);
+    ap_rprintf(r, "{\"slots\":%d,\"queue\":%u,\"wait\":%u,\"specs\":[",
+            rrd_sketch_count, apr_atomic_read32(&rrd_render_queue),
+            apr_atomic_read32(&rrd_render_wait));
+    for (i = 0; i < count; ++i) {
+        rrd_hitter_t *hitter = &hitters[i];
 
-            break;
-        case RRD_CONF_PRINT:
+        ap_rprintf(r, "%s{\"spec\":\"%s\",\"weight\":%" APR_UINT64_T_FMT
+                ",\"error\":%" APR_UINT64_T_FMT ",\"busy\":%" APR_UINT64_T_FMT
+                ",\"hits\":%" APR_UINT64_T_FMT ",\"cached\":%" APR_UINT64_T_FMT
+                ",\"average\":%" APR_UINT64_T_FMT ",\"fanout\":%s}",
+                i ? "," : "", pescape_json(r->pool, hitter->spec),
+                hitter->weight, hitter->error, hitter->busy, hitter->hits,
+                hitter->cached, hitter->busy / hitter->hits,
+                pjson_number(r->pool, (double) hitter->files / hitter->hits));
+    }
+    ap_rputs("]}\n", r);
 
-            ret = generate_print(r, cmd, args);
+    return OK;
+}
 
-            break;
-        case RRD_CONF_GPRINT:
+static int rrd_status_hook(request_rec *r, int flags)
+{
+    rrd_hitter_t *hitters;
+    int i, count;
+
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "RRDRenderQueue: %u\nRRDRenderWait: %u\n",
+                apr_atomic_read32(&rrd_render_queue),
+                apr_atomic_read32(&rrd_render_wait));
+        return OK;
+    }
 
-            ret = generate_gprint(r, cmd, args);
+    hitters = sketch_snapshot(r->pool, &count);
+    if (!hitters) {
+        return OK;
+    }
 
-            break;
-        case RRD_CONF_HRULE:
+    ap_rputs("<hr />\n<h2>mod_rrd heaviest graphs</h2>\n"
+            "<table border=\"0\"><tr><th>Weight (ms)</th><th>Error (ms)</th>"
+            "<th>Busy (ms)</th><th>Hits</th><th>Cached</th>"
+            "<th>Average (ms)</th><th>Fan out</th><th>Graph</th></tr>\n", r);
+    for (i = 0; i < count; ++i) {
+        rrd_hitter_t *hitter = &hitters[i];
+
+        ap_rprintf(r, "<tr><td>%" APR_UINT64_T_FMT "</td><td>%"
+                APR_UINT64_T_FMT "</td><td>%" APR_UINT64_T_FMT "</td><td>%"
+                APR_UINT64_T_FMT "</td><td>%" APR_UINT64_T_FMT "</td><td>%"
+                APR_UINT64_T_FMT "</td><td>%.1f</td><td>%s</td></tr>\n",
+                hitter->weight / 1000, hitter->error / 1000,
+                hitter->busy / 1000, hitter->hits, hitter->cached,
+                hitter->busy / hitter->hits / 1000,
+                (double) hitter->files / hitter->hits,
+                ap_escape_html(r->pool, hitter->spec));
+    }
+    ap_rputs("</table>\n", r);
 
-            ret = generate_hrule(r, cmd, args);
+    return OK;
+}
 
-            break;
-        case RRD_CONF_VRULE:
+static int rrd_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptemp)
+{
+    ap_mutex_register(pconf, RRD_SKETCH_MUTEX, NULL, APR_LOCK_DEFAULT, 0);
 
-            ret = generate_vrule(r, cmd, args);
+    return OK;
+}
 
-            break;
-        case RRD_CONF_COMMENT:
-        case RRD_CONF_TEXTALIGN:
+static int rrd_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptemp, server_rec *s)
+{
+    rrd_server_conf *sconf = ap_get_module_config(s->module_config,
+            &rrd_module);
+    apr_shm_t *shm;
+    apr_status_t rv;
+    int buckets, i;
+
+    /* the graph caches are trimmed on what all children have written */
+    rv = apr_shm_create(&shm, sizeof(apr_uint32_t), NULL, pconf);
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "mod_rrd: Could not create the shared memory for RRDGraphCache");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    rrd_cache_written = apr_shm_baseaddr_get(shm);
+    *rrd_cache_written = 0;
+
+#if APR_HAS_FORK
+    /* one process keeps the sidecar indexes up to date, not every child */
+    if (sconf && sconf->indexes->nelts
+            && ap_state_query(AP_SQ_MAIN_STATE) != AP_SQ_MS_CREATE_PRE_CONFIG) {
+        rrd_indexer_t *ctx = apr_pcalloc(pconf, sizeof(rrd_indexer_t));
+
+        ctx->s = s;
+        ctx->pool = pconf;
+        ctx->indexes = apr_array_copy(pconf, sconf->indexes);
+        index_start(ctx);
+    }
+#endif
 
-            ret = generate_element(r, cmd, args);
+    /* forget the sketch of any previous generation */
+    rrd_sketch = NULL;
+    rrd_sketch_count = 0;
+    rrd_sketch_heap = NULL;
+    rrd_sketch_index = NULL;
+    rrd_sketch_buckets = 0;
+    rrd_sketch_mutex = NULL;
 
-            break;
-        }
+    if (!sconf || !sconf->sketch) {
+        return OK;
+    }
 
-        if (OK != ret) {
-            return ret;
-        }
+    /* the slots, their heap, and an index at most half full */
+    for (buckets = 1; buckets < 2 * sconf->sketch; buckets <<= 1);
 
+    rv = apr_shm_create(&shm, sconf->sketch * sizeof(rrd_hitter_t)
+            + (sconf->sketch + buckets) * sizeof(int), NULL, pconf);
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "mod_rrd: Could not create the shared memory for RRDGraphSketch");
+        return HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    for (i = 0; i < args->nelts; ++i) {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r, "mod_rrd: rrdgraph:%d: %s",
-                i, ((const char **) args->elts)[i]);
+    rv = ap_global_mutex_create(&rrd_sketch_mutex, NULL, RRD_SKETCH_MUTEX,
+            NULL, s, pconf, 0);
+    if (APR_SUCCESS != rv) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rrd_sketch = apr_shm_baseaddr_get(shm);
+    rrd_sketch_count = sconf->sketch;
+    rrd_sketch_heap = (int *)(rrd_sketch + sconf->sketch);
+    rrd_sketch_index = rrd_sketch_heap + sconf->sketch;
+    rrd_sketch_buckets = buckets;
+    memset(rrd_sketch, 0, sconf->sketch * sizeof(rrd_hitter_t)
+            + (sconf->sketch + buckets) * sizeof(int));
+
+    /* every slot starts empty and as light as any other */
+    for (i = 0; i < sconf->sketch; ++i) {
+        rrd_sketch_heap[i] = i;
+        rrd_sketch[i].heap = i;
     }
 
     return OK;
 }
 
-static int cleanup_args(request_rec *r, rrd_cmds_t *cmds)
+#if HAVE_DLMOPEN && APR_HAS_THREADS
+static apr_status_t instance_load(apr_pool_t *p, server_rec *s,
+        const char *library, rrd_instance_t *instance)
 {
-    rrd_cmd_t *cmd;
-    int i;
+#if HAVE_RRD_FETCH_CB_REGISTER
+    int (*fetch_cb_register)(rrd_fetch_cb_t);
+#endif
+    void *handle, *libc;
+    Lmid_t lmid;
+    apr_status_t rv;
 
-    for (i = 0; i < cmds->cmds->nelts; ++i) {
-        request_rec **rr;
+    /* a new link namespace gives this copy its own global state */
+    handle = dlmopen(LM_ID_NEWLM, library, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, APR_SUCCESS, s,
+                "mod_rrd: Could not load '%s' into a new namespace: %s",
+                library, dlerror());
+        return APR_EGENERAL;
+    }
 
-        cmd = &APR_ARRAY_IDX(cmds->cmds, i, rrd_cmd_t);
+    *(void **)(&instance->graph_v) = dlsym(handle, "rrd_graph_v");
+    *(void **)(&instance->info_r) = dlsym(handle, "rrd_info_r");
+    *(void **)(&instance->info_free) = dlsym(handle, "rrd_info_free");
+    *(void **)(&instance->get_error) = dlsym(handle, "rrd_get_error");
+    *(void **)(&instance->clear_error) = dlsym(handle, "rrd_clear_error");
+    *(void **)(&instance->set_error) = dlsym(handle, "rrd_set_error");
+    *(void **)(&instance->fetch_r) = dlsym(handle, "rrd_fetch_r");
+    *(void **)(&instance->parsetime) = dlsym(handle, "rrd_parsetime");
+    *(void **)(&instance->proc_start_end) = dlsym(handle,
+            "rrd_proc_start_end");
+    *(void **)(&instance->freemem) = dlsym(handle, "rrd_freemem");
+
+    /* memory this copy frees comes from the libc of its own namespace */
+    if (dlinfo(handle, RTLD_DI_LMID, &lmid) == 0
+            && (libc = dlmopen(lmid, LIBC_SO, RTLD_NOW | RTLD_NOLOAD))) {
+        *(void **)(&instance->malloc) = dlsym(libc, "malloc");
+        *(void **)(&instance->free) = dlsym(libc, "free");
+        dlclose(libc);
+    }
+#if HAVE_RRD_FETCH_CB_REGISTER
+    *(void **)(&fetch_cb_register) = dlsym(handle, "rrd_fetch_cb_register");
+#endif
 
-        /* free all the saved requests */
-        if (RRD_CONF_DEF == cmd->type && cmd->d.requests) {
-            while ((rr = apr_array_pop(cmd->d.requests))) {
-                apr_pool_destroy((*rr)->pool);
-            }
-        }
+    if (!instance->graph_v || !instance->info_r || !instance->info_free
+            || !instance->get_error
+            || !instance->clear_error || !instance->set_error
+            || !instance->fetch_r || !instance->parsetime
+            || !instance->proc_start_end || !instance->freemem
+            || !instance->malloc || !instance->free
+#if HAVE_RRD_FETCH_CB_REGISTER
+            || !fetch_cb_register
+#endif
+            ) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, APR_SUCCESS, s,
+                "mod_rrd: '%s' is not a usable copy of librrd", library);
+        dlclose(handle);
+        return APR_EGENERAL;
+    }
 
+    rv = apr_thread_mutex_create(&instance->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "mod_rrd: Could not create the lock for '%s'", library);
+        dlclose(handle);
+        return rv;
     }
 
-    return OK;
+#if HAVE_RRD_FETCH_CB_REGISTER
+    fetch_cb_register(distribution_cb);
+#endif
+
+    /*
+     * The copy stays loaded until the child exits, unloading namespaces
+     * holding font and graphics libraries is not reliable.
+     */
+    return APR_SUCCESS;
 }
+#endif
 
-static int get_rrdgraph(request_rec *r)
+static void rrd_child_init(apr_pool_t *pchild, server_rec *s)
 {
-    rrd_info_t *grinfo = NULL;
-    apr_array_header_t *args;
-    apr_bucket_brigade *bb = apr_brigade_create(r->pool,
-            r->connection->bucket_alloc);
-    rrd_cmds_t *cmds;
-
-    apr_status_t rv;
-    int ret;
-
-    /* pull apart the query string, reject unrecognised options */
-    ret = parse_query(r, &cmds);
-    if (OK != ret) {
-        return ret;
-    }
+    rrd_server_conf *sconf = ap_get_module_config(s->module_config,
+            &rrd_module);
+    rrd_instance_t *instance;
+    int instances = sconf && sconf->instances > 1 ? sconf->instances : 1;
+#if APR_HAS_THREADS
+    int threaded_mpm = 0;
+#endif
 
-    /* resolve permissions and wildcards of rrd files */
-    ret = resolve_rrds(r, cmds);
-    if (OK != ret) {
-        return ret;
+    /* reattach to the lock of the shared sketch */
+    if (rrd_sketch_mutex && apr_global_mutex_child_init(&rrd_sketch_mutex,
+            apr_global_mutex_lockfile(rrd_sketch_mutex), pchild) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, APR_SUCCESS, s,
+                "mod_rrd: Could not reattach to the sketch lock, not recording");
+        rrd_sketch = NULL;
     }
 
-    /* create the args string for rrd_graph */
-    ret = generate_args(r, cmds, &args);
-    if (OK != ret) {
-        return ret;
-    }
+    /* the linked copy of librrd is always available */
+    instance = instance_linked(pchild, instances);
 
-    /* rrd_graph_v is not thread safe */
-#if APR_HAS_THREADS
-    if (rrd_mutex) {
-        apr_thread_mutex_lock(rrd_mutex);
-    }
+#if HAVE_RRD_FETCH_CB_REGISTER
+    rrd_fetch_cb_register(distribution_cb);
 #endif
 
-    /* we're ready, let's generate the graph */
-    grinfo = rrd_graph_v(args->nelts, (char **)args->elts);
-    if (grinfo == NULL) {
-        log_message(r, APR_SUCCESS, "Call to rrd_graph_v failed", rrd_get_error());
-        ret = HTTP_INTERNAL_SERVER_ERROR;
-    }
-    else {
-        /* grab the image data from the results */
-        while (grinfo) {
-            if (strcmp(grinfo->key, "image") == 0) {
-                apr_brigade_write(bb, NULL, NULL, (const char *)grinfo->value.u_blo.ptr,
-                        grinfo->value.u_blo.size);
-                ap_set_content_length(r, grinfo->value.u_blo.size);
-                break;
-            }
-            /* skip anything else */
-            grinfo = grinfo->next;
+#if HAVE_ZSTD
+    /* pins outlive any one request, and have an allocator of their own */
+    {
+        rrd_cold_pool = allocator_pool(pchild);
+        if (!rrd_cold_pool) {
+            apr_pool_create(&rrd_cold_pool, pchild);
         }
-        rrd_info_free(grinfo);
-    }
-    rrd_clear_error();
-
+        rrd_cold_pins = apr_hash_make(rrd_cold_pool);
 #if APR_HAS_THREADS
-    if (rrd_mutex) {
-        apr_thread_mutex_unlock(rrd_mutex);
+        apr_thread_mutex_create(&rrd_cold_mutex, APR_THREAD_MUTEX_DEFAULT,
+                pchild);
+#endif
     }
 #endif
 
-    /* trigger an early cleanup to save memory */
-    ret = cleanup_args(r, cmds);
-    if (OK != ret) {
-        return ret;
+#if APR_HAS_THREADS
+    if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded_mpm) == APR_SUCCESS
+        && threaded_mpm)
+    {
+        apr_thread_mutex_create(&instance->mutex, APR_THREAD_MUTEX_DEFAULT, pchild);
+#if HAVE_RRD_FETCH_CB_REGISTER
+        apr_threadkey_private_create(&rrd_fetch_key, NULL, pchild);
+#endif
+        if (apr_thread_pool_create(&rrd_workers, 0, RRD_WORKERS, pchild)
+                != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, APR_SUCCESS, s,
+                    "mod_rrd: Could not create the worker threads, "
+                    "checking in the request thread");
+            rrd_workers = NULL;
+        }
     }
+#endif
 
-    /* send our response down the stack */
-    if (OK == ret) {
-        rv = ap_pass_brigade(r->output_filters, bb);
-        if (rv == APR_SUCCESS || r->status != HTTP_OK
-                || r->connection->aborted) {
-            return OK;
+    if (instances > 1) {
+#if HAVE_DLMOPEN && APR_HAS_THREADS
+        if (!threaded_mpm) {
+            ap_log_error(APLOG_MARK, APLOG_INFO, APR_SUCCESS, s,
+                    "mod_rrd: RRDGraphInstances ignored, the MPM is not threaded");
         }
-        else {
-            /* no way to know what type of error occurred */
-            ap_log_rerror(
-                    APLOG_MARK, APLOG_DEBUG, rv, r, "rrd_handler: ap_pass_brigade returned %i", rv);
-            return HTTP_INTERNAL_SERVER_ERROR;
+        /* further copies of librrd render in parallel to the first */
+        while (threaded_mpm && rrd_instance_count < instances
+                && instance_load(pchild, s, sconf->library,
+                        &rrd_instances[rrd_instance_count]) == APR_SUCCESS) {
+            rrd_instance_count++;
         }
+        if (threaded_mpm && rrd_instance_count < instances) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, s,
+                    "mod_rrd: Only %d of %d copies of librrd could be loaded, "
+                    "rendering with those", rrd_instance_count, instances);
+        }
+#else
+        ap_log_error(APLOG_MARK, APLOG_INFO, APR_SUCCESS, s,
+                "mod_rrd: RRDGraphInstances ignored, dlmopen() is not available");
+#endif
     }
-
-    return ret;
 }
 
-static int get_rrd(request_rec *r)
+static APR_OPTIONAL_FN_TYPE(ap_proxy_retry_worker) *ap_proxy_retry_worker_fn = NULL;
+
+static apr_uint64_t lbmethod_hash(apr_uint64_t hash, const char *str)
 {
-    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
-            &rrd_module);
-    /*
-     * if a file does not exist, assume it is a request for a graph, otherwise
-     * go with the original file.
-     */
-    if ((conf->format) ||
-    		(r->filename && r->finfo.filetype == APR_NOFILE && parse_rrdgraph_suffix(r))) {
-        return get_rrdgraph(r);
+    /* FNV-1a, the same as the sketch */
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * APR_UINT64_C(1099511628211);
     }
-
-    return DECLINED;
+    return hash;
 }
 
-static int rrd_fixups(request_rec *r)
+/*
+ * The key of a graph request is its directory and the path of each DEF,
+ * so that graphs of the same files go to the same backend. The DEFs are
+ * picked out of the raw query without parsing it, so that a query the
+ * backend will reject is still keyed by its files. A path runs from the
+ * '=' to the first ':' not escaped with a backslash.
+ */
+static apr_uint64_t lbmethod_key(request_rec *r)
 {
-    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
-            &rrd_module);
+    apr_uint64_t hash = APR_UINT64_C(14695981039346656037);
+    const char *last = strrchr(r->uri, '/');
+    const char *element, *path, *end;
+    char *args, *arg;
 
-    if (!conf) {
-        return DECLINED;
+    hash = lbmethod_hash(hash, last ?
+            apr_pstrmemdup(r->pool, r->uri, last - r->uri) : r->uri);
+
+    if (!r->args) {
+        return hash;
     }
 
-    if (conf->graph) {
-    	r->handler = "rrdgraph";
-    	return OK;
+    args = apr_pstrdup(r->pool, r->args);
+    while ((arg = apr_cstr_tokenize("&", &args))) {
+        element = apr_punescape_url(r->pool, arg, NULL, NULL, 0);
+        if (!element) {
+            element = arg;
+        }
+        if (strncmp(element, "DEF:", 4) || !(path = strchr(element, '='))) {
+            continue;
+        }
+
+        for (end = ++path; *end && *end != ':'; ++end) {
+            if (*end == '\\' && end[1]) {
+                ++end;
+            }
+        }
+
+        hash = lbmethod_hash(hash, "\n");
+        hash = lbmethod_hash(hash, apr_pstrmemdup(r->pool, path, end - path));
     }
 
-    return DECLINED;
+    return hash;
 }
 
-static int rrd_handler(request_rec *r)
+static double lbmethod_score(apr_uint64_t key, proxy_worker *worker)
 {
+    apr_uint64_t hash = lbmethod_hash(key ^ APR_UINT64_C(0x9e3779b97f4a7c15),
+            worker->s->name);
+    double u;
+
+    /* mix the bits, then a weighted rendezvous score from (0, 1) */
+    hash ^= hash >> 33;
+    hash *= APR_UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+    hash *= APR_UINT64_C(0xc4ceb9fe1a85ec53);
+    hash ^= hash >> 33;
+    u = ((hash >> 11) + 0.5) / (double)(APR_UINT64_C(1) << 53);
+
+    return (worker->s->lbfactor > 0 ? worker->s->lbfactor : 1) / -log(u);
+}
 
-    rrd_conf *conf = ap_get_module_config(r->per_dir_config,
-            &rrd_module);
-
-    if (!conf || !conf->graph) {
-        return DECLINED;
+/*
+ * Rendezvous hashing: every usable worker scores the key, and the highest
+ * score wins. Adding or losing a backend only moves the graphs that
+ * backend wins or held, so each backend keeps a stable share of the RRD
+ * files in its page cache and graph cache.
+ */
+static proxy_worker *find_best_rrd(proxy_balancer *balancer, request_rec *r)
+{
+    proxy_worker **workers = (proxy_worker **)balancer->workers->elts;
+    proxy_worker *best = NULL;
+    apr_uint64_t key;
+    double score = 0;
+    int i, lbset, max_lbset = 0, standby;
+
+    if (!ap_proxy_retry_worker_fn) {
+        ap_proxy_retry_worker_fn =
+                APR_RETRIEVE_OPTIONAL_FN(ap_proxy_retry_worker);
+        if (!ap_proxy_retry_worker_fn) {
+            /* can only happen if mod_proxy isn't loaded */
+            return NULL;
+        }
     }
 
-    /* A GET should return the CRL, OPTIONS should return the WADL */
-    ap_allow_methods(r, 1, "GET", "OPTIONS", NULL);
-    if (!strcmp(r->method, "GET")) {
-        return get_rrd(r);
+    key = lbmethod_key(r);
+
+    for (i = 0; i < balancer->workers->nelts; ++i) {
+        if (workers[i]->s->lbset > max_lbset) {
+            max_lbset = workers[i]->s->lbset;
+        }
     }
-    else if (!strcmp(r->method, "OPTIONS")) {
-        return options_wadl(r, conf);
+
+    /* the lowest lbset with a usable worker, hot standbys last */
+    for (standby = 0; !best && standby < 2; ++standby) {
+        for (lbset = 0; !best && lbset <= max_lbset; ++lbset) {
+            for (i = 0; i < balancer->workers->nelts; ++i) {
+                proxy_worker *worker = workers[i];
+                double s;
+
+                if (worker->s->lbset != lbset
+                        || !PROXY_WORKER_IS_STANDBY(worker) != !standby) {
+                    continue;
+                }
+                if (!PROXY_WORKER_IS_USABLE(worker)) {
+                    ap_proxy_retry_worker_fn("BALANCER", worker, r->server);
+                }
+                if (!PROXY_WORKER_IS_USABLE(worker)) {
+                    continue;
+                }
+
+                s = lbmethod_score(key, worker);
+                if (!best || s > score) {
+                    best = worker;
+                    score = s;
+                }
+            }
+        }
     }
-    else {
-        return HTTP_METHOD_NOT_ALLOWED;
+
+    if (best) {
+        best->s->elected++;
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                "mod_rrd: Balancing graph to '%s'", best->s->name);
     }
 
+    return best;
 }
 
-static void rrd_child_init(apr_pool_t *pchild, server_rec *s)
+static apr_status_t reset_rrd(proxy_balancer *balancer, server_rec *s)
 {
-#if APR_HAS_THREADS
-    int threaded_mpm;
-    if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded_mpm) == APR_SUCCESS
-        && threaded_mpm)
-    {
-        apr_thread_mutex_create(&rrd_mutex, APR_THREAD_MUTEX_DEFAULT, pchild);
-    }
-#endif
+    return APR_SUCCESS;
+}
+
+static apr_status_t age_rrd(proxy_balancer *balancer, server_rec *s)
+{
+    return APR_SUCCESS;
 }
 
+static const proxy_balancer_method rrd_lbmethod =
+{
+    "rrd",
+    &find_best_rrd,
+    NULL,
+    &reset_rrd,
+    &age_rrd
+};
+
 static void *create_rrd_config(apr_pool_t *p, char *dummy)
 {
     rrd_conf *new = (rrd_conf *) apr_pcalloc(p, sizeof(rrd_conf));
@@ -2614,11 +8621,37 @@ static void *create_rrd_config(apr_pool_t *p, char *dummy)
     return (void *) new;
 }
 
+static void *create_rrd_server_config(apr_pool_t *p, server_rec *s)
+{
+    rrd_server_conf *new = (rrd_server_conf *) apr_pcalloc(p, sizeof(rrd_server_conf));
+
+    new->indexes = apr_array_make(p, 2, sizeof(rrd_index_t));
+
+    return (void *) new;
+}
+
+static void *merge_rrd_server_config(apr_pool_t *p, void *basev, void *addv)
+{
+    rrd_server_conf *new = (rrd_server_conf *) apr_pcalloc(p, sizeof(rrd_server_conf));
+    rrd_server_conf *add = (rrd_server_conf *) addv;
+    rrd_server_conf *base = (rrd_server_conf *) basev;
+
+    new->indexes = apr_array_append(p, add->indexes, base->indexes);
+    new->instances = add->instances ? add->instances : base->instances;
+    new->sketch = add->sketch ? add->sketch : base->sketch;
+    new->library = add->library ? add->library : base->library;
+    new->cold = add->cold ? add->cold : base->cold;
+    new->cold_size = add->cold ? add->cold_size : base->cold_size;
+
+    return new;
+}
+
 static void *merge_rrd_config(apr_pool_t *p, void *basev, void *addv)
 {
     rrd_conf *new = (rrd_conf *) apr_pcalloc(p, sizeof(rrd_conf));
     rrd_conf *add = (rrd_conf *) addv;
     rrd_conf *base = (rrd_conf *) basev;
+    int i;
 
     new->options = apr_array_append(p, add->options, base->options);
     new->elements = apr_array_append(p, add->elements, base->elements);
@@ -2630,6 +8663,26 @@ static void *merge_rrd_config(apr_pool_t *p, void *basev, void *addv)
     new->format = (add->format_set == 0) ? base->format : add->format;
     new->format_set = add->format_set || base->format_set;
 
+    new->partition = (add->partition_set == 0) ? base->partition : add->partition;
+    new->partition_set = add->partition_set || base->partition_set;
+
+    new->cache = (add->cache_set == 0) ? base->cache : add->cache;
+    new->cache_maxage = (add->cache_set == 0) ? base->cache_maxage : add->cache_maxage;
+    new->cache_size = (add->cache_set == 0) ? base->cache_size : add->cache_size;
+    new->cache_set = add->cache_set || base->cache_set;
+
+    for (i = 0; i < RRD_TIER_COUNT; ++i) {
+        new->degrade[i] = (add->degrade[i].set == 0) ? base->degrade[i] : add->degrade[i];
+    }
+
+    new->fanout = (add->fanout_set == 0) ? base->fanout : add->fanout;
+    new->fanout_set = add->fanout_set || base->fanout_set;
+
+    new->prefetch = (add->prefetch_set == 0) ? base->prefetch : add->prefetch;
+    new->prefetch_set = add->prefetch_set || base->prefetch_set;
+    new->explain = (add->explain_set == 0) ? base->explain : add->explain;
+    new->explain_set = add->explain_set || base->explain_set;
+
     new->graph = (add->graph_set == 0) ? base->graph : add->graph;
     new->graph_set = add->graph_set || base->graph_set;
 
@@ -2646,6 +8699,96 @@ static const char *set_rrd_graph_format(cmd_parms *cmd, void *dconf, const char
     return NULL;
 }
 
+static const char *set_rrd_graph_partition(cmd_parms *cmd, void *dconf, const char *partition)
+{
+    rrd_conf *conf = dconf;
+    char *end;
+
+    conf->partition = apr_strtoi64(partition, &end, 10);
+    if (*end || conf->partition < 0) {
+        return apr_pstrcat(cmd->pool, "RRDGraphPartition must be a positive number of seconds, or zero: ", partition, NULL);
+    }
+    conf->partition_set = 1;
+
+    return NULL;
+}
+
+static const char *set_rrd_graph_cache(cmd_parms *cmd, void *dconf, const char *dir, const char *maxage, const char *size)
+{
+    rrd_conf *conf = dconf;
+    char *end;
+
+    if (!strcasecmp(dir, "none")) {
+        conf->cache = NULL;
+    }
+    else {
+        conf->cache = ap_server_root_relative(cmd->pool, dir);
+        if (!conf->cache) {
+            return apr_pstrcat(cmd->pool, "RRDGraphCache has an invalid path: ", dir, NULL);
+        }
+    }
+
+    conf->cache_maxage = apr_time_from_sec(RRD_CACHE_MAXAGE);
+    if (maxage) {
+        apr_int64_t secs = apr_strtoi64(maxage, &end, 10);
+        if (*end || secs < 0) {
+            return apr_pstrcat(cmd->pool, "RRDGraphCache maximum age must be a positive number of seconds, or zero: ", maxage, NULL);
+        }
+        conf->cache_maxage = apr_time_from_sec(secs);
+    }
+
+    conf->cache_size = (apr_off_t)RRD_CACHE_SIZE * 1024 * 1024;
+    if (size) {
+        apr_int64_t megabytes = apr_strtoi64(size, &end, 10);
+        if (*end || megabytes < 1) {
+            return apr_pstrcat(cmd->pool, "RRDGraphCache size must be a positive number of megabytes: ", size, NULL);
+        }
+        conf->cache_size = (apr_off_t)megabytes * 1024 * 1024;
+    }
+    conf->cache_set = 1;
+
+    return NULL;
+}
+
+static const char *set_rrd_graph_degrade(cmd_parms *cmd, void *dconf, const char *tier, const char *queue, const char *wait)
+{
+    rrd_conf *conf = dconf;
+    rrd_degrade_t *degrade;
+    int i;
+
+    for (i = RRD_TIER_STALE; i < RRD_TIER_COUNT; ++i) {
+        if (!strcasecmp(tier, rrd_tiers[i])) {
+            break;
+        }
+    }
+    if (i == RRD_TIER_COUNT) {
+        return apr_pstrcat(cmd->pool, "RRDGraphDegrade tier must be one of stale, fanout, reduce or reject: ", tier, NULL);
+    }
+
+    degrade = &conf->degrade[i];
+    degrade->queue = atoi(queue);
+    degrade->wait = wait ? (apr_interval_time_t) atoi(wait) * 1000 : 0;
+    if (degrade->queue < 0 || degrade->wait < 0) {
+        return apr_pstrcat(cmd->pool, "RRDGraphDegrade queue depth and wait must be positive, or zero: ", queue, " ", wait, NULL);
+    }
+    degrade->set = 1;
+
+    return NULL;
+}
+
+static const char *set_rrd_graph_degrade_fanout(cmd_parms *cmd, void *dconf, const char *fanout)
+{
+    rrd_conf *conf = dconf;
+
+    conf->fanout = atoi(fanout);
+    if (conf->fanout < 1) {
+        return apr_pstrcat(cmd->pool, "RRDGraphDegradeFanout must be a positive number of series: ", fanout, NULL);
+    }
+    conf->fanout_set = 1;
+
+    return NULL;
+}
+
 static const char *set_rrd_graph_option(cmd_parms *cmd, void *dconf, const char *key, const char *val)
 {
     rrd_conf *conf = dconf;
@@ -2734,6 +8877,133 @@ const char *key, const char *val)
     return NULL;
 }
 
+static const char *set_rrd_index(cmd_parms *cmd, void *dconf,
+        const char *root, const char *dir, const char *interval)
+{
+    rrd_server_conf *sconf = ap_get_module_config(cmd->server->module_config,
+            &rrd_module);
+    rrd_index_t *index;
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err) {
+        return err;
+    }
+
+    index = apr_array_push(sconf->indexes);
+    index->root = ap_server_root_relative(cmd->pool, root);
+    index->dir = ap_server_root_relative(cmd->pool, dir);
+    index->interval = apr_time_from_sec(interval ?
+            apr_atoi64(interval) : RRD_INDEX_INTERVAL);
+
+    if (!index->root || !index->dir) {
+        return apr_pstrcat(cmd->pool, "RRDIndex has an invalid path: ", root,
+                " ", dir, NULL);
+    }
+    if (index->interval <= 0) {
+        return apr_pstrcat(cmd->pool, "RRDIndex interval must be a positive "
+                "number of seconds: ", interval, NULL);
+    }
+
+    /* no trailing slashes, sidecar paths are built from the root */
+    while (strlen(index->root) > 1 && index->root[strlen(index->root) - 1] == '/') {
+        index->root = apr_pstrndup(cmd->pool, index->root, strlen(index->root) - 1);
+    }
+
+    return NULL;
+}
+
+static const char *set_rrd_graph_instances(cmd_parms *cmd, void *dconf,
+        const char *instances, const char *library)
+{
+    rrd_server_conf *sconf = ap_get_module_config(cmd->server->module_config,
+            &rrd_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err) {
+        return err;
+    }
+
+    sconf->instances = atoi(instances);
+    if (sconf->instances < 1 || sconf->instances > RRD_INSTANCES_MAX) {
+        return apr_psprintf(cmd->pool, "RRDGraphInstances must be between "
+                "1 and %d: %s", RRD_INSTANCES_MAX, instances);
+    }
+
+    sconf->library = library ? library : RRD_LIBRARY;
+
+    return NULL;
+}
+
+static const char *set_rrd_graph_sketch(cmd_parms *cmd, void *dconf,
+        const char *sketch)
+{
+    rrd_server_conf *sconf = ap_get_module_config(cmd->server->module_config,
+            &rrd_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err) {
+        return err;
+    }
+
+    sconf->sketch = atoi(sketch);
+    if (sconf->sketch < 0) {
+        return apr_pstrcat(cmd->pool, "RRDGraphSketch must be a positive "
+                "number of graphs, or zero: ", sketch, NULL);
+    }
+
+    return NULL;
+}
+
+static const char *set_rrd_graph_cold(cmd_parms *cmd, void *dconf,
+        const char *dir, const char *size)
+{
+#if HAVE_ZSTD
+    rrd_server_conf *sconf = ap_get_module_config(cmd->server->module_config,
+            &rrd_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_int64_t megabytes = size ? apr_atoi64(size) : RRD_COLD_SIZE;
+
+    if (err) {
+        return err;
+    }
+
+    sconf->cold = ap_server_root_relative(cmd->pool, dir);
+    if (!sconf->cold) {
+        return apr_pstrcat(cmd->pool, "RRDGraphCold has an invalid path: ",
+                dir, NULL);
+    }
+    if (megabytes < 1) {
+        return apr_pstrcat(cmd->pool, "RRDGraphCold size must be a positive "
+                "number of megabytes: ", size, NULL);
+    }
+    sconf->cold_size = (apr_off_t)megabytes * 1024 * 1024;
+
+    return NULL;
+#else
+    return "RRDGraphCold is not available, mod_rrd was built without zstd";
+#endif
+}
+
+static const char *set_rrd_graph_prefetch(cmd_parms *cmd, void *dconf, int flag)
+{
+    rrd_conf *conf = dconf;
+
+    conf->prefetch = flag;
+    conf->prefetch_set = 1;
+
+    return NULL;
+}
+
+static const char *set_rrd_graph_explain(cmd_parms *cmd, void *dconf, int flag)
+{
+    rrd_conf *conf = dconf;
+
+    conf->explain = flag;
+    conf->explain_set = 1;
+
+    return NULL;
+}
+
 static const char *set_rrd_graph(cmd_parms *cmd, void *dconf, int flag)
 {
     rrd_conf *conf = dconf;
@@ -2749,27 +9019,54 @@ static const command_rec rrd_cmds[] = {
         "Enable the rrdgraph image generator."),
     AP_INIT_TAKE1("RRDGraphFormat", set_rrd_graph_format, NULL, RSRC_CONF | ACCESS_CONF,
         "Explicitly set the image format. Takes any valid --imgformat value."),
+    AP_INIT_TAKE1("RRDGraphPartition", set_rrd_graph_partition, NULL, RSRC_CONF | ACCESS_CONF,
+        "Render and stream CSV, TSV and SSV exports in partitions of this many seconds. Zero to disable."),
+    AP_INIT_TAKE123("RRDGraphCache", set_rrd_graph_cache, NULL, RSRC_CONF | ACCESS_CONF,
+        "Cache rendered graphs in this directory, fresh for the optional number of seconds and trimmed to the optional size in megabytes, or 'none'."),
+    AP_INIT_TAKE23("RRDGraphDegrade", set_rrd_graph_degrade, NULL, RSRC_CONF | ACCESS_CONF,
+        "Degrade graphs by tier stale, fanout, reduce or reject from this many queued renders, or from the optional average lock wait in milliseconds."),
+    AP_INIT_TAKE1("RRDGraphDegradeFanout", set_rrd_graph_degrade_fanout, NULL, RSRC_CONF | ACCESS_CONF,
+        "The number of series a wildcard keeps under the fanout tier, the rest are summed as other."),
+    AP_INIT_FLAG("RRDGraphPrefetch", set_rrd_graph_prefetch, NULL, RSRC_CONF | ACCESS_CONF,
+        "Render the windows either side of a graph and the window zoomed out into the RRDGraphCache in the background. Needs RRDGraphInstances of two or more."),
+    AP_INIT_FLAG("RRDGraphExplain", set_rrd_graph_explain, NULL, RSRC_CONF | ACCESS_CONF,
+        "Answer names ending in .explain.json with the plan of the graph. Off by default."),
     AP_INIT_TAKE12("RRDGraphOption", set_rrd_graph_option, NULL, RSRC_CONF | ACCESS_CONF,
         "Options for the rrdgraph image generator."),
     AP_INIT_TAKE123("RRDGraphElement", set_rrd_graph_element, NULL, RSRC_CONF | ACCESS_CONF,
         "Elements for the rrdgraph image generator. If specified, an optional expression can be set for the legend where appropriate."),
     AP_INIT_TAKE2("RRDGraphEnv", set_rrd_graph_env, NULL, RSRC_CONF | ACCESS_CONF,
-        "Summarise environment variables from the RRD file requests."), { NULL }
+        "Summarise environment variables from the RRD file requests."),
+    AP_INIT_TAKE12("RRDGraphInstances", set_rrd_graph_instances, NULL, RSRC_CONF,
+        "Number of copies of librrd to render graphs with in parallel, each loaded into its own namespace, and the optional name of the librrd shared library."),
+    AP_INIT_TAKE1("RRDGraphSketch", set_rrd_graph_sketch, NULL, RSRC_CONF,
+        "Number of the most expensive graph specs to track in shared memory, for the rrd-status handler and mod_status. Zero to disable."),
+    AP_INIT_TAKE12("RRDGraphCold", set_rrd_graph_cold, NULL, RSRC_CONF,
+        "Decompress cold RRD archives ending in .rrd.zst into this directory, keeping at most the optional number of megabytes."),
+    AP_INIT_TAKE23("RRDIndex", set_rrd_index, NULL, RSRC_CONF,
+        "Maintain summary sidecars in the second directory for all RRD files below the first directory, checking for changes at the optional interval in seconds."),
+    { NULL }
 };
 
 static void register_hooks(apr_pool_t *p)
 {
+    ap_hook_pre_config(rrd_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(rrd_post_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_child_init(rrd_child_init,NULL,NULL,APR_HOOK_MIDDLE);
     ap_hook_fixups(rrd_fixups, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_handler(rrd_handler, NULL, NULL, APR_HOOK_FIRST);
+    ap_hook_handler(rrd_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, rrd_status_hook, NULL, NULL,
+            APR_HOOK_MIDDLE);
+    ap_register_provider(p, PROXY_LBMETHOD, "rrd", "0", &rrd_lbmethod);
 }
 
 AP_DECLARE_MODULE(rrd) = {
     STANDARD20_MODULE_STUFF,
     create_rrd_config, /* create per-directory config structure */
     merge_rrd_config, /* merge per-directory config structures */
-    NULL, /* create per-server config structure */
-    NULL, /* merge per-server config structures */
+    create_rrd_server_config, /* create per-server config structure */
+    merge_rrd_server_config, /* merge per-server config structures */
     rrd_cmds, /* command apr_table_t */
     register_hooks /* register hooks */
 };
@@ -0,0 +1,143 @@
+#!/bin/sh
+#
+# Smoke tests for paging, duplicate DEFs, threshold checks and the rrd
+# load balancer method, run against a configured httpd with curl and
+# rrdtool.
+#
+# RRD_DIR is a writable directory served by mod_rrd at RRD_URL, with
+# RRDGraph on and RRDGraphExplain on:
+#
+#   RRD_DIR=/var/lib/collectd/rrd RRD_URL=http://localhost/rrd sh test/smoke.sh
+#
+# RRD_BALANCER is optionally the same directory proxied through a
+# frontend with lbmethod=rrd, which names the backend chosen:
+#
+#   Header always set X-RRD-Backend "%{BALANCER_WORKER_NAME}e"
+#
+# Each backend must serve the same files.
+#
+
+if test -z "$RRD_DIR" || test -z "$RRD_URL"; then
+  echo "RRD_DIR and RRD_URL must be set, skipping"
+  exit 77
+fi
+
+DIR="$RRD_DIR/smoke.$$"
+URL="$RRD_URL/smoke.$$"
+TMP=`mktemp -d` || exit 1
+FAILED=0
+
+trap 'rm -rf "$DIR" "$TMP"' 0
+
+fail() {
+  echo "FAIL: $1"
+  FAILED=1
+}
+
+pass() {
+  echo "PASS: $1"
+}
+
+# create a gauge, with its last value given now
+rrd() {
+  rrdtool create "$DIR/$1.rrd" --start now-600 --step 60 \
+    DS:value:GAUGE:120:U:U RRA:AVERAGE:0.5:1:60 RRA:LAST:0.5:1:60 &&
+  rrdtool update "$DIR/$1.rrd" N:$2
+}
+
+# fetch a url, keeping the headers and body apart
+fetch() {
+  curl -s -D "$TMP/headers" -o "$TMP/body" -w '%{http_code}' "$@"
+}
+
+header() {
+  tr -d '\r' < "$TMP/headers" | grep -i "^$1:" | sed 's/^[^:]*: *//'
+}
+
+mkdir -p "$DIR" || exit 1
+for i in 1 2 3 4 5; do
+  rrd host$i ${i}0 || exit 1
+done
+
+DEF='DEF:v=host*.rrd:value:AVERAGE'
+
+# paging: five files two at a time give three pages, the last without
+# a cursor
+pages=0
+next="$URL/page.csv?$DEF&LINE1:v%2300ff00:value&limit=2"
+while test -n "$next"; do
+  status=`fetch "$next"`
+  if test "$status" != 200; then
+    fail "page $pages returned $status"
+    break
+  fi
+  pages=`expr $pages + 1`
+  cursor=`header X-RRD-Cursor`
+  link=`header Link | sed -n 's/^<\([^>]*\)>; rel="next"$/\1/p'`
+  if test -n "$cursor" && test -z "$link"; then
+    fail "page $pages has a cursor but no Link header"
+    break
+  fi
+  if test "$pages" = 1; then
+    first="$cursor"
+  fi
+  next=""
+  if test -n "$link"; then
+    next="`echo "$URL" | sed 's#^\([a-z]*://[^/]*\).*#\1#'`$link"
+  fi
+done
+test "$pages" = 3 && pass "paging" || fail "paging gave $pages pages, not 3"
+
+# a changed set of files invalidates the cursor
+rrd host6 60 || exit 1
+status=`fetch "$URL/page.csv?$DEF&LINE1:v%2300ff00:value&limit=2&cursor=$first"`
+test "$status" = 409 && pass "stale cursor" || fail "stale cursor returned $status"
+rm -f "$DIR/host6.rrd"
+
+# dedup: the same path, data source and function is matched once
+status=`fetch "$URL/dedup.explain.json?$DEF&DEF:w=host*.rrd:value:AVERAGE"`
+if test "$status" != 200; then
+  fail "explain returned $status, is RRDGraphExplain on?"
+elif ! grep -q '"vname":"w",[^]]*"alias":"v"' "$TMP/body"; then
+  fail "duplicate DEF not aliased: `cat "$TMP/body"`"
+elif ! grep -q '"cost":{"files":5,' "$TMP/body"; then
+  fail "duplicate DEF counted twice: `cat "$TMP/body"`"
+else
+  pass "dedup"
+fi
+
+# checks: one rule breached by two files, one with no breach, one that
+# matches nothing
+status=`fetch --data-binary @- "$URL/smoke.check.json" <<EOT
+host*.rrd value LAST 300 gt 30
+host*.rrd value LAST 300 gt 100
+nothing*.rrd value LAST 300 gt 0
+EOT
+`
+if test "$status" != 200; then
+  fail "check returned $status"
+elif ! grep -q '"ok":1,"critical":1,"unknown":1}' "$TMP/body"; then
+  fail "check totals wrong: `cat "$TMP/body"`"
+elif test "`grep -o '"status":"critical"' "$TMP/body" | wc -l`" -ne 3; then
+  fail "check breaches wrong: `cat "$TMP/body"`"
+else
+  pass "check"
+fi
+
+# balancing: the same DEFs go to the same backend, whatever the other
+# options and however malformed
+if test -n "$RRD_BALANCER"; then
+  BALANCER="$RRD_BALANCER/smoke.$$"
+  backends=""
+  for query in "$DEF" "$DEF&start=-1h" "title=x&$DEF" "$DEF&LINE1:v%2300ff00:value" \
+      "$DEF&nonsense=" "$DEF&VDEF:"; do
+    fetch "$BALANCER/balance.png?$query" >/dev/null
+    backends="$backends
+`header X-RRD-Backend`"
+  done
+  count=`echo "$backends" | sed '/^$/d' | sort -u | wc -l`
+  test "$count" -eq 1 && pass "balancer key" \
+    || fail "balancer key spread over backends:$backends"
+fi
+
+exit $FAILED